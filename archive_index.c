@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive_index.h"
+#include "archive_reader.h"
+#include "io_util.h"
+#include "stats.h"
+
+#define MAX_PATH_LEN 4096
+
+// Layout of the fixed-size block at the start of an index file. It is followed
+// by 'num_entries' index_entry_t records and then 'names_len' bytes of names.
+typedef struct {
+    char magic[8];
+    // Size of the archive when the index was written
+    uint64_t archive_size;
+    uint64_t num_entries;
+    uint64_t names_len;
+    // Hash of the newest member's header block, 0 for an empty archive
+    uint64_t last_header_hash;
+    // Hash over the entry records and the names
+    uint64_t checksum;
+} index_file_header_t;
+
+// FNV-1a hash of 'len' bytes, continuing from 'hash'
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+static uint64_t hash_string(const char *name) {
+    return fnv1a(FNV_OFFSET_BASIS, name, strlen(name));
+}
+
+// Checksum stored in the index file, covering entries and names
+static uint64_t index_checksum(const archive_index_t *index) {
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, index->entries, index->num_entries * sizeof(index_entry_t));
+    return fnv1a(hash, index->names, index->names_len);
+}
+
+// Build the name of the index file for 'archive_name' into 'path'
+// Returns 0 on success, -1 if the name does not fit
+static int index_path(const char *archive_name, char *path) {
+    if (snprintf(path, MAX_PATH_LEN, "%s%s", archive_name, INDEX_SUFFIX) >= MAX_PATH_LEN) {
+        fprintf(stderr, "Error: archive name %s is too long\n", archive_name);
+        return -1;
+    }
+    return 0;
+}
+
+// Find the slot of 'latest' holding 'name', or the empty slot where it would go
+static size_t find_slot(const archive_index_t *index, const char *name) {
+    size_t mask = index->latest_capacity - 1;
+    size_t slot = hash_string(name) & mask;
+    while (index->latest[slot] != 0) {
+        const index_entry_t *entry = &index->entries[index->latest[slot] - 1];
+        if (strcmp(archive_index_name(index, entry), name) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+// Double the size of the name table, rehashing every name
+// Returns 0 on success, -1 if memory could not be allocated
+static int grow_latest(archive_index_t *index) {
+    archive_index_t grown = *index;
+    grown.latest_capacity = index->latest_capacity == 0 ? 64 : 2 * index->latest_capacity;
+    grown.latest = calloc(grown.latest_capacity, sizeof(uint32_t));
+    if (grown.latest == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < index->latest_capacity; i++) {
+        if (index->latest[i] != 0) {
+            const index_entry_t *entry = &index->entries[index->latest[i] - 1];
+            grown.latest[find_slot(&grown, archive_index_name(index, entry))] = index->latest[i];
+        }
+    }
+    free(index->latest);
+    index->latest = grown.latest;
+    index->latest_capacity = grown.latest_capacity;
+    return 0;
+}
+
+void archive_index_init(archive_index_t *index) {
+    memset(index, 0, sizeof(archive_index_t));
+}
+
+void archive_index_free(archive_index_t *index) {
+    free(index->entries);
+    free(index->names);
+    free(index->latest);
+    archive_index_init(index);
+}
+
+const char *archive_index_name(const archive_index_t *index, const index_entry_t *entry) {
+    return index->names + entry->name_offset;
+}
+
+/*
+ * Records entry number 'i' (already in 'entries') as the newest version of its
+ * name, setting its version number from the previous newest one.
+ * Returns 0 on success, -1 if memory could not be allocated
+ */
+static int index_latest(archive_index_t *index, size_t i) {
+    // Keep the table at most half full so probe sequences stay short
+    if (2 * (index->num_names + 1) > index->latest_capacity && grow_latest(index)) {
+        return -1;
+    }
+    index_entry_t *entry = &index->entries[i];
+    size_t slot = find_slot(index, archive_index_name(index, entry));
+    if (index->latest[slot] == 0) {
+        entry->version = 1;
+        index->num_names++;
+    } else {
+        entry->version = index->entries[index->latest[slot] - 1].version + 1;
+    }
+    index->latest[slot] = i + 1;
+    return 0;
+}
+
+int archive_index_add(archive_index_t *index, const char *name, off_t header_offset,
+                      off_t data_offset, off_t size, off_t real_size, time_t mtime,
+                      uint32_t flags, const char *link_name) {
+    // Grow the entry and name arrays geometrically
+    if (index->num_entries == index->entries_capacity) {
+        size_t capacity = index->entries_capacity == 0 ? 64 : 2 * index->entries_capacity;
+        index_entry_t *entries = realloc(index->entries, capacity * sizeof(index_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        index->entries = entries;
+        index->entries_capacity = capacity;
+    }
+    size_t name_len = strlen(name) + 1;
+    if (index->names_len + name_len > index->names_capacity) {
+        size_t capacity = index->names_capacity == 0 ? 4096 : 2 * index->names_capacity;
+        while (capacity < index->names_len + name_len) {
+            capacity *= 2;
+        }
+        char *names = realloc(index->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        index->names = names;
+        index->names_capacity = capacity;
+    }
+
+    index_entry_t *entry = &index->entries[index->num_entries];
+    memset(entry, 0, sizeof(index_entry_t));
+    entry->header_offset = header_offset;
+    entry->data_offset = data_offset;
+    entry->size = size;
+    entry->real_size = real_size;
+    entry->mtime = mtime;
+    entry->flags = flags;
+    if (link_name != NULL) {
+        const index_entry_t *target = archive_index_lookup(index, link_name);
+        entry->flags |= INDEX_ENTRY_LINK;
+        entry->link_target = target != NULL ? target - index->entries + 1 : 0;
+    }
+    entry->name_offset = index->names_len;
+    memcpy(index->names + index->names_len, name, name_len);
+    index->names_len += name_len;
+    index->num_entries++;
+
+    if (index_latest(index, index->num_entries - 1)) {
+        index->num_entries--;
+        index->names_len -= name_len;
+        return -1;
+    }
+    return 0;
+}
+
+const index_entry_t *archive_index_lookup(const archive_index_t *index, const char *name) {
+    if (index->latest_capacity == 0) {
+        return NULL;
+    }
+    uint32_t i = index->latest[find_slot(index, name)];
+    return i == 0 ? NULL : &index->entries[i - 1];
+}
+
+int archive_index_exists(const char *archive_name) {
+    char path[MAX_PATH_LEN];
+    if (strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0 || index_path(archive_name, path)) {
+        return 0;
+    }
+    return access(path, F_OK) == 0;
+}
+
+/*
+ * Computes the hash of the newest member's header block in the archive open in
+ * 'reader', which is what ties an index to one particular state of an archive.
+ * Returns 0 on success or -1 if the block could not be read
+ */
+static int last_header_hash(const archive_index_t *index, archive_reader_t *reader, uint64_t *hash) {
+    *hash = 0;
+    if (index->num_entries == 0) {
+        return 0;
+    }
+    char block[BLOCK_SIZE];
+    off_t offset = index->entries[index->num_entries - 1].header_offset;
+    if (archive_reader_read_at(reader, offset, block, BLOCK_SIZE)) {
+        return -1;
+    }
+    *hash = fnv1a(FNV_OFFSET_BASIS, block, BLOCK_SIZE);
+    return 0;
+}
+
+/*
+ * Does the work of archive_index_load, which times it for --stats
+ */
+static int load_index(archive_index_t *index, const char *archive_name) {
+    // Streamed archives never have an index
+    char path[MAX_PATH_LEN];
+    if (strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0) {
+        return 1;
+    }
+    if (index_path(archive_name, path)) {
+        return -1;
+    }
+
+    // No index at all is not an error, the caller just scans the archive
+    FILE *index_file = fopen(path, "r");
+    if (index_file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        perror("Error opening index file");
+        return -1;
+    }
+
+    index_file_header_t file_header;
+    if (fread(&file_header, sizeof(file_header), 1, index_file) != 1 ||
+        memcmp(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic)) != 0 ||
+        file_header.names_len > UINT32_MAX) {
+        fclose(index_file);
+        return 1;
+    }
+
+    // Cheapest check first: an archive that changed size has changed
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        fclose(index_file);
+        return -1;
+    }
+    struct stat stat_buf;
+    if (fstat(reader.fd, &stat_buf) == -1 || (uint64_t) stat_buf.st_size != file_header.archive_size) {
+        archive_reader_close(&reader);
+        fclose(index_file);
+        return 1;
+    }
+
+    index->entries = malloc(file_header.num_entries * sizeof(index_entry_t) + 1);
+    index->names = malloc(file_header.names_len + 1);
+    if (index->entries == NULL || index->names == NULL) {
+        perror("Error allocating index");
+        archive_reader_close(&reader);
+        fclose(index_file);
+        archive_index_free(index);
+        return -1;
+    }
+    index->entries_capacity = file_header.num_entries;
+    index->names_capacity = file_header.names_len + 1;
+
+    int valid = fread(index->entries, sizeof(index_entry_t), file_header.num_entries, index_file) ==
+                file_header.num_entries &&
+                fread(index->names, 1, file_header.names_len, index_file) == file_header.names_len;
+    fclose(index_file);
+    index->num_entries = file_header.num_entries;
+    index->names_len = file_header.names_len;
+
+    // The contents have to hash to the recorded checksum, every name has to be
+    // in bounds, every link has to point back to an earlier entry, and the
+    // newest header in the archive has to be the indexed one
+    uint64_t hash;
+    valid = valid && index_checksum(index) == file_header.checksum &&
+            (index->names_len == 0 || index->names[index->names_len - 1] == '\0');
+    for (size_t i = 0; valid && i < index->num_entries; i++) {
+        valid = index->entries[i].name_offset < index->names_len && index->entries[i].link_target <= i;
+    }
+    valid = valid && last_header_hash(index, &reader, &hash) == 0 && hash == file_header.last_header_hash;
+    archive_reader_close(&reader);
+
+    // Rebuild the name lookup table, which is not stored on disk
+    for (size_t i = 0; valid && i < index->num_entries; i++) {
+        if (index_latest(index, i)) {
+            perror("Error allocating index");
+            archive_index_free(index);
+            return -1;
+        }
+    }
+    if (!valid) {
+        archive_index_free(index);
+        return 1;
+    }
+    return 0;
+}
+
+int archive_index_load(archive_index_t *index, const char *archive_name) {
+    stats_phase_t outer = stats_enter(STATS_PHASE_INDEX);
+    int ret = load_index(index, archive_name);
+    stats_leave(outer);
+    return ret;
+}
+
+/*
+ * Does the work of archive_index_build, which times it for --stats
+ */
+static int build_index(archive_index_t *index, const char *archive_name) {
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        return -1;
+    }
+
+    int ret;
+    while ((ret = archive_reader_next(&reader)) == 1) {
+        if (archive_index_add(index, reader.name, reader.header_offset, reader.data_offset,
+                              reader.data_size, reader.real_size, reader.mtime,
+                              reader.sparse ? INDEX_ENTRY_SPARSE : 0,
+                              reader.hard_link ? reader.link_name : NULL)) {
+            perror("Error adding member to index");
+            ret = -1;
+            break;
+        }
+    }
+
+    archive_reader_close(&reader);
+    return ret;
+}
+
+int archive_index_build(archive_index_t *index, const char *archive_name) {
+    stats_phase_t outer = stats_enter(STATS_PHASE_INDEX);
+    int ret = build_index(index, archive_name);
+    stats_leave(outer);
+    return ret;
+}
+
+/*
+ * Does the work of archive_index_save, which times it for --stats
+ */
+static int save_index(const archive_index_t *index, const char *archive_name) {
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN + 4];
+    if (index_path(archive_name, path)) {
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    // Stamp the index with the archive state it describes
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        return -1;
+    }
+    index_file_header_t file_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memcpy(file_header.magic, INDEX_MAGIC, sizeof(file_header.magic));
+    struct stat stat_buf;
+    if (fstat(reader.fd, &stat_buf) == -1 ||
+        last_header_hash(index, &reader, &file_header.last_header_hash)) {
+        fprintf(stderr, "Error inspecting tar file\n");
+        archive_reader_close(&reader);
+        return -1;
+    }
+    archive_reader_close(&reader);
+    file_header.archive_size = stat_buf.st_size;
+    file_header.num_entries = index->num_entries;
+    file_header.names_len = index->names_len;
+    file_header.checksum = index_checksum(index);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("Error opening index file");
+        return -1;
+    }
+    if (write_all(fd, &file_header, sizeof(file_header)) ||
+        write_all(fd, index->entries, index->num_entries * sizeof(index_entry_t)) ||
+        write_all(fd, index->names, index->names_len)) {
+        perror("Error writing index file");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    if (close(fd) || rename(tmp_path, path)) {
+        perror("Error saving index file");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int archive_index_save(const archive_index_t *index, const char *archive_name) {
+    stats_phase_t outer = stats_enter(STATS_PHASE_INDEX);
+    int ret = save_index(index, archive_name);
+    stats_leave(outer);
+    return ret;
+}
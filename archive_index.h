@@ -0,0 +1,107 @@
+#ifndef _ARCHIVE_INDEX_H
+#define _ARCHIVE_INDEX_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Suffix appended to an archive's name to get the name of its index file
+#define INDEX_SUFFIX ".idx"
+#define INDEX_MAGIC "MTIDX03"
+
+// index_entry_t flags
+// The member is a sparse file, whose data starts with a map of its segments
+#define INDEX_ENTRY_SPARSE 0x1
+// The member is a hard link (see 'link_target')
+#define INDEX_ENTRY_LINK 0x2
+
+// One member of an archive, as recorded in its index (stored as-is on disk)
+typedef struct {
+    // Offset of the member's first header block, and of its data
+    uint64_t header_offset;
+    uint64_t data_offset;
+    // Size of the member's data in bytes, the size of the file it holds
+    // (larger for a sparse file, whose holes aren't stored), and its
+    // modification time
+    uint64_t size;
+    uint64_t real_size;
+    int64_t mtime;
+    // 1 for the first member with this name, 2 for the next one, and so on
+    uint32_t version;
+    // Offset of the member's null-terminated name within the index's names
+    uint32_t name_offset;
+    // INDEX_ENTRY_* flags
+    uint32_t flags;
+    // For a hard link, 1 + the number of the entry it links to: the newest
+    // one before it with its link name. 0 otherwise, or if there is none.
+    uint32_t link_target;
+} index_entry_t;
+
+// In-memory index of every member of an archive, in archive order
+typedef struct {
+    index_entry_t *entries;
+    size_t num_entries;
+    size_t entries_capacity;
+    // Null-terminated member names, back to back
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+    // Open-addressing hash table from name to (1 + index of its newest entry),
+    // 0 marks an empty slot. The number of slots is a power of two.
+    uint32_t *latest;
+    size_t latest_capacity;
+    size_t num_names;
+} archive_index_t;
+
+// Initialize a new, empty index
+void archive_index_init(archive_index_t *index);
+
+// Free all memory held by the index and leave it empty
+void archive_index_free(archive_index_t *index);
+
+// Name of entry 'entry' of 'index'
+const char *archive_index_name(const archive_index_t *index, const index_entry_t *entry);
+
+/*
+ * Record a new member at the end of the index. Its version number is one more
+ * than that of the newest existing entry with the same name. 'real_size' is
+ * the size of the file the member holds, which only differs from 'size' for a
+ * sparse file ('flags' holds INDEX_ENTRY_* flags). If 'link_name' is not NULL
+ * the member is a hard link to the newest entry by that name.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int archive_index_add(archive_index_t *index, const char *name, off_t header_offset,
+                      off_t data_offset, off_t size, off_t real_size, time_t mtime,
+                      uint32_t flags, const char *link_name);
+
+// Newest entry for 'name', or NULL if no member has that name
+const index_entry_t *archive_index_lookup(const archive_index_t *index, const char *name);
+
+// Determine whether an index file exists next to 'archive_name'
+// (never true for an archive streamed through standard input or output)
+int archive_index_exists(const char *archive_name);
+
+/*
+ * Load the index file that belongs to 'archive_name' into an empty 'index'.
+ * The index is only used if its checksum is intact, the archive still has the
+ * size recorded in it, and the newest member's header block is unchanged, so a
+ * stale index left behind by some other tool is never trusted.
+ * Returns 0 if a valid index was loaded, 1 if there is no usable index (the
+ * caller should fall back to scanning the archive), or -1 on error.
+ */
+int archive_index_load(archive_index_t *index, const char *archive_name);
+
+/*
+ * Fill an empty 'index' by scanning every header of 'archive_name'.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_index_build(archive_index_t *index, const char *archive_name);
+
+/*
+ * Write 'index' to the index file of 'archive_name', stamped with the current
+ * size of the archive. The file is written under a temporary name and renamed
+ * into place, so readers never see a partial index.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_index_save(const archive_index_t *index, const char *archive_name);
+
+#endif
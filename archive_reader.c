@@ -0,0 +1,850 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive_reader.h"
+#include "header_simd.h"
+#include "io_util.h"
+#include "stats.h"
+
+// Largest value an off_t can hold
+#define OFF_MAX ((off_t) ((1ULL << (sizeof(off_t) * CHAR_BIT - 1)) - 1))
+
+long long parse_numeric(const char *field, size_t len) {
+    // Base-256: the rest of the first byte, then every other byte. A set
+    // second-highest bit would make the value negative.
+    const unsigned char *bytes = (const unsigned char *) field;
+    if (len > 0 && (bytes[0] & 0x80)) {
+        if (bytes[0] & 0x40) {
+            return -1;
+        }
+        long long value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) {
+            if (value > (LLONG_MAX >> 8)) {
+                return -1;
+            }
+            value = (value << 8) | bytes[i];
+        }
+        return value;
+    }
+
+    return parse_octal(field, len);
+}
+
+/*
+ * Checks the checksum recorded in 'header' against its contents. Like GNU
+ * tar, a sum over signed bytes is accepted too, which some old tar programs
+ * (and minitar itself, before it was fixed) wrote for headers with bytes of
+ * 0x80 and up.
+ * Returns 1 if the checksum matches or 0 if it doesn't
+ */
+static int header_checksum_matches(const tar_header *header) {
+    long long recorded = parse_octal(header->chksum, sizeof(header->chksum));
+    unsigned sum = header_checksum(header);
+    if (recorded == sum) {
+        return 1;
+    }
+    // Every byte of 0x80 and up counts 256 less when signed
+    const unsigned char *bytes = (const unsigned char *) header;
+    int signed_sum = sum;
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        if (bytes[i] >= 0x80 && (i < HEADER_CHKSUM_OFFSET || i >= HEADER_CHKSUM_OFFSET + HEADER_CHKSUM_LEN)) {
+            signed_sum -= 256;
+        }
+    }
+    return recorded == signed_sum;
+}
+
+/*
+ * Makes sure the archive bytes in [offset, offset + len) are mapped, moving
+ * the window if needed. 'len' must not exceed READER_WINDOW_SIZE.
+ * Returns a pointer to the byte at 'offset', or NULL if an error occurs
+ */
+static const char *map_range(archive_reader_t *reader, off_t offset, size_t len) {
+    if (reader->window != NULL && offset >= reader->window_start &&
+        offset + len <= reader->window_start + reader->window_len) {
+        return reader->window + (offset - reader->window_start);
+    }
+
+    if (reader->window != NULL) {
+        munmap(reader->window, reader->window_len);
+        reader->window = NULL;
+    }
+
+    // mmap offsets have to be page aligned
+    off_t page_size = sysconf(_SC_PAGESIZE);
+    off_t start = offset - offset % page_size;
+    off_t end = start + READER_WINDOW_SIZE;
+    if (end > reader->archive_size) {
+        end = reader->archive_size;
+    }
+
+    STATS_SYSCALL(STATS_SYS_MMAP, 0, 0);
+    void *window = mmap(NULL, end - start, PROT_READ, MAP_SHARED, reader->fd, start);
+    if (window == MAP_FAILED) {
+        perror("Error mapping archive");
+        return NULL;
+    }
+    // Advice is only a hint, so a failure here is not an error
+    madvise(window, end - start, reader->advice);
+
+    reader->window = window;
+    reader->window_start = start;
+    reader->window_len = end - start;
+    return reader->window + (offset - start);
+}
+
+/*
+ * Refills the streaming buffer, discarding whatever was in it. Compressed
+ * streams are decompressed on the way in.
+ * Returns the number of bytes read, 0 at end of file, or -1 on error
+ */
+static ssize_t stream_refill(archive_reader_t *reader) {
+    reader->stream_buf_pos = 0;
+    reader->stream_buf_len = 0;
+    if (reader->inflater != NULL) {
+        ssize_t bytes_read = inflate_stream_read(reader->inflater, reader->fd, reader->stream_buf,
+                                                 READER_STREAM_BUF_SIZE);
+        if (bytes_read > 0) {
+            reader->stream_buf_len = bytes_read;
+        }
+        return bytes_read;
+    }
+    while (1) {
+        ssize_t bytes_read = read(reader->fd, reader->stream_buf, READER_STREAM_BUF_SIZE);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        STATS_SYSCALL(STATS_SYS_READ, bytes_read > 0 ? bytes_read : 0, 0);
+        if (bytes_read == -1) {
+            perror("Error reading tar file");
+        }
+        if (bytes_read > 0) {
+            reader->stream_buf_len = bytes_read;
+        }
+        return bytes_read;
+    }
+}
+
+/*
+ * Streaming mode: reads and discards archive bytes up to 'offset', using the
+ * whole buffer for each read so large skips cost few syscalls.
+ * Returns 0 on success, 1 if the archive ended first, or -1 on error
+ */
+static int stream_skip_to(archive_reader_t *reader, off_t offset) {
+    if (offset < reader->stream_pos) {
+        fprintf(stderr, "Error: can't seek backwards in a streamed archive\n");
+        return -1;
+    }
+    while (reader->stream_pos < offset) {
+        if (reader->stream_buf_pos == reader->stream_buf_len) {
+            ssize_t bytes_read = stream_refill(reader);
+            if (bytes_read <= 0) {
+                return bytes_read == 0 ? 1 : -1;
+            }
+        }
+        size_t avail = reader->stream_buf_len - reader->stream_buf_pos;
+        size_t step = offset - reader->stream_pos < avail ? offset - reader->stream_pos : avail;
+        reader->stream_buf_pos += step;
+        reader->stream_pos += step;
+    }
+    return 0;
+}
+
+/*
+ * Streaming mode: moves the next 'nbytes' archive bytes to 'out_fd', or into
+ * 'dest' if 'out_fd' is -1.
+ * Returns 0 on success, 1 if the archive ended first, or -1 on error
+ */
+static int stream_consume(archive_reader_t *reader, off_t nbytes, int out_fd, char *dest) {
+    while (nbytes > 0) {
+        if (reader->stream_buf_pos == reader->stream_buf_len) {
+            ssize_t bytes_read = stream_refill(reader);
+            if (bytes_read <= 0) {
+                return bytes_read == 0 ? 1 : -1;
+            }
+        }
+        size_t avail = reader->stream_buf_len - reader->stream_buf_pos;
+        size_t step = nbytes < avail ? nbytes : avail;
+        const char *src = reader->stream_buf + reader->stream_buf_pos;
+        if (out_fd == -1) {
+            memcpy(dest, src, step);
+            dest += step;
+        } else if (write_all(out_fd, src, step)) {
+            perror("Error writing data to data file from archive");
+            return -1;
+        }
+        reader->stream_buf_pos += step;
+        reader->stream_pos += step;
+        nbytes -= step;
+    }
+    return 0;
+}
+
+/*
+ * Compressed mode: makes sure frame 'i' is decompressed into the frame buffer.
+ * Returns a pointer to the frame's first byte, or NULL if an error occurs
+ */
+static const char *load_frame(archive_reader_t *reader, size_t i) {
+    if (reader->cached_frame == i + 1) {
+        return reader->frame_buf;
+    }
+    const frame_info_t *frame = &reader->frames.frames[i];
+    if (frame->uncompressed_size > reader->frame_buf_capacity) {
+        char *frame_buf = realloc(reader->frame_buf, frame->uncompressed_size);
+        if (frame_buf == NULL) {
+            perror("Error allocating decompression buffer");
+            return NULL;
+        }
+        reader->frame_buf = frame_buf;
+        reader->frame_buf_capacity = frame->uncompressed_size;
+    }
+    reader->cached_frame = 0;
+    if (frame_decompress(reader->fd, frame, reader->frame_buf)) {
+        return NULL;
+    }
+    reader->cached_frame = i + 1;
+    return reader->frame_buf;
+}
+
+/*
+ * Compressed mode: moves the 'nbytes' archive bytes starting at 'offset' to
+ * 'out_fd', or into 'dest' if 'out_fd' is -1. Only the frames overlapping the
+ * range are decompressed.
+ * Returns 0 on success or -1 on error
+ */
+static int frames_copy(archive_reader_t *reader, off_t offset, off_t nbytes, int out_fd, char *dest) {
+    size_t i = frame_table_find(&reader->frames, offset);
+    while (nbytes > 0) {
+        const frame_info_t *frame = &reader->frames.frames[i];
+        const char *data = load_frame(reader, i);
+        if (data == NULL) {
+            return -1;
+        }
+        size_t start = offset - frame->uncompressed_offset;
+        size_t step = frame->uncompressed_size - start;
+        if (step > nbytes) {
+            step = nbytes;
+        }
+        if (out_fd == -1) {
+            memcpy(dest, data + start, step);
+            dest += step;
+        } else if (write_all(out_fd, data + start, step)) {
+            perror("Error writing data to data file from archive");
+            return -1;
+        }
+        offset += step;
+        nbytes -= step;
+        i++;
+    }
+    return 0;
+}
+
+int archive_reader_open(archive_reader_t *reader, const char *archive_name, int advice) {
+    // Open tar file and error check
+    int fd;
+    if (strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0) {
+        fd = dup(STDIN_FILENO);
+    } else {
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        fd = open(archive_name, O_RDONLY);
+    }
+    if (fd == -1) {
+        perror("Error opening tar file");
+        return -1;
+    }
+    return archive_reader_open_fd(reader, fd, advice);
+}
+
+int archive_reader_open_fd(archive_reader_t *reader, int fd, int advice) {
+    memset(reader, 0, sizeof(archive_reader_t));
+    reader->fd = fd;
+    reader->advice = advice;
+
+    struct stat stat_buf;
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    if (fstat(reader->fd, &stat_buf) == -1) {
+        perror("Error inspecting tar file");
+        close(reader->fd);
+        return -1;
+    }
+    reader->archive_size = stat_buf.st_size;
+    int streaming = !S_ISREG(stat_buf.st_mode);
+
+    // A compressed file is read through its frame table if it has one, and
+    // decompressed front to back as a stream otherwise
+    unsigned char magic[2];
+    if (!streaming && pread(reader->fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        is_compressed(magic, sizeof(magic))) {
+        int ret = frame_table_load(reader->fd, &reader->frames);
+        if (ret == 0) {
+            reader->compressed = 1;
+            reader->archive_size = reader->frames.uncompressed_size;
+        } else if (ret == 1) {
+            streaming = 1;
+            reader->inflater = inflate_stream_new(NULL, 0);
+        }
+        if (ret == -1 || (ret == 1 && reader->inflater == NULL)) {
+            archive_reader_close(reader);
+            return -1;
+        }
+    }
+
+    // Anything but a regular file has to be read as a stream
+    if (streaming) {
+        reader->streaming = 1;
+        reader->archive_size = INT64_MAX;
+        reader->stream_buf = malloc(READER_STREAM_BUF_SIZE);
+        if (reader->stream_buf == NULL) {
+            perror("Error allocating read buffer");
+            archive_reader_close(reader);
+            return -1;
+        }
+    }
+
+    // A pipe can't be peeked at, so check its first bytes once they are buffered
+    if (streaming && reader->inflater == NULL) {
+        while (reader->stream_buf_len < sizeof(magic)) {
+            ssize_t bytes_read = read(reader->fd, reader->stream_buf + reader->stream_buf_len,
+                                      READER_STREAM_BUF_SIZE - reader->stream_buf_len);
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            STATS_SYSCALL(STATS_SYS_READ, bytes_read > 0 ? bytes_read : 0, 0);
+            if (bytes_read == -1) {
+                perror("Error reading tar file");
+                archive_reader_close(reader);
+                return -1;
+            }
+            if (bytes_read == 0) {
+                break;
+            }
+            reader->stream_buf_len += bytes_read;
+        }
+        if (is_compressed(reader->stream_buf, reader->stream_buf_len)) {
+            reader->inflater = inflate_stream_new(reader->stream_buf, reader->stream_buf_len);
+            reader->stream_buf_len = 0;
+            if (reader->inflater == NULL) {
+                archive_reader_close(reader);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads the header block at 'offset' into the reader, or finds it in the
+ * mapping.
+ * Returns the block, or NULL at the end of the archive ('*eof' is then set)
+ * or if an error occurs
+ */
+static const tar_header *read_header_block(archive_reader_t *reader, off_t offset, int *eof) {
+    *eof = 0;
+    // A truncated archive without a footer simply ends at its last full block
+    if (offset + BLOCK_SIZE > reader->archive_size) {
+        *eof = 1;
+        return NULL;
+    }
+    if (reader->streaming) {
+        // Skip whatever is left of the previous member, then read the header
+        int ret = stream_skip_to(reader, offset);
+        if (ret == 0) {
+            ret = stream_consume(reader, BLOCK_SIZE, -1, (char *) &reader->stream_header);
+        }
+        *eof = ret == 1;
+        return ret == 0 ? &reader->stream_header : NULL;
+    }
+    if (reader->compressed) {
+        if (frames_copy(reader, offset, BLOCK_SIZE, -1, (char *) &reader->stream_header)) {
+            return NULL;
+        }
+        return &reader->stream_header;
+    }
+    STATS_ADD(bytes_read, BLOCK_SIZE);
+    return (const tar_header *) map_range(reader, offset, BLOCK_SIZE);
+}
+
+/*
+ * Copies the 'len' bytes at 'src' into the growable buffer '*str' of
+ * '*capacity' bytes, followed by a null byte.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int store_string(char **str, size_t *capacity, const char *src, size_t len) {
+    if (len + 1 > *capacity) {
+        size_t bigger_capacity = *capacity == 0 ? 256 : *capacity;
+        while (bigger_capacity < len + 1) {
+            bigger_capacity *= 2;
+        }
+        char *bigger = realloc(*str, bigger_capacity);
+        if (bigger == NULL) {
+            perror("Error allocating member name");
+            return -1;
+        }
+        *str = bigger;
+        *capacity = bigger_capacity;
+    }
+    memcpy(*str, src, len);
+    (*str)[len] = '\0';
+    return 0;
+}
+
+/*
+ * Sets the current member's name to the 'len' bytes at 'name'.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int set_member_name(archive_reader_t *reader, const char *name, size_t len) {
+    return store_string(&reader->name, &reader->name_capacity, name, len);
+}
+
+/*
+ * Sets the name the current member links to to the 'len' bytes at 'name'.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int set_link_name(archive_reader_t *reader, const char *name, size_t len) {
+    return store_string(&reader->link_name, &reader->link_name_capacity, name, len);
+}
+
+/*
+ * Parses the PAX record value from 'value' up to 'end', where the record's
+ * newline is, as a decimal number from 0 to 'max' into '*number'. If 'is_time'
+ * is set it may also be negative and have a fractional part, which is
+ * dropped.
+ * Returns 0 on success or -1 if the value is anything else
+ */
+static int parse_pax_number(const char *value, const char *end, long long max, int is_time,
+                            long long *number) {
+    int negative = is_time && value < end && *value == '-';
+    const char *digit = value + negative;
+    long long result = 0;
+    for (; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+        int d = *digit - '0';
+        if (result > (max - d) / 10) {
+            return -1;
+        }
+        result = result * 10 + d;
+    }
+    if (digit == value + negative) {
+        return -1;
+    }
+    if (is_time && digit < end && *digit == '.') {
+        for (digit++; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+        }
+    }
+    if (digit != end) {
+        return -1;
+    }
+    *number = negative ? -result : result;
+    return 0;
+}
+
+/*
+ * Applies the PAX records in the 'len' bytes at 'records' to the member that
+ * follows: "path" (or "GNU.sparse.name") becomes its name, setting
+ * '*have_name', "linkpath" becomes its link name, setting '*have_link_name',
+ * and "size" and "mtime" replace its header fields. The
+ * "GNU.sparse" records of a format 1.0 sparse file set 'reader->sparse' and
+ * 'reader->real_size'. Other keys are ignored. Numbers have to be whole
+ * values, and sizes small enough to be padded to a whole block.
+ * Returns 0 on success or -1 if the records are malformed
+ */
+static int apply_pax_records(archive_reader_t *reader, const char *records, size_t len,
+                             int *have_name, int *have_link_name, off_t *size, time_t *mtime) {
+    long long sparse_major = -1;
+    long long sparse_minor = -1;
+    int have_sparse_name = 0;
+    size_t pos = 0;
+    while (pos < len && records[pos] != '\0') {
+        // Each record is "<length> <key>=<value>\n", its length included
+        size_t record_len = 0;
+        size_t i = pos;
+        while (i < len && records[i] >= '0' && records[i] <= '9' && record_len < len) {
+            record_len = record_len * 10 + (records[i++] - '0');
+        }
+        // The length has to cover at least itself, the space and the newline,
+        // and the record has to end within the header
+        if (i == pos || i >= len || records[i] != ' ' || record_len <= (i - pos) + 1 ||
+            record_len > len - pos || records[pos + record_len - 1] != '\n') {
+            fprintf(stderr, "Error: malformed PAX extended header\n");
+            return -1;
+        }
+        const char *key = records + i + 1;
+        const char *end = records + pos + record_len - 1;
+        const char *equals = memchr(key, '=', end - key);
+        if (equals == NULL) {
+            fprintf(stderr, "Error: malformed PAX extended header\n");
+            return -1;
+        }
+        const char *value = equals + 1;
+        size_t key_len = equals - key;
+        long long number;
+        int valid = 1;
+        // The sparse name wins over the path, whichever comes first
+        if ((key_len == 4 && memcmp(key, "path", 4) == 0 && !have_sparse_name) ||
+            (key_len == 15 && memcmp(key, "GNU.sparse.name", 15) == 0)) {
+            if (set_member_name(reader, value, end - value)) {
+                return -1;
+            }
+            *have_name = 1;
+            have_sparse_name |= key_len == 15;
+        } else if (key_len == 8 && memcmp(key, "linkpath", 8) == 0) {
+            if (set_link_name(reader, value, end - value)) {
+                return -1;
+            }
+            *have_link_name = 1;
+        } else if (key_len == 16 && memcmp(key, "GNU.sparse.major", 16) == 0) {
+            valid = parse_pax_number(value, end, INT_MAX, 0, &sparse_major) == 0;
+        } else if (key_len == 16 && memcmp(key, "GNU.sparse.minor", 16) == 0) {
+            valid = parse_pax_number(value, end, INT_MAX, 0, &sparse_minor) == 0;
+        } else if (key_len == 19 && memcmp(key, "GNU.sparse.realsize", 19) == 0) {
+            valid = parse_pax_number(value, end, OFF_MAX - BLOCK_SIZE, 0, &number) == 0;
+            reader->real_size = number;
+        } else if (key_len == 4 && memcmp(key, "size", 4) == 0) {
+            valid = parse_pax_number(value, end, OFF_MAX - BLOCK_SIZE, 0, &number) == 0;
+            *size = number;
+        } else if (key_len == 5 && memcmp(key, "mtime", 5) == 0) {
+            valid = parse_pax_number(value, end, LLONG_MAX, 1, &number) == 0;
+            *mtime = number;
+        }
+        if (!valid) {
+            fprintf(stderr, "Error: malformed PAX extended header\n");
+            return -1;
+        }
+        pos += record_len;
+    }
+    if (sparse_major != -1 || sparse_minor != -1 || have_sparse_name) {
+        // Older versions of the format keep the map in the records themselves
+        if (sparse_major != 1 || sparse_minor != 0) {
+            fprintf(stderr, "Error: %s uses a sparse file format other than 1.0\n",
+                    *have_name ? reader->name : "member");
+            return -1;
+        }
+        reader->sparse = 1;
+    }
+    return 0;
+}
+
+/*
+ * Copies the extended header at 'offset', whose block is 'header', and its
+ * data into 'reader->extended_headers'.
+ * Returns a pointer to the copied data, or NULL if an error occurs
+ */
+static const char *read_extended_header(archive_reader_t *reader, const tar_header *header,
+                                        off_t offset, off_t size) {
+    if (size < 0 || size > READER_MAX_EXTENDED_HEADER_SIZE) {
+        fprintf(stderr, "Error: extended header of %lld bytes is too large\n", (long long) size);
+        return NULL;
+    }
+    size_t padded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    size_t needed = reader->extended_headers_len + BLOCK_SIZE + padded + 1;
+    if (needed > reader->extended_headers_capacity) {
+        size_t capacity = reader->extended_headers_capacity == 0 ? 4096 : reader->extended_headers_capacity;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *bigger = realloc(reader->extended_headers, capacity);
+        if (bigger == NULL) {
+            perror("Error allocating extended header");
+            return NULL;
+        }
+        reader->extended_headers = bigger;
+        reader->extended_headers_capacity = capacity;
+    }
+
+    char *block = reader->extended_headers + reader->extended_headers_len;
+    memcpy(block, header, BLOCK_SIZE);
+    char *data = block + BLOCK_SIZE;
+    if (archive_reader_read_at(reader, offset + BLOCK_SIZE, data, padded)) {
+        return NULL;
+    }
+    // Null-terminated, so a long name can be used as it is
+    data[size] = '\0';
+    reader->extended_headers_len += BLOCK_SIZE + padded;
+    return data;
+}
+
+int archive_reader_next(archive_reader_t *reader) {
+    reader->header = NULL;
+    reader->header_offset = reader->next_header;
+    reader->extended_headers_len = 0;
+    reader->sparse = 0;
+    reader->real_size = -1;
+
+    // Values from extended headers, which override the member's own header
+    int have_name = 0;
+    int have_link_name = 0;
+    off_t size = -1;
+    time_t mtime = -1;
+
+    const tar_header *header;
+    off_t offset = reader->next_header;
+    while (1) {
+        int eof;
+        header = read_header_block(reader, offset, &eof);
+        if (header == NULL) {
+            return eof ? 0 : -1;
+        }
+        // The footer starts with an all-zero block, so an empty name marks the end
+        if (header->name[0] == '\0') {
+            return 0;
+        }
+        if (!header_checksum_matches(header)) {
+            fprintf(stderr, "Error: header checksum mismatch at offset %lld\n", (long long) offset);
+            return -1;
+        }
+        char typeflag = header->typeflag;
+        if (typeflag != PAX_HEADER_TYPE && typeflag != PAX_GLOBAL_HEADER_TYPE &&
+            typeflag != GNU_LONG_NAME_TYPE && typeflag != GNU_LONG_LINK_TYPE) {
+            break;
+        }
+
+        // Reading the data may move the mapping, so 'header' is done with here
+        off_t ext_size = parse_numeric(header->size, sizeof(header->size));
+        const char *data = read_extended_header(reader, header, offset, ext_size);
+        if (data == NULL) {
+            return -1;
+        }
+        if (typeflag == PAX_HEADER_TYPE &&
+            apply_pax_records(reader, data, ext_size, &have_name, &have_link_name, &size, &mtime)) {
+            return -1;
+        }
+        if (typeflag == GNU_LONG_NAME_TYPE) {
+            if (set_member_name(reader, data, strlen(data))) {
+                return -1;
+            }
+            have_name = 1;
+        }
+        if (typeflag == GNU_LONG_LINK_TYPE) {
+            if (set_link_name(reader, data, strlen(data))) {
+                return -1;
+            }
+            have_link_name = 1;
+        }
+        offset += BLOCK_SIZE + (ext_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    }
+
+    if (size < 0) {
+        size = parse_numeric(header->size, sizeof(header->size));
+    }
+    if (size < 0) {
+        fprintf(stderr, "Error reading header size of %.100s\n", header->name);
+        return -1;
+    }
+    if (mtime < 0) {
+        mtime = parse_numeric(header->mtime, sizeof(header->mtime));
+    }
+
+    // Without an extended name, a ustar prefix goes in front of the name
+    if (!have_name) {
+        size_t name_len = strnlen(header->name, sizeof(header->name));
+        size_t prefix_len = 0;
+        if (memcmp(header->magic, MAGIC, strlen(MAGIC)) == 0) {
+            prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+        }
+        char name[sizeof(header->prefix) + 1 + sizeof(header->name)];
+        if (prefix_len > 0) {
+            memcpy(name, header->prefix, prefix_len);
+            name[prefix_len++] = '/';
+        }
+        memcpy(name + prefix_len, header->name, name_len);
+        if (set_member_name(reader, name, prefix_len + name_len)) {
+            return -1;
+        }
+    }
+
+    // Unlike the name, a link name in the header is never split
+    reader->hard_link = header->typeflag == LNKTYPE;
+    if (reader->hard_link && !have_link_name &&
+        set_link_name(reader, header->linkname, strnlen(header->linkname, sizeof(header->linkname)))) {
+        return -1;
+    }
+
+    reader->header = header;
+    reader->data_offset = offset + BLOCK_SIZE;
+    reader->data_size = size;
+    reader->mtime = mtime;
+    if (reader->sparse && reader->real_size < 0) {
+        fprintf(stderr, "Error: sparse file %s has no size\n", reader->name);
+        return -1;
+    }
+    if (!reader->sparse) {
+        reader->real_size = size;
+    }
+    // Data is padded out to a whole number of blocks
+    reader->next_header = reader->data_offset + (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 1;
+}
+
+int archive_reader_write_range(archive_reader_t *reader, off_t offset, off_t nbytes, int out_fd) {
+    if (offset + nbytes > reader->archive_size) {
+        fprintf(stderr, "Error: archive ends in the middle of member data\n");
+        return -1;
+    }
+
+    if (reader->streaming) {
+        int ret = stream_skip_to(reader, offset);
+        if (ret == 0) {
+            ret = stream_consume(reader, nbytes, out_fd, NULL);
+        }
+        if (ret == 1) {
+            fprintf(stderr, "Error: archive ends in the middle of member data\n");
+        }
+        return ret == 0 ? 0 : -1;
+    }
+    if (reader->compressed) {
+        return frames_copy(reader, offset, nbytes, out_fd, NULL);
+    }
+
+    // Write the range a window at a time so huge members stay within budget
+    while (nbytes > 0) {
+        size_t chunk = nbytes > READER_WINDOW_SIZE / 2 ? READER_WINDOW_SIZE / 2 : nbytes;
+        const char *data = map_range(reader, offset, chunk);
+        if (data == NULL) {
+            return -1;
+        }
+        STATS_ADD(bytes_read, chunk);
+        if (write_all(out_fd, data, chunk)) {
+            perror("Error writing data to data file from archive");
+            return -1;
+        }
+        offset += chunk;
+        nbytes -= chunk;
+    }
+    return 0;
+}
+
+int archive_reader_write_data(archive_reader_t *reader, int out_fd) {
+    return archive_reader_write_range(reader, reader->data_offset, reader->data_size, out_fd);
+}
+
+int archive_reader_read_at(archive_reader_t *reader, off_t offset, void *buf, size_t len) {
+    if (reader->streaming) {
+        int ret = stream_skip_to(reader, offset);
+        if (ret == 0) {
+            ret = stream_consume(reader, len, -1, buf);
+        }
+        if (ret == 1) {
+            fprintf(stderr, "Error: read past the end of the archive\n");
+        }
+        return ret == 0 ? 0 : -1;
+    }
+    if (offset + len > reader->archive_size) {
+        fprintf(stderr, "Error: read past the end of the archive\n");
+        return -1;
+    }
+    if (reader->compressed) {
+        return frames_copy(reader, offset, len, -1, buf);
+    }
+
+    char *dest = buf;
+    while (len > 0) {
+        size_t chunk = len > READER_WINDOW_SIZE / 2 ? READER_WINDOW_SIZE / 2 : len;
+        const char *data = map_range(reader, offset, chunk);
+        if (data == NULL) {
+            return -1;
+        }
+        STATS_ADD(bytes_read, chunk);
+        memcpy(dest, data, chunk);
+        dest += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int archive_reader_read_sparse_map(archive_reader_t *reader, off_t offset, off_t size, off_t real_size,
+                                   sparse_map_t *map, off_t *segments_offset) {
+    // The map is only as long as it has to be, so read it a block at a time
+    // into a buffer that is kept for the next sparse member
+    size_t len = 0;
+    int ret = 1;
+    while (ret == 1) {
+        if (len + BLOCK_SIZE > (size_t) size || len + BLOCK_SIZE > READER_MAX_EXTENDED_HEADER_SIZE) {
+            fprintf(stderr, "Error: malformed sparse file map\n");
+            ret = -1;
+            break;
+        }
+        if (len + BLOCK_SIZE > reader->map_text_capacity) {
+            char *bigger = realloc(reader->map_text, len + BLOCK_SIZE);
+            if (bigger == NULL) {
+                perror("Error allocating sparse file map");
+                ret = -1;
+                break;
+            }
+            reader->map_text = bigger;
+            reader->map_text_capacity = len + BLOCK_SIZE;
+        }
+        char *text = reader->map_text;
+        if (archive_reader_read_at(reader, offset + len, text + len, BLOCK_SIZE)) {
+            ret = -1;
+            break;
+        }
+        len += BLOCK_SIZE;
+        size_t map_len;
+        ret = sparse_map_parse(text, len, map, &map_len);
+        if (ret == 0) {
+            *segments_offset = offset + map_len;
+        } else if (ret == -1) {
+            fprintf(stderr, "Error: malformed sparse file map\n");
+        }
+    }
+    if (ret == 0 && (off_t) (*segments_offset - offset + map->data_size) > size) {
+        fprintf(stderr, "Error: sparse file map doesn't match the data after it\n");
+        ret = -1;
+    }
+    // A file's real size can't be smaller than the data in it
+    for (size_t i = 0; ret == 0 && i < map->num_segments; i++) {
+        const sparse_segment_t *segment = &map->segments[i];
+        if (segment->length > real_size || segment->offset > real_size - segment->length) {
+            fprintf(stderr, "Error: sparse file map reaches past the file's size\n");
+            ret = -1;
+        }
+    }
+    map->real_size = real_size;
+    if (ret != 0) {
+        sparse_map_free(map);
+        return -1;
+    }
+    return 0;
+}
+
+void archive_reader_set_advice(archive_reader_t *reader, int advice) {
+    reader->advice = advice;
+    if (reader->window != NULL) {
+        madvise(reader->window, reader->window_len, advice);
+    }
+}
+
+void archive_reader_close(archive_reader_t *reader) {
+    if (reader->window != NULL) {
+        munmap(reader->window, reader->window_len);
+        reader->window = NULL;
+    }
+    if (reader->fd != -1) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    free(reader->stream_buf);
+    reader->stream_buf = NULL;
+    inflate_stream_free(reader->inflater);
+    reader->inflater = NULL;
+    frame_table_free(&reader->frames);
+    free(reader->map_text);
+    reader->map_text = NULL;
+    free(reader->name);
+    reader->name = NULL;
+    free(reader->link_name);
+    reader->link_name = NULL;
+    free(reader->extended_headers);
+    reader->extended_headers = NULL;
+    free(reader->frame_buf);
+    reader->frame_buf = NULL;
+    reader->cached_frame = 0;
+}
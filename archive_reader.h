@@ -0,0 +1,168 @@
+#ifndef _ARCHIVE_READER_H
+#define _ARCHIVE_READER_H
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "minitar.h"
+#include "sparse.h"
+
+// Largest span of the archive that is mapped into memory at any one time
+#define READER_WINDOW_SIZE (64 << 20)
+// Buffer size used when the archive is a pipe and has to be read sequentially
+#define READER_STREAM_BUF_SIZE (1 << 20)
+// Largest extended header (PAX records or a GNU long name) the reader accepts
+#define READER_MAX_EXTENDED_HEADER_SIZE (1 << 20)
+
+// Sequential reader over the members of an archive, backed by mmap for
+// regular files and by a read buffer for pipes. Compressed archives are read
+// frame by frame, or through a decompressor when they have to be streamed.
+typedef struct {
+    // Open descriptor for the archive and its total (uncompressed) size in bytes
+    int fd;
+    off_t archive_size;
+    // Currently mapped span of the archive, or NULL if nothing is mapped
+    char *window;
+    off_t window_start;
+    size_t window_len;
+    // madvise() hint applied to every window as it is mapped
+    int advice;
+    // Offset of the header block that the next call to archive_reader_next reads
+    off_t next_header;
+    // Header of the current member, valid until the next call into the reader
+    const tar_header *header;
+    // Full name of the current member. It comes from a PAX "path" record or a
+    // GNU long name if the member has one, and otherwise from the header's
+    // prefix and name fields, so it may well be longer than either.
+    char *name;
+    size_t name_capacity;
+    // Set when the current member is a hard link, along with the name of the
+    // member it links to (from a PAX "linkpath" record, a GNU long link name,
+    // or the header's linkname field)
+    int hard_link;
+    char *link_name;
+    size_t link_name_capacity;
+    // Offset of the current member's first header block: that of its
+    // extended headers, if it has any, or else 'header' itself
+    off_t header_offset;
+    // Copies of the current member's extended header blocks, data included,
+    // and their total length (0 if it has none)
+    char *extended_headers;
+    size_t extended_headers_len;
+    size_t extended_headers_capacity;
+    // Offset and size of the current member's data within the archive
+    off_t data_offset;
+    off_t data_size;
+    // Modification time of the current member, or -1 if its header has none
+    time_t mtime;
+    // Set when the current member is a sparse file (PAX format 1.0). Its data
+    // then starts with a map of where the file's data lies (see
+    // archive_reader_read_sparse_map), and 'real_size' is its full size.
+    int sparse;
+    off_t real_size;
+    // Set when the archive can't be mapped (a pipe, say). The archive is then
+    // read strictly front to back: skipped data is read and discarded, and
+    // 'archive_size' is unknown, so it is set to the largest possible offset.
+    int streaming;
+    // Read buffer for streaming mode. 'stream_pos' is the archive offset of
+    // stream_buf[stream_buf_pos], and bytes up to 'stream_buf_len' are valid.
+    char *stream_buf;
+    size_t stream_buf_pos;
+    size_t stream_buf_len;
+    off_t stream_pos;
+    // Copy of the current header in streaming and compressed mode, which
+    // 'header' points to
+    tar_header stream_header;
+    // Set when a compressed archive is streamed, to decompress what is read
+    inflate_stream_t *inflater;
+    // Set when the archive is a seekable compressed archive. Offsets refer to
+    // the uncompressed archive, and each access decompresses the frames it
+    // touches; the most recent one is kept in 'frame_buf'.
+    int compressed;
+    frame_table_t frames;
+    char *frame_buf;
+    size_t frame_buf_capacity;
+    // 1 + index of the frame held in 'frame_buf', or 0 if it holds none
+    size_t cached_frame;
+    // Text of the last sparse file map read, kept to be reused for the next
+    char *map_text;
+    size_t map_text_capacity;
+} archive_reader_t;
+
+/*
+ * Parse a numeric header field of 'len' bytes: 0-padded octal, which need not
+ * be null-terminated and may start with spaces, or GNU base-256 (a first byte
+ * with its high bit set, followed by a big-endian binary value), which tar
+ * uses for values too large for octal.
+ * Returns the value, or -1 if the field holds no number or a negative one.
+ */
+long long parse_numeric(const char *field, size_t len);
+
+/*
+ * Open the archive identified by 'archive_name' for reading, or standard input
+ * if it is STDIO_ARCHIVE_NAME. Compressed archives are recognized by their
+ * first bytes and decompressed transparently.
+ * 'advice' is passed to madvise() for each mapped window: MADV_SEQUENTIAL
+ * suits readers that consume member data, MADV_RANDOM suits readers that only
+ * look at headers, since it keeps the kernel from reading ahead into data pages.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_open(archive_reader_t *reader, const char *archive_name, int advice);
+
+/*
+ * Same as archive_reader_open, for the archive open on 'fd', which the reader
+ * takes over and closes (even if this fails). A regular file is read from
+ * its start whatever the descriptor's offset, anything else as a stream.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_open_fd(archive_reader_t *reader, int fd, int advice);
+
+/*
+ * Advance to the next member of the archive, skipping over the data of the
+ * current one by pointer arithmetic alone.
+ * On success 'reader->header', 'reader->name', 'reader->data_offset' and
+ * 'reader->data_size' describe the new member. Extended headers in front of
+ * it are read and applied along the way, and never show up as members.
+ * Returns 1 if a member was found, 0 at the end of the archive, or -1 on error.
+ */
+int archive_reader_next(archive_reader_t *reader);
+
+/*
+ * Write the data of the current member to 'out_fd', straight from the mapping.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_write_data(archive_reader_t *reader, int out_fd);
+
+/*
+ * Write the 'nbytes' archive bytes starting at 'offset' to 'out_fd', straight
+ * from the mapping. Lets callers revisit members found by an earlier pass.
+ * In streaming mode 'offset' can't lie before the end of the current header.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_write_range(archive_reader_t *reader, off_t offset, off_t nbytes, int out_fd);
+
+/*
+ * Copy the 'len' archive bytes starting at 'offset' into 'buf'.
+ * In streaming mode 'offset' can't lie before the end of the last read.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_read_at(archive_reader_t *reader, off_t offset, void *buf, size_t len);
+
+/*
+ * Read the map at the start of the data of a sparse member, whose 'size'
+ * bytes of data start at 'offset', into 'map', replacing any segments it
+ * held but keeping their storage. Every segment has to lie within the
+ * member's full size 'real_size', which is stored in the map as well.
+ * '*segments_offset' is set to the archive offset of the first segment's data.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int archive_reader_read_sparse_map(archive_reader_t *reader, off_t offset, off_t size, off_t real_size,
+                                   sparse_map_t *map, off_t *segments_offset);
+
+// Change the madvise() hint for the current window and all later ones
+void archive_reader_set_advice(archive_reader_t *reader, int advice);
+
+// Unmap any window, free any decompression state, and close the archive
+void archive_reader_close(archive_reader_t *reader);
+
+#endif
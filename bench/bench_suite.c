@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../io_util.h"
+
+// End-to-end benchmark suite: generates reproducible workloads under a work
+// directory, then times whole minitar runs (create, append, list, update,
+// extract and compact) on each, several times over. Reports MB/s, files/s
+// and p50/p99 latency per operation, and writes every sample to a JSON file
+// so two commits can be compared.
+//
+// Workloads, at scale 1 (-s multiplies the number of files, or for large the
+// size of each one):
+//   tiny      100000 files of up to 1 KB, in 100 directories
+//   large     3 files of 2 GB each
+//   versions  1000 names of 4 KB, each archived in 20 versions
+// File contents come from a fixed-seed generator, so every run archives the
+// same bytes, none of them compressible or sparse. Files of the tiny and
+// large workloads are kept in the work directory and reused by later runs.
+//
+// Usage: bench_suite [-s SCALE] [-r REPEATS] [-d WORKDIR] [-o RESULTS.json]
+//                    [-m MINITAR] [-w WORKLOAD]... [-O MINITAR_OPTION]...
+
+#define MAX_OPTIONS 16
+#define MAX_WORKLOADS 3
+#define WRITE_CHUNK (1 << 20)
+
+typedef struct {
+    const char *name;
+    // Number of files and bytes per file at scale 1 (a size of 0 means a
+    // random size below 1 KB), and how many versions each is archived in
+    long num_files;
+    long long file_size;
+    int versions;
+    // Scale the size of the files rather than their number
+    int scale_size;
+} workload_def_t;
+
+static const workload_def_t WORKLOADS[] = {
+    {"tiny", 100000, 0, 1, 0},
+    {"large", 3, 2LL << 30, 1, 1},
+    {"versions", 1000, 4096, 20, 0},
+};
+
+// Modification time given to the files that change before each update, far
+// enough in the past that update never has to compare their contents
+#define TOUCH_TIME 1000000000
+
+// Paths of a generated workload, relative to its directory
+typedef struct {
+    const workload_def_t *def;
+    char dir[PATH_MAX / 2];
+    char **paths;
+    long num_paths;
+    long long total_bytes;
+} workload_t;
+
+// Timings of one operation on one workload
+typedef struct {
+    const char *workload;
+    const char *op;
+    // Files and bytes the operation handles each time it runs
+    long files;
+    long long bytes;
+    double *samples;
+    int num_samples;
+} result_t;
+
+static struct {
+    double scale;
+    int repeats;
+    const char *work_dir;
+    const char *output;
+    char minitar[PATH_MAX];
+    const char *options[MAX_OPTIONS];
+    int num_options;
+} config = {1.0, 5, "bench_work", "bench_results.json", "./minitar", {NULL}, 0};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*: fast, and the same sequence on every machine
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fill_random(char *buf, size_t len, uint64_t *state) {
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t value = next_random(state);
+        memcpy(buf + i, &value, 8);
+    }
+    for (size_t i = len / 8 * 8; i < len; i++) {
+        buf[i] = next_random(state);
+    }
+}
+
+/*
+ * Writes 'size' bytes from the generator seeded with 'seed' to 'path'. If
+ * 'reuse' is set and a file of that size is already there, it is kept.
+ * Returns 0 on success or -1 if an error occurs (the error is reported)
+ */
+static int write_file(const char *path, long long size, uint64_t seed, int reuse, char *buf) {
+    struct stat stat_buf;
+    if (reuse && stat(path, &stat_buf) == 0 && stat_buf.st_size == size) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    uint64_t state = seed | 1;
+    for (long long written = 0; written < size; written += WRITE_CHUNK) {
+        size_t chunk = size - written < WRITE_CHUNK ? size - written : WRITE_CHUNK;
+        fill_random(buf, chunk, &state);
+        if (write_all(fd, buf, chunk)) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+/*
+ * Generates the files of workload 'def' under 'root/NAME/data', scaled by
+ * config.scale, and records their paths relative to 'root/NAME'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int generate_workload(const workload_def_t *def, workload_t *workload) {
+    // Absolute, since minitar runs in other directories
+    workload->def = def;
+    char root[PATH_MAX];
+    mkdir(config.work_dir, 0755);
+    if (realpath(config.work_dir, root) == NULL) {
+        perror(config.work_dir);
+        return -1;
+    }
+    snprintf(workload->dir, sizeof(workload->dir), "%.*s/%s", PATH_MAX / 4, root, def->name);
+    long num_files = def->num_files * (def->scale_size ? 1 : config.scale);
+    long long file_size = def->file_size * (def->scale_size ? config.scale : 1);
+    if (num_files < 1) {
+        num_files = 1;
+    }
+    workload->paths = calloc(num_files, sizeof(char *));
+    char *buf = malloc(WRITE_CHUNK);
+    if (workload->paths == NULL || buf == NULL) {
+        perror("Error allocating workload");
+        free(buf);
+        return -1;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/data", workload->dir);
+    mkdir(workload->dir, 0755);
+    mkdir(path, 0755);
+    uint64_t sizes = 4061;
+    for (long i = 0; i < num_files; i++) {
+        // Spread many files over 100 directories
+        char rel[64];
+        if (num_files > 1000) {
+            snprintf(rel, sizeof(rel), "data/d%02ld", i % 100);
+            snprintf(path, sizeof(path), "%s/%s", workload->dir, rel);
+            mkdir(path, 0755);
+            snprintf(rel, sizeof(rel), "data/d%02ld/f%07ld", i % 100, i);
+        } else {
+            snprintf(rel, sizeof(rel), "data/f%07ld", i);
+        }
+        long long size = file_size > 0 ? file_size : (long long) (next_random(&sizes) % 1024);
+        snprintf(path, sizeof(path), "%s/%s", workload->dir, rel);
+        workload->paths[i] = strdup(rel);
+        // Files that get new versions are always written afresh
+        if (workload->paths[i] == NULL || write_file(path, size, i + 1, def->versions == 1, buf)) {
+            free(buf);
+            return -1;
+        }
+        workload->num_paths++;
+        workload->total_bytes += size;
+    }
+    free(buf);
+    return 0;
+}
+
+/*
+ * Runs minitar with 'op', the archive 'archive', config.options and then the
+ * 'num_args' arguments in 'args', in the directory 'dir', with its output
+ * thrown away.
+ * Returns the run's wall-clock time in seconds, or -1 if it failed
+ */
+static double run_minitar(const char *dir, const char *op, const char *archive, char **args,
+                          long num_args) {
+    const char **argv = malloc((num_args + config.num_options + 5) * sizeof(char *));
+    if (argv == NULL) {
+        perror("Error allocating arguments");
+        return -1;
+    }
+    int argc = 0;
+    argv[argc++] = config.minitar;
+    argv[argc++] = op;
+    argv[argc++] = "-f";
+    argv[argc++] = archive;
+    for (int i = 0; i < config.num_options; i++) {
+        argv[argc++] = config.options[i];
+    }
+    for (long i = 0; i < num_args; i++) {
+        argv[argc++] = args[i];
+    }
+    argv[argc] = NULL;
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (chdir(dir) == -1 || null_fd == -1 || dup2(null_fd, STDOUT_FILENO) == -1) {
+            _exit(127);
+        }
+        execv(argv[0], (char **) argv);
+        _exit(127);
+    }
+    free(argv);
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1) {
+        perror("Error running minitar");
+        return -1;
+    }
+    double elapsed = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "minitar %s -f %s failed in %s\n", op, archive, dir);
+        return -1;
+    }
+    return elapsed;
+}
+
+static int remove_entry(const char *path, const struct stat *stat_buf, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+// Removes 'path' and everything below it, if it exists
+static int remove_tree(const char *path) {
+    if (access(path, F_OK) != 0) {
+        return 0;
+    }
+    return nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Copies the file 'from' to 'to', replacing it, so each run of an operation
+ * that changes an archive starts from the same one.
+ * Returns 0 on success or -1 if an error occurs (the error is reported)
+ */
+static int copy_file(const char *from, const char *to) {
+    int in_fd = open(from, O_RDONLY);
+    int out_fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat stat_buf;
+    int ret = in_fd == -1 || out_fd == -1 || fstat(in_fd, &stat_buf) == -1 ||
+              copy_range(out_fd, in_fd, 0, stat_buf.st_size) ? -1 : 0;
+    if (ret) {
+        perror("Error copying archive");
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (out_fd != -1) {
+        close(out_fd);
+    }
+    return ret;
+}
+
+// Setting the modification time of the 'num_paths' files in 'paths' under
+// 'dir' to 'when' seconds past the epoch makes the next update pick them up
+static int touch_files(const char *dir, char **paths, long num_paths, time_t when) {
+    struct timespec times[2] = {{when, 0}, {when, 0}};
+    char path[PATH_MAX];
+    for (long i = 0; i < num_paths; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, paths[i]);
+        if (utimensat(AT_FDCWD, path, times, 0) == -1) {
+            perror(path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// qsort comparator for doubles
+static int compare_doubles(const void *a, const void *b) {
+    double d1 = *(const double *) a;
+    double d2 = *(const double *) b;
+    return (d1 > d2) - (d1 < d2);
+}
+
+// Nearest-rank percentile 'p' of the 'n' sorted samples
+static double percentile(const double *sorted, int n, double p) {
+    int rank = (int) (p / 100 * n + 0.999999);
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static result_t results[MAX_WORKLOADS * 8];
+static int num_results;
+
+/*
+ * Times config.repeats runs of one operation. Before each run 'base' (if not
+ * NULL) is copied over 'archive', 'out_dir' (if not NULL) is emptied, and the
+ * 'files' files in 'touch' (if not NULL) get a new modification time, none of
+ * which counts towards the time.
+ * Returns 0 on success or -1 if a run failed
+ */
+static int time_op(const workload_t *workload, const char *op_name, const char *op, const char *dir,
+                   const char *archive, const char *base, const char *out_dir, char **touch,
+                   char **args, long num_args, long files, long long bytes) {
+    result_t *result = &results[num_results];
+    result->workload = workload->def->name;
+    result->op = op_name;
+    result->files = files;
+    result->bytes = bytes;
+    result->samples = calloc(config.repeats, sizeof(double));
+    if (result->samples == NULL) {
+        perror("Error allocating samples");
+        return -1;
+    }
+    num_results++;
+    for (int i = 0; i < config.repeats; i++) {
+        if (base != NULL && copy_file(base, archive)) {
+            return -1;
+        }
+        if (out_dir != NULL && (remove_tree(out_dir) || mkdir(out_dir, 0755))) {
+            perror(out_dir);
+            return -1;
+        }
+        if (touch != NULL && touch_files(workload->dir, touch, files, TOUCH_TIME + 1 + i)) {
+            return -1;
+        }
+        double elapsed = run_minitar(dir, op, archive, args, num_args);
+        if (elapsed < 0) {
+            return -1;
+        }
+        result->samples[result->num_samples++] = elapsed;
+    }
+    qsort(result->samples, result->num_samples, sizeof(double), compare_doubles);
+    double p50 = percentile(result->samples, result->num_samples, 50);
+    printf("%-9s %-8s %9ld %11.1f %10.2f %10.2f %10.1f %11.0f\n", result->workload, result->op, files,
+           bytes / 1e6, p50 * 1e3, percentile(result->samples, result->num_samples, 99) * 1e3,
+           bytes / 1e6 / p50, files / p50);
+    fflush(stdout);
+    return 0;
+}
+
+/*
+ * Runs every operation on one workload. Every versioned workload first gets
+ * an archive with all of its versions, built by one create and then appends
+ * of rewritten files, which the operations then start from.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int bench_workload(workload_t *workload) {
+    char archive[PATH_MAX];
+    char base[PATH_MAX];
+    char out_dir[PATH_MAX];
+    snprintf(archive, sizeof(archive), "%s/archive.tar", workload->dir);
+    snprintf(base, sizeof(base), "%s/base.tar", workload->dir);
+    snprintf(out_dir, sizeof(out_dir), "%s/out", workload->dir);
+    char *data_dir[] = {"data"};
+    const workload_def_t *def = workload->def;
+    long n = workload->num_paths;
+    long long bytes = workload->total_bytes;
+
+    // One percent of the files change for append and update, at least one
+    long num_changed = n / 100 > 0 ? n / 100 : 1;
+    char **changed = malloc(num_changed * sizeof(char *));
+    if (changed == NULL) {
+        perror("Error allocating arguments");
+        return -1;
+    }
+    long long changed_bytes = 0;
+    for (long i = 0; i < num_changed; i++) {
+        changed[i] = workload->paths[i * (n / num_changed)];
+        char path[PATH_MAX];
+        struct stat stat_buf;
+        snprintf(path, sizeof(path), "%s/%s", workload->dir, changed[i]);
+        if (stat(path, &stat_buf) == 0) {
+            changed_bytes += stat_buf.st_size;
+        }
+    }
+
+    // Start the files that change from the same time on every run
+    int ret = touch_files(workload->dir, changed, num_changed, TOUCH_TIME);
+    if (ret == 0 && def->versions == 1) {
+        ret = time_op(workload, "create", "-c", workload->dir, archive, NULL, NULL, NULL, data_dir, 1, n, bytes);
+        ret = ret || copy_file(archive, base);
+    } else if (ret == 0) {
+        // Every version rewrites every file with new contents, untimed
+        char *buf = malloc(WRITE_CHUNK);
+        ret = buf == NULL || run_minitar(workload->dir, "-c", base, data_dir, 1) < 0;
+        for (int v = 1; v < def->versions && ret == 0; v++) {
+            for (long i = 0; i < n && ret == 0; i++) {
+                char path[PATH_MAX];
+                snprintf(path, sizeof(path), "%s/%s", workload->dir, workload->paths[i]);
+                ret = write_file(path, def->file_size, (uint64_t) v << 32 | (i + 1), 0, buf);
+            }
+            ret = ret || run_minitar(workload->dir, "-a", base, workload->paths, n) < 0;
+        }
+        free(buf);
+    }
+
+    struct stat base_stat;
+    ret = ret || stat(base, &base_stat);
+    ret = ret || time_op(workload, "list", "-t", workload->dir, base, NULL, NULL, NULL, NULL, 0,
+                         n * def->versions, base_stat.st_size);
+    ret = ret || time_op(workload, "append", "-a", workload->dir, archive, base, NULL, NULL, changed,
+                         num_changed, num_changed, changed_bytes);
+    ret = ret || time_op(workload, "update", "-u", workload->dir, archive, base, NULL, changed,
+                         data_dir, 1, num_changed, changed_bytes);
+    ret = ret || time_op(workload, "extract", "-x", out_dir, base, NULL, out_dir, NULL, NULL, 0, n, bytes);
+    if (def->versions > 1) {
+        ret = ret || time_op(workload, "compact", "-k", workload->dir, archive, base, NULL, NULL, NULL,
+                             0, n * def->versions, base_stat.st_size);
+    }
+    remove_tree(out_dir);
+    unlink(archive);
+    free(changed);
+    if (ret) {
+        fprintf(stderr, "Benchmark of workload %s failed\n", def->name);
+    }
+    return ret ? -1 : 0;
+}
+
+// Writes every sample, with the run's settings, to config.output
+static int write_results(void) {
+    FILE *out = fopen(config.output, "w");
+    if (out == NULL) {
+        perror(config.output);
+        return -1;
+    }
+    char commit[64] = "unknown";
+    FILE *git = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+    if (git != NULL) {
+        if (fgets(commit, sizeof(commit), git) != NULL) {
+            commit[strcspn(commit, "\n")] = '\0';
+        }
+        pclose(git);
+    }
+
+    fprintf(out, "{\n  \"commit\": \"%s\",\n  \"time\": %lld,\n  \"scale\": %g,\n  \"repeats\": %d,\n",
+            commit, (long long) time(NULL), config.scale, config.repeats);
+    fprintf(out, "  \"options\": [");
+    for (int i = 0; i < config.num_options; i++) {
+        fprintf(out, "%s\"%s\"", i > 0 ? ", " : "", config.options[i]);
+    }
+    fprintf(out, "],\n  \"results\": [\n");
+    for (int i = 0; i < num_results; i++) {
+        const result_t *result = &results[i];
+        double p50 = percentile(result->samples, result->num_samples, 50);
+        fprintf(out, "    {\"workload\": \"%s\", \"op\": \"%s\", \"files\": %ld, \"bytes\": %lld, ",
+                result->workload, result->op, result->files, result->bytes);
+        fprintf(out, "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mb_per_s\": %.1f, \"files_per_s\": %.0f, ",
+                p50 * 1e3, percentile(result->samples, result->num_samples, 99) * 1e3,
+                result->bytes / 1e6 / p50, result->files / p50);
+        fprintf(out, "\"samples_ms\": [");
+        for (int j = 0; j < result->num_samples; j++) {
+            fprintf(out, "%s%.3f", j > 0 ? ", " : "", result->samples[j] * 1e3);
+        }
+        fprintf(out, "]}%s\n", i + 1 < num_results ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return fclose(out);
+}
+
+int main(int argc, char **argv) {
+    const char *selected[MAX_WORKLOADS];
+    int num_selected = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:d:o:m:w:O:")) != -1) {
+        if (opt == 's') {
+            config.scale = atof(optarg);
+        } else if (opt == 'r') {
+            config.repeats = atoi(optarg);
+        } else if (opt == 'd') {
+            config.work_dir = optarg;
+        } else if (opt == 'o') {
+            config.output = optarg;
+        } else if (opt == 'm') {
+            snprintf(config.minitar, sizeof(config.minitar), "%s", optarg);
+        } else if (opt == 'w' && num_selected < MAX_WORKLOADS) {
+            selected[num_selected++] = optarg;
+        } else if (opt == 'O' && config.num_options < MAX_OPTIONS) {
+            config.options[config.num_options++] = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-s SCALE] [-r REPEATS] [-d WORKDIR] [-o RESULTS.json] [-m MINITAR] "
+                    "[-w tiny|large|versions]... [-O MINITAR_OPTION]...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.scale <= 0 || config.repeats < 1) {
+        fprintf(stderr, "Scale and repeats have to be positive\n");
+        return 1;
+    }
+    // minitar runs in the workload directories, so it needs a full path
+    char minitar[PATH_MAX];
+    if (realpath(config.minitar, minitar) == NULL) {
+        perror(config.minitar);
+        return 1;
+    }
+    strcpy(config.minitar, minitar);
+
+    printf("%-9s %-8s %9s %11s %10s %10s %10s %11s\n", "workload", "op", "files", "MB", "p50 ms", "p99 ms",
+           "MB/s", "files/s");
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(WORKLOADS) / sizeof(WORKLOADS[0]) && ret == 0; i++) {
+        int wanted = num_selected == 0;
+        for (int j = 0; j < num_selected; j++) {
+            wanted = wanted || !strcmp(selected[j], WORKLOADS[i].name);
+        }
+        if (!wanted) {
+            continue;
+        }
+        workload_t workload;
+        memset(&workload, 0, sizeof(workload));
+        ret = generate_workload(&WORKLOADS[i], &workload) || bench_workload(&workload);
+        for (long j = 0; j < workload.num_paths; j++) {
+            free(workload.paths[j]);
+        }
+        free(workload.paths);
+    }
+    if (ret == 0 && write_results() == 0) {
+        printf("Results written to %s\n", config.output);
+    }
+    for (int i = 0; i < num_results; i++) {
+        free(results[i].samples);
+    }
+    return ret ? 1 : 0;
+}
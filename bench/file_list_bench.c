@@ -0,0 +1,82 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../file_list.h"
+
+// Microbenchmark for file_list_t: times add, contains and is_subset on lists
+// of 10^3 to 10^6 distinct names and reports nanoseconds per operation, along
+// with the heap memory the list holds per entry once it is built.
+// Usage: file_list_bench [MAX_ENTRIES]
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Bytes of heap memory currently allocated, including large blocks that
+// malloc serves with mmap
+static size_t heap_in_use(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+int main(int argc, char **argv) {
+    long max_entries = argc > 1 ? atol(argv[1]) : 1000000;
+    char name[64];
+
+    printf("%10s %14s %14s %14s %14s\n", "entries", "add ns/op", "contains ns/op", "subset ns/op",
+           "heap B/entry");
+    for (long n = 1000; n <= max_entries; n *= 10) {
+        file_list_t list;
+        file_list_t half;
+        file_list_init(&list);
+        file_list_init(&half);
+
+        // Names look like archive members: a shared directory prefix plus a number
+        size_t heap_before = heap_in_use();
+        double start = now();
+        for (long i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "data/part-%08ld.bin", i);
+            if (file_list_add(&list, name)) {
+                perror("Error adding file to file list");
+                return 1;
+            }
+        }
+        double add_time = now() - start;
+        double heap_per_entry = (double) (heap_in_use() - heap_before) / n;
+
+        // Half of the lookups hit, half miss
+        long hits = 0;
+        start = now();
+        for (long i = 0; i < n; i++) {
+            snprintf(name, sizeof(name), "data/part-%08ld.bin", i * 2);
+            hits += file_list_contains(&list, name);
+        }
+        double contains_time = now() - start;
+
+        for (long i = 0; i < n; i += 2) {
+            snprintf(name, sizeof(name), "data/part-%08ld.bin", i);
+            if (file_list_add(&half, name)) {
+                perror("Error adding file to file list");
+                return 1;
+            }
+        }
+        start = now();
+        int subset = file_list_is_subset(&half, &list);
+        double subset_time = now() - start;
+
+        if (hits != (n + 1) / 2 || !subset) {
+            fprintf(stderr, "Unexpected result: %ld hits, subset %d\n", hits, subset);
+            return 1;
+        }
+        printf("%10ld %14.1f %14.1f %14.1f %14.1f\n", n, add_time * 1e9 / n, contains_time * 1e9 / n,
+               subset_time * 1e9 / half.size, heap_per_entry);
+
+        file_list_clear(&list);
+        file_list_clear(&half);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../header_simd.h"
+
+// Microbenchmark for the header kernels: times the checksum and the decoding
+// of the size and mtime fields of 10^6 header blocks, for the code minitar
+// used before (a signed byte loop and strtoll on a copy of the field), the
+// scalar kernels and the vector kernels the CPU supports, and reports
+// nanoseconds per header. Every result is checked against the scalar kernels.
+// The headers cycle through a pool small enough to stay in cache, so the
+// kernels are timed rather than memory bandwidth.
+// Usage: header_bench [NUM_HEADERS]
+
+#define BLOCK 512
+#define POOL 1024
+#define SIZE_OFFSET 124
+#define MTIME_OFFSET 136
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The checksum as minitar computed it before, summing through a signed char
+static unsigned legacy_checksum(const char *block) {
+    char header[BLOCK];
+    memcpy(header, block, BLOCK);
+    memset(header + HEADER_CHKSUM_OFFSET, ' ', HEADER_CHKSUM_LEN);
+    unsigned sum = 0;
+    for (int i = 0; i < BLOCK; i++) {
+        sum += header[i];
+    }
+    return sum;
+}
+
+// Octal fields as minitar parsed them before: copied out, then strtoll
+static long long legacy_octal(const char *field, size_t len) {
+    char buf[32];
+    memcpy(buf, field, len);
+    buf[len] = '\0';
+    char *end;
+    long long value = strtoll(buf, &end, 8);
+    return end == buf || value < 0 ? -1 : value;
+}
+
+// Fills 'blocks' with headers that look like real ones: a name with some
+// UTF-8 in it, octal fields of the usual widths, the rest zeros
+static void make_headers(char *blocks, long n) {
+    srand(4061);
+    for (long i = 0; i < n; i++) {
+        char *block = blocks + i * BLOCK;
+        memset(block, 0, BLOCK);
+        snprintf(block, 100, "data/d%03ld/caf\xc3\xa9-%08ld.bin", i % 1000, i);
+        snprintf(block + 100, 8, "%07o", 0644);
+        snprintf(block + 108, 8, "%07o", 1000);
+        snprintf(block + 116, 8, "%07o", 1000);
+        snprintf(block + SIZE_OFFSET, 12, "%011llo", (unsigned long long) rand() * rand() % (1ULL << 33));
+        snprintf(block + MTIME_OFFSET, 12, "%011o", 1700000000 + rand() % 100000000);
+        block[156] = '0';
+        memcpy(block + 257, "ustar", 6);
+        memcpy(block + 263, "00", 2);
+        snprintf(block + HEADER_CHKSUM_OFFSET, HEADER_CHKSUM_LEN, "%07o", header_checksum_scalar(block));
+    }
+}
+
+int main(int argc, char **argv) {
+    long n = argc > 1 ? atol(argv[1]) : 1000000;
+    char *blocks = malloc(POOL * BLOCK);
+    unsigned *sums = malloc(n * sizeof(unsigned));
+    long long *values = malloc(2 * n * sizeof(long long));
+    if (blocks == NULL || sums == NULL || values == NULL) {
+        perror("Error allocating headers");
+        return 1;
+    }
+    make_headers(blocks, POOL);
+
+    unsigned sink = 0;
+    double start = now();
+    for (long i = 0; i < n; i++) {
+        sink += legacy_checksum(blocks + i % POOL * BLOCK);
+    }
+    double legacy_sum_time = now() - start;
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        sums[i] = header_checksum_scalar(blocks + i % POOL * BLOCK);
+    }
+    double scalar_sum_time = now() - start;
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        unsigned sum = header_checksum(blocks + i % POOL * BLOCK);
+        if (sum != sums[i]) {
+            fprintf(stderr, "Checksum mismatch in header %ld: %u, expected %u\n", i, sum, sums[i]);
+            return 1;
+        }
+    }
+    double vector_sum_time = now() - start;
+
+    long long total = 0;
+    start = now();
+    for (long i = 0; i < n; i++) {
+        total += legacy_octal(blocks + i % POOL * BLOCK + SIZE_OFFSET, 12);
+        total += legacy_octal(blocks + i % POOL * BLOCK + MTIME_OFFSET, 12);
+    }
+    double legacy_octal_time = now() - start;
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        values[2 * i] = parse_octal_scalar(blocks + i % POOL * BLOCK + SIZE_OFFSET, 12);
+        values[2 * i + 1] = parse_octal_scalar(blocks + i % POOL * BLOCK + MTIME_OFFSET, 12);
+    }
+    double scalar_octal_time = now() - start;
+
+    start = now();
+    for (long i = 0; i < n; i++) {
+        long long size = parse_octal(blocks + i % POOL * BLOCK + SIZE_OFFSET, 12);
+        long long mtime = parse_octal(blocks + i % POOL * BLOCK + MTIME_OFFSET, 12);
+        if (size != values[2 * i] || mtime != values[2 * i + 1]) {
+            fprintf(stderr, "Octal mismatch in header %ld\n", i);
+            return 1;
+        }
+    }
+    double vector_octal_time = now() - start;
+
+    long long scalar_total = 0;
+    for (long i = 0; i < 2 * n; i++) {
+        scalar_total += values[i];
+    }
+    if (scalar_total != total) {
+        fprintf(stderr, "Octal fields decode differently from strtoll\n");
+        return 1;
+    }
+
+    printf("%ld headers, %d distinct (sink %u)\n", n, POOL, sink);
+    printf("%-22s %12s %12s %12s\n", "", "legacy ns", "scalar ns", "vector ns");
+    printf("%-22s %12.2f %12.2f %12.2f\n", "checksum", legacy_sum_time * 1e9 / n, scalar_sum_time * 1e9 / n,
+           vector_sum_time * 1e9 / n);
+    printf("%-22s %12.2f %12.2f %12.2f\n", "size + mtime fields", legacy_octal_time * 1e9 / n,
+           scalar_octal_time * 1e9 / n, vector_octal_time * 1e9 / n);
+    free(blocks);
+    free(sums);
+    free(values);
+    return 0;
+}
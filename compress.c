@@ -0,0 +1,810 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "io_util.h"
+#include "minitar.h"
+#include "stats.h"
+
+int is_compressed(const void *bytes, size_t len) {
+    const unsigned char *magic = bytes;
+    return len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+void frame_table_free(frame_table_t *table) {
+    free(table->frames);
+    table->frames = NULL;
+    table->num_frames = 0;
+    table->uncompressed_size = 0;
+}
+
+size_t frame_table_find(const frame_table_t *table, off_t offset) {
+    // Binary search for the last frame starting at or before 'offset'
+    size_t low = 0;
+    size_t high = table->num_frames;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+        if (table->frames[mid].uncompressed_offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+#ifdef MINITAR_HAVE_ZLIB
+#include <zlib.h>
+
+// Fixed part of a gzip member header, then XLEN, then one subfield header
+#define GZIP_BASE_HEADER_LEN 10
+#define GZIP_FLAG_EXTRA 0x04
+#define GZIP_FLAG_NAME 0x08
+#define GZIP_FLAG_COMMENT 0x10
+#define GZIP_TRAILER_LEN 8
+// Length of the 'M','T' subfield's data: compressed size and uncompressed size
+#define FRAME_FIELD_LEN 8
+// Header of every frame written by the compressor: base header, XLEN, and the
+// 'M','T' subfield
+#define FRAME_HEADER_LEN (GZIP_BASE_HEADER_LEN + 2 + 4 + FRAME_FIELD_LEN)
+// A footer frame's header also has an empty 'M','F' subfield
+#define FOOTER_HEADER_LEN (FRAME_HEADER_LEN + 4)
+// Bytes read to parse a frame header, enough for any frame minitar writes
+#define FRAME_PROBE_LEN 64
+// Raw deflate data of an empty final block, as in an erased frame
+static const unsigned char empty_deflate[] = {0x03, 0x00};
+// The footer always gets a frame of its own
+#define FOOTER_LEN (BLOCK_SIZE * 2)
+// Frames that may be queued or in flight per worker thread
+#define SLOTS_PER_THREAD 2
+// Size of the input buffer of a streaming decompressor
+#define INFLATE_IN_SIZE (256 << 10)
+
+static void put_le16(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, uint32_t value) {
+    put_le16(p, value & 0xffff);
+    put_le16(p + 2, value >> 16);
+}
+
+static uint32_t get_le16(const unsigned char *p) {
+    return p[0] | (uint32_t) p[1] << 8;
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return get_le16(p) | get_le16(p + 2) << 16;
+}
+
+/*
+ * Parses the gzip member header in the 'len' bytes at 'header'.
+ * On success stores the offset of the compressed data in '*data_start' and, if
+ * the 'M','T' subfield is present, the frame sizes in '*compressed_size' and
+ * '*uncompressed_size' (both are left at 0 otherwise). '*footer' is set if
+ * the 'M','F' subfield is present.
+ * Returns 0 on success, or -1 if this is not a gzip header that fits in 'len'
+ */
+static int parse_frame_header(const unsigned char *header, size_t len, size_t *data_start,
+                              size_t *compressed_size, size_t *uncompressed_size, int *footer) {
+    *compressed_size = 0;
+    *uncompressed_size = 0;
+    *footer = 0;
+    if (len < GZIP_BASE_HEADER_LEN || !is_compressed(header, len) || header[2] != Z_DEFLATED) {
+        return -1;
+    }
+    if (!(header[3] & GZIP_FLAG_EXTRA)) {
+        // Nothing but the extra field is ever written by the compressor, so a
+        // member without one can't be a frame. It is only checked by inflate().
+        *data_start = GZIP_BASE_HEADER_LEN;
+        return 0;
+    }
+    if (len < GZIP_BASE_HEADER_LEN + 2) {
+        return -1;
+    }
+    size_t extra_len = get_le16(header + GZIP_BASE_HEADER_LEN);
+    size_t pos = GZIP_BASE_HEADER_LEN + 2;
+    size_t end = pos + extra_len;
+    if (end > len) {
+        return -1;
+    }
+    while (pos + 4 <= end) {
+        size_t field_len = get_le16(header + pos + 2);
+        if (pos + 4 + field_len > end) {
+            return -1;
+        }
+        if (header[pos] == 'M' && header[pos + 1] == 'T' && field_len == FRAME_FIELD_LEN) {
+            *compressed_size = get_le32(header + pos + 4);
+            *uncompressed_size = get_le32(header + pos + 8);
+        } else if (header[pos] == 'M' && header[pos + 1] == 'F' && field_len == 0) {
+            *footer = 1;
+        }
+        pos += 4 + field_len;
+    }
+    // An erased frame is padded with a comment, and may as well have a name
+    for (int flag = GZIP_FLAG_NAME; flag <= GZIP_FLAG_COMMENT; flag <<= 1) {
+        if (header[3] & flag) {
+            const unsigned char *nul = memchr(header + end, '\0', len - end);
+            if (nul == NULL) {
+                return -1;
+            }
+            end = nul - header + 1;
+        }
+    }
+    *data_start = end;
+    return 0;
+}
+
+int frame_table_load(int fd, frame_table_t *table) {
+    memset(table, 0, sizeof(frame_table_t));
+
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) == -1) {
+        perror("Error inspecting tar file");
+        return -1;
+    }
+
+    size_t capacity = 0;
+    off_t offset = 0;
+    int footer = 0;
+    while (offset < stat_buf.st_size && !footer) {
+        // Frame headers written by minitar are short, so read just enough for
+        // them. Anything else is not a seekable archive.
+        unsigned char header[FRAME_PROBE_LEN];
+        size_t probe_len = sizeof(header);
+        if ((off_t) probe_len > stat_buf.st_size - offset) {
+            probe_len = stat_buf.st_size - offset;
+        }
+        ssize_t bytes_read = pread(fd, header, probe_len, offset);
+        STATS_SYSCALL(STATS_SYS_READ, bytes_read > 0 ? bytes_read : 0, 0);
+        if (bytes_read == -1) {
+            perror("Error reading tar file");
+            frame_table_free(table);
+            return -1;
+        }
+        size_t data_start, compressed_size, uncompressed_size;
+        if (parse_frame_header(header, bytes_read, &data_start, &compressed_size,
+                               &uncompressed_size, &footer) ||
+            compressed_size < data_start + GZIP_TRAILER_LEN ||
+            offset + (off_t) compressed_size > stat_buf.st_size) {
+            frame_table_free(table);
+            return 1;
+        }
+        if (uncompressed_size == 0) {
+            offset += compressed_size;
+            continue;
+        }
+
+        if (table->num_frames == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            frame_info_t *frames = realloc(table->frames, capacity * sizeof(frame_info_t));
+            if (frames == NULL) {
+                perror("Error allocating frame table");
+                frame_table_free(table);
+                return -1;
+            }
+            table->frames = frames;
+        }
+        frame_info_t *frame = &table->frames[table->num_frames++];
+        frame->compressed_offset = offset;
+        frame->compressed_size = compressed_size;
+        frame->uncompressed_offset = table->uncompressed_size;
+        frame->uncompressed_size = uncompressed_size;
+        frame->footer = footer;
+        table->uncompressed_size += uncompressed_size;
+        offset += compressed_size;
+    }
+    return 0;
+}
+
+int frame_decompress(int fd, const frame_info_t *frame, char *out) {
+    unsigned char *in = malloc(frame->compressed_size);
+    if (in == NULL) {
+        perror("Error allocating decompression buffer");
+        return -1;
+    }
+    ssize_t bytes_read = pread(fd, in, frame->compressed_size, frame->compressed_offset);
+    STATS_SYSCALL(STATS_SYS_READ, bytes_read > 0 ? bytes_read : 0, 0);
+    if (bytes_read != (ssize_t) frame->compressed_size) {
+        if (bytes_read == -1) {
+            perror("Error reading tar file");
+        } else {
+            fprintf(stderr, "Error: compressed archive is truncated\n");
+        }
+        free(in);
+        return -1;
+    }
+
+    size_t data_start, compressed_size, uncompressed_size;
+    int footer;
+    if (parse_frame_header(in, frame->compressed_size, &data_start, &compressed_size, &uncompressed_size,
+                           &footer) ||
+        frame->compressed_size < data_start + GZIP_TRAILER_LEN) {
+        fprintf(stderr, "Error: corrupt frame in compressed archive\n");
+        free(in);
+        return -1;
+    }
+
+    // The frame holds raw deflate data between its header and its trailer
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int ret = inflateInit2(&zs, -MAX_WBITS);
+    if (ret != Z_OK) {
+        fprintf(stderr, "Error initializing decompressor\n");
+        free(in);
+        return -1;
+    }
+    zs.next_in = in + data_start;
+    zs.avail_in = frame->compressed_size - data_start - GZIP_TRAILER_LEN;
+    zs.next_out = (unsigned char *) out;
+    zs.avail_out = frame->uncompressed_size;
+    ret = inflate(&zs, Z_FINISH);
+    size_t produced = zs.total_out;
+    inflateEnd(&zs);
+
+    const unsigned char *trailer = in + frame->compressed_size - GZIP_TRAILER_LEN;
+    int valid = ret == Z_STREAM_END && produced == frame->uncompressed_size &&
+                get_le32(trailer) == crc32(0, (const unsigned char *) out, produced) &&
+                get_le32(trailer + 4) == (uint32_t) produced;
+    free(in);
+    if (!valid) {
+        fprintf(stderr, "Error: corrupt frame in compressed archive\n");
+        return -1;
+    }
+    return 0;
+}
+
+int frame_is_footer(int fd, const frame_info_t *frame) {
+    if (frame->footer) {
+        return 1;
+    }
+    if (frame->uncompressed_size != FOOTER_LEN) {
+        return 0;
+    }
+    char data[FOOTER_LEN];
+    if (frame_decompress(fd, frame, data)) {
+        return -1;
+    }
+    for (size_t i = 0; i < FOOTER_LEN; i++) {
+        if (data[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int frame_erase(int fd, const frame_info_t *frame) {
+    // Header with the usual 'M','T' subfield, then a comment taking up
+    // whatever length is left over, including its terminating null
+    size_t min_len = FRAME_HEADER_LEN + sizeof(empty_deflate) + GZIP_TRAILER_LEN;
+    if (frame->compressed_size < min_len || frame->compressed_size > FRAME_PROBE_LEN) {
+        fprintf(stderr, "Error: unexpected footer frame in compressed archive\n");
+        return -1;
+    }
+    unsigned char out[FRAME_PROBE_LEN];
+    memset(out, ' ', sizeof(out));
+    size_t comment_len = frame->compressed_size - min_len;
+    out[0] = 0x1f;
+    out[1] = 0x8b;
+    out[2] = Z_DEFLATED;
+    out[3] = GZIP_FLAG_EXTRA | (comment_len > 0 ? GZIP_FLAG_COMMENT : 0);
+    put_le32(out + 4, 0);
+    out[8] = 0;
+    out[9] = 3;
+    put_le16(out + 10, 4 + FRAME_FIELD_LEN);
+    out[12] = 'M';
+    out[13] = 'T';
+    put_le16(out + 14, FRAME_FIELD_LEN);
+    put_le32(out + 16, frame->compressed_size);
+    put_le32(out + 20, 0);
+    size_t pos = FRAME_HEADER_LEN + comment_len;
+    if (comment_len > 0) {
+        out[pos - 1] = '\0';
+    }
+    memcpy(out + pos, empty_deflate, sizeof(empty_deflate));
+    pos += sizeof(empty_deflate);
+    // The CRC and length of no data are both 0
+    put_le32(out + pos, 0);
+    put_le32(out + pos + 4, 0);
+
+    STATS_SYSCALL(STATS_SYS_WRITE, 0, frame->compressed_size);
+    if (pwrite(fd, out, frame->compressed_size, frame->compressed_offset) != (ssize_t) frame->compressed_size) {
+        perror("Error erasing footer frame");
+        return -1;
+    }
+    return 0;
+}
+
+struct inflate_stream {
+    z_stream zs;
+    unsigned char in[INFLATE_IN_SIZE];
+    // Set once the input is exhausted, and while a gzip member is only partly read
+    int eof;
+    int in_member;
+};
+
+inflate_stream_t *inflate_stream_new(const char *pending, size_t pending_len) {
+    inflate_stream_t *stream = malloc(sizeof(inflate_stream_t));
+    if (stream == NULL) {
+        perror("Error allocating decompressor");
+        return NULL;
+    }
+    memset(&stream->zs, 0, sizeof(stream->zs));
+    // 16 + MAX_WBITS selects the gzip wrapper
+    if (inflateInit2(&stream->zs, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "Error initializing decompressor\n");
+        free(stream);
+        return NULL;
+    }
+    if (pending_len > INFLATE_IN_SIZE) {
+        pending_len = INFLATE_IN_SIZE;
+    }
+    memcpy(stream->in, pending, pending_len);
+    stream->zs.next_in = stream->in;
+    stream->zs.avail_in = pending_len;
+    stream->eof = 0;
+    stream->in_member = 0;
+    return stream;
+}
+
+ssize_t inflate_stream_read(inflate_stream_t *stream, int fd, char *out, size_t len) {
+    z_stream *zs = &stream->zs;
+    zs->next_out = (unsigned char *) out;
+    zs->avail_out = len;
+
+    while (zs->avail_out == len) {
+        if (zs->avail_in == 0) {
+            if (stream->eof) {
+                break;
+            }
+            ssize_t bytes_read = read(fd, stream->in, INFLATE_IN_SIZE);
+            if (bytes_read == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error reading tar file");
+                return -1;
+            }
+            STATS_SYSCALL(STATS_SYS_READ, bytes_read, 0);
+            if (bytes_read == 0) {
+                stream->eof = 1;
+                if (stream->in_member) {
+                    fprintf(stderr, "Error: compressed archive is truncated\n");
+                    return -1;
+                }
+                break;
+            }
+            zs->next_in = stream->in;
+            zs->avail_in = bytes_read;
+        }
+
+        int ret = inflate(zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            // Another gzip member may follow this one
+            inflateReset(zs);
+            stream->in_member = 0;
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            stream->in_member = 1;
+        } else {
+            fprintf(stderr, "Error: corrupt compressed archive\n");
+            return -1;
+        }
+    }
+    return len - zs->avail_out;
+}
+
+void inflate_stream_free(inflate_stream_t *stream) {
+    if (stream != NULL) {
+        inflateEnd(&stream->zs);
+        free(stream);
+    }
+}
+
+// Life cycle of a compressor slot
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_BUSY, SLOT_DONE };
+
+// One frame on its way through the compressor
+typedef struct {
+    int state;
+    char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    size_t out_capacity;
+    // Set if the input is the archive footer
+    int footer;
+    int failed;
+} frame_slot_t;
+
+struct compressor {
+    int out_fd;
+    // The caller writes to pipe_fds[1], the dispatcher reads pipe_fds[0]
+    int pipe_fds[2];
+    pthread_t dispatcher;
+    pthread_t *workers;
+    int num_workers;
+    // Frame number n lives in slots[n % num_slots] from the time it is
+    // queued until it has been written out
+    frame_slot_t *slots;
+    size_t num_slots;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t done;
+    // Number of frames queued so far, and the next one for a worker to take
+    size_t next_queue;
+    size_t next_claim;
+    // Set once every frame has been queued, and if anything went wrong
+    int finished;
+    int failed;
+};
+
+/*
+ * Compresses a slot's input into a complete frame in its output buffer.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int compress_frame(frame_slot_t *slot) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    size_t header_len = slot->footer ? FOOTER_HEADER_LEN : FRAME_HEADER_LEN;
+    size_t needed = header_len + deflateBound(&zs, slot->in_len) + GZIP_TRAILER_LEN;
+    if (needed > slot->out_capacity) {
+        unsigned char *out = realloc(slot->out, needed);
+        if (out == NULL) {
+            deflateEnd(&zs);
+            return -1;
+        }
+        slot->out = out;
+        slot->out_capacity = needed;
+    }
+
+    zs.next_in = (unsigned char *) slot->in;
+    zs.avail_in = slot->in_len;
+    zs.next_out = slot->out + header_len;
+    zs.avail_out = slot->out_capacity - header_len - GZIP_TRAILER_LEN;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t compressed_len = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        return -1;
+    }
+    slot->out_len = header_len + compressed_len + GZIP_TRAILER_LEN;
+
+    // gzip header: magic, deflate, FEXTRA, no mtime, no extra flags, Unix
+    unsigned char *header = slot->out;
+    header[0] = 0x1f;
+    header[1] = 0x8b;
+    header[2] = Z_DEFLATED;
+    header[3] = GZIP_FLAG_EXTRA;
+    put_le32(header + 4, 0);
+    header[8] = 0;
+    header[9] = 3;
+    put_le16(header + 10, header_len - GZIP_BASE_HEADER_LEN - 2);
+    header[12] = 'M';
+    header[13] = 'T';
+    put_le16(header + 14, FRAME_FIELD_LEN);
+    put_le32(header + 16, slot->out_len);
+    put_le32(header + 20, slot->in_len);
+    if (slot->footer) {
+        header[24] = 'M';
+        header[25] = 'F';
+        put_le16(header + 26, 0);
+    }
+
+    unsigned char *trailer = slot->out + slot->out_len - GZIP_TRAILER_LEN;
+    put_le32(trailer, crc32(0, (const unsigned char *) slot->in, slot->in_len));
+    put_le32(trailer + 4, slot->in_len);
+    return 0;
+}
+
+static void *compress_worker(void *arg) {
+    compressor_t *compressor = arg;
+    pthread_mutex_lock(&compressor->lock);
+    while (1) {
+        while (compressor->next_claim == compressor->next_queue && !compressor->finished) {
+            pthread_cond_wait(&compressor->queued, &compressor->lock);
+        }
+        if (compressor->next_claim == compressor->next_queue) {
+            break;
+        }
+        frame_slot_t *slot = &compressor->slots[compressor->next_claim++ % compressor->num_slots];
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&compressor->lock);
+
+        int failed = compress_frame(slot);
+
+        pthread_mutex_lock(&compressor->lock);
+        slot->failed = failed;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&compressor->done);
+    }
+    pthread_mutex_unlock(&compressor->lock);
+    return NULL;
+}
+
+/*
+ * Waits for the frame in 'slot', if it holds one, to be compressed, writes it
+ * out, and frees the slot. Once anything has failed, frames are dropped
+ * instead of written.
+ */
+static void flush_slot(compressor_t *compressor, frame_slot_t *slot) {
+    // Workers change the state under the lock, so it is only read under it
+    pthread_mutex_lock(&compressor->lock);
+    if (slot->state == SLOT_FREE) {
+        pthread_mutex_unlock(&compressor->lock);
+        return;
+    }
+    while (slot->state != SLOT_DONE) {
+        pthread_cond_wait(&compressor->done, &compressor->lock);
+    }
+    // Only the dispatcher queues frames, so the slot stays this thread's
+    slot->state = SLOT_FREE;
+    pthread_mutex_unlock(&compressor->lock);
+
+    if (slot->failed && !compressor->failed) {
+        fprintf(stderr, "Error compressing archive data\n");
+        compressor->failed = 1;
+    }
+    if (!compressor->failed && write_all(compressor->out_fd, slot->out, slot->out_len)) {
+        perror("Error writing compressed archive");
+        compressor->failed = 1;
+    }
+}
+
+/*
+ * Hands the 'len' bytes at 'data' to the workers as the next frame, marked as
+ * the footer if 'footer' is set. The slot it needs is written out first if it
+ * still holds an earlier frame, which keeps frames in order and bounds the
+ * memory in use.
+ */
+static void queue_frame(compressor_t *compressor, const char *data, size_t len, int footer) {
+    frame_slot_t *slot = &compressor->slots[compressor->next_queue % compressor->num_slots];
+    flush_slot(compressor, slot);
+    memcpy(slot->in, data, len);
+    slot->in_len = len;
+    slot->footer = footer;
+
+    pthread_mutex_lock(&compressor->lock);
+    slot->state = SLOT_QUEUED;
+    compressor->next_queue++;
+    pthread_cond_signal(&compressor->queued);
+    pthread_mutex_unlock(&compressor->lock);
+}
+
+/*
+ * Cuts everything written to the pipe into frames. The last FOOTER_LEN bytes
+ * read are always held back, so that when the input ends they can be queued
+ * as a frame of their own.
+ */
+static void *compress_dispatcher(void *arg) {
+    compressor_t *compressor = arg;
+    size_t capacity = FRAME_SIZE + FOOTER_LEN;
+    char *pending = malloc(capacity);
+    size_t pending_len = 0;
+    if (pending == NULL) {
+        perror("Error allocating compression buffer");
+        compressor->failed = 1;
+    }
+
+    while (1) {
+        char discard[BLOCK_SIZE];
+        char *dest = pending == NULL ? discard : pending + pending_len;
+        size_t room = pending == NULL ? sizeof(discard) : capacity - pending_len;
+        ssize_t bytes_read = read(compressor->pipe_fds[0], dest, room);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == -1) {
+                perror("Error reading archive data to compress");
+                compressor->failed = 1;
+            }
+            break;
+        }
+        // After a failure, keep draining the pipe so the writer never blocks
+        if (pending == NULL) {
+            continue;
+        }
+        pending_len += bytes_read;
+        if (pending_len == capacity) {
+            queue_frame(compressor, pending, FRAME_SIZE, 0);
+            memmove(pending, pending + FRAME_SIZE, FOOTER_LEN);
+            pending_len = FOOTER_LEN;
+        }
+    }
+
+    if (pending != NULL) {
+        if (pending_len > FOOTER_LEN) {
+            queue_frame(compressor, pending, pending_len - FOOTER_LEN, 0);
+            memmove(pending, pending + pending_len - FOOTER_LEN, FOOTER_LEN);
+            pending_len = FOOTER_LEN;
+        }
+        if (pending_len > 0) {
+            int footer = pending_len == FOOTER_LEN;
+            for (size_t i = 0; footer && i < pending_len; i++) {
+                footer = pending[i] == 0;
+            }
+            queue_frame(compressor, pending, pending_len, footer);
+        }
+        free(pending);
+    }
+
+    // Write out whatever frames are still in flight, oldest first
+    size_t first = compressor->next_queue > compressor->num_slots
+                       ? compressor->next_queue - compressor->num_slots
+                       : 0;
+    for (size_t i = first; i < compressor->next_queue; i++) {
+        flush_slot(compressor, &compressor->slots[i % compressor->num_slots]);
+    }
+    return NULL;
+}
+
+/*
+ * Frees a compressor's buffers and synchronization objects once no thread is
+ * using them
+ */
+static void compressor_free(compressor_t *compressor) {
+    for (size_t i = 0; i < compressor->num_slots; i++) {
+        free(compressor->slots[i].in);
+        free(compressor->slots[i].out);
+    }
+    free(compressor->slots);
+    free(compressor->workers);
+    pthread_mutex_destroy(&compressor->lock);
+    pthread_cond_destroy(&compressor->queued);
+    pthread_cond_destroy(&compressor->done);
+    free(compressor);
+}
+
+compressor_t *compressor_start(int out_fd, int num_threads) {
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    compressor_t *compressor = calloc(1, sizeof(compressor_t));
+    if (compressor == NULL) {
+        perror("Error allocating compressor");
+        return NULL;
+    }
+    compressor->out_fd = out_fd;
+    compressor->num_slots = num_threads * SLOTS_PER_THREAD;
+    compressor->slots = calloc(compressor->num_slots, sizeof(frame_slot_t));
+    compressor->workers = calloc(num_threads, sizeof(pthread_t));
+    pthread_mutex_init(&compressor->lock, NULL);
+    pthread_cond_init(&compressor->queued, NULL);
+    pthread_cond_init(&compressor->done, NULL);
+    if (compressor->slots == NULL || compressor->workers == NULL) {
+        perror("Error allocating compressor");
+        compressor_free(compressor);
+        return NULL;
+    }
+    for (size_t i = 0; i < compressor->num_slots; i++) {
+        compressor->slots[i].in = malloc(FRAME_SIZE);
+        if (compressor->slots[i].in == NULL) {
+            perror("Error allocating compressor");
+            compressor_free(compressor);
+            return NULL;
+        }
+    }
+    if (pipe(compressor->pipe_fds) == -1) {
+        perror("Error creating compression pipe");
+        compressor_free(compressor);
+        return NULL;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&compressor->workers[i], NULL, compress_worker, compressor)) {
+            fprintf(stderr, "Error starting compression thread\n");
+            break;
+        }
+        compressor->num_workers++;
+    }
+    if (compressor->num_workers == 0 ||
+        pthread_create(&compressor->dispatcher, NULL, compress_dispatcher, compressor)) {
+        if (compressor->num_workers > 0) {
+            fprintf(stderr, "Error starting compression thread\n");
+        }
+        // Let any workers that did start see there is no work and exit
+        pthread_mutex_lock(&compressor->lock);
+        compressor->finished = 1;
+        pthread_cond_broadcast(&compressor->queued);
+        pthread_mutex_unlock(&compressor->lock);
+        for (int i = 0; i < compressor->num_workers; i++) {
+            pthread_join(compressor->workers[i], NULL);
+        }
+        close(compressor->pipe_fds[0]);
+        close(compressor->pipe_fds[1]);
+        compressor_free(compressor);
+        return NULL;
+    }
+    return compressor;
+}
+
+int compressor_input_fd(const compressor_t *compressor) {
+    return compressor->pipe_fds[1];
+}
+
+int compressor_finish(compressor_t *compressor) {
+    stats_phase_t outer = stats_enter(STATS_PHASE_COMPRESS);
+    // Closing the write end lets the dispatcher see the end of the input
+    close(compressor->pipe_fds[1]);
+    pthread_join(compressor->dispatcher, NULL);
+    close(compressor->pipe_fds[0]);
+
+    pthread_mutex_lock(&compressor->lock);
+    compressor->finished = 1;
+    pthread_cond_broadcast(&compressor->queued);
+    pthread_mutex_unlock(&compressor->lock);
+    for (int i = 0; i < compressor->num_workers; i++) {
+        pthread_join(compressor->workers[i], NULL);
+    }
+
+    int failed = compressor->failed;
+    compressor_free(compressor);
+    stats_leave(outer);
+    return failed ? -1 : 0;
+}
+
+#else
+
+// Built without zlib: compressed archives are recognized but can't be handled
+
+static void no_compression_support(void) {
+    fprintf(stderr, "Error: minitar was built without compression support\n");
+}
+
+int frame_table_load(int fd, frame_table_t *table) {
+    memset(table, 0, sizeof(frame_table_t));
+    no_compression_support();
+    return -1;
+}
+
+int frame_decompress(int fd, const frame_info_t *frame, char *out) {
+    no_compression_support();
+    return -1;
+}
+
+int frame_is_footer(int fd, const frame_info_t *frame) {
+    no_compression_support();
+    return -1;
+}
+
+int frame_erase(int fd, const frame_info_t *frame) {
+    no_compression_support();
+    return -1;
+}
+
+inflate_stream_t *inflate_stream_new(const char *pending, size_t pending_len) {
+    no_compression_support();
+    return NULL;
+}
+
+ssize_t inflate_stream_read(inflate_stream_t *stream, int fd, char *out, size_t len) {
+    return -1;
+}
+
+void inflate_stream_free(inflate_stream_t *stream) {
+}
+
+compressor_t *compressor_start(int out_fd, int num_threads) {
+    no_compression_support();
+    return NULL;
+}
+
+int compressor_input_fd(const compressor_t *compressor) {
+    return -1;
+}
+
+int compressor_finish(compressor_t *compressor) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Compressed archives (-z) are a series of independently compressed frames.
+ * Every frame is a complete gzip member, so the whole archive is an ordinary
+ * multi-member gzip file that gzip and tar -z can read. Each frame's gzip
+ * header carries an extra field (subfield 'M','T') holding the frame's
+ * compressed and uncompressed sizes. Walking those headers yields the frame
+ * offset table without decompressing anything, which lets readers decompress
+ * only the frames they need.
+ * The archive footer is always a frame of its own, marked by an empty 'M','F'
+ * subfield. An append writes its frames after the footer, then erases the old
+ * footer frame in place (see frame_erase), so until that last small write
+ * the archive still ends where it did.
+ */
+
+// Uncompressed bytes per frame (the footer frame and the last data frame are
+// usually shorter)
+#define FRAME_SIZE (1 << 20)
+
+// Location of one frame in the compressed file and in the uncompressed archive
+typedef struct {
+    off_t compressed_offset;
+    size_t compressed_size;
+    off_t uncompressed_offset;
+    size_t uncompressed_size;
+    // Set if the frame is marked as holding the archive footer
+    int footer;
+} frame_info_t;
+
+// Every frame of a compressed archive, in order
+typedef struct {
+    frame_info_t *frames;
+    size_t num_frames;
+    // Size of the whole archive once decompressed
+    off_t uncompressed_size;
+} frame_table_t;
+
+// Opaque state of a streaming decompressor and of a parallel compressor
+typedef struct inflate_stream inflate_stream_t;
+typedef struct compressor compressor_t;
+
+// Determine whether the first 'len' bytes of a file look like gzip data
+int is_compressed(const void *bytes, size_t len);
+
+/*
+ * Build the frame table of the compressed archive open on 'fd' by walking the
+ * frame headers with pread(). The table ends with the first frame marked as
+ * a footer: anything after it was left by an append that never finished.
+ * Erased frames hold nothing and are left out.
+ * Returns 0 on success, 1 if the file is gzip data without the frame size
+ * fields (it can then only be decompressed as a stream), or -1 on error.
+ */
+int frame_table_load(int fd, frame_table_t *table);
+
+// Free the memory held by 'table'
+void frame_table_free(frame_table_t *table);
+
+// Index of the frame holding uncompressed offset 'offset', which must be
+// smaller than the table's uncompressed size
+size_t frame_table_find(const frame_table_t *table, off_t offset);
+
+/*
+ * Decompress 'frame' of the archive open on 'fd' into 'out', which must have
+ * room for the frame's uncompressed size.
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int frame_decompress(int fd, const frame_info_t *frame, char *out);
+
+/*
+ * Determine whether 'frame' holds nothing but an archive footer: either it is
+ * marked as one, or, in archives written before footers were marked, it
+ * decompresses to BLOCK_SIZE * 2 zero bytes.
+ * Returns 1 if it does, 0 if it doesn't, or -1 on error.
+ */
+int frame_is_footer(int fd, const frame_info_t *frame);
+
+/*
+ * Overwrite 'frame' of the archive open on 'fd' with a frame of exactly the
+ * same length that decompresses to nothing, padded with a gzip comment. It
+ * takes a single small pwrite().
+ * Returns 0 on success or -1 if an error occurred.
+ */
+int frame_erase(int fd, const frame_info_t *frame);
+
+/*
+ * Start decompressing gzip data read from a file descriptor as a stream.
+ * 'pending' holds 'pending_len' bytes that were already read from it.
+ * Returns the new decompressor, or NULL if an error occurred.
+ */
+inflate_stream_t *inflate_stream_new(const char *pending, size_t pending_len);
+
+/*
+ * Decompress up to 'len' bytes into 'out', reading more input from 'fd' as
+ * needed. Concatenated gzip members are decompressed one after another.
+ * Returns the number of bytes produced, 0 at the end of the data, or -1 on error.
+ */
+ssize_t inflate_stream_read(inflate_stream_t *stream, int fd, char *out, size_t len);
+
+// Free a decompressor
+void inflate_stream_free(inflate_stream_t *stream);
+
+/*
+ * Start a compressor that writes frames to 'out_fd'. Uncompressed data is
+ * written to the descriptor returned by compressor_input_fd(), cut into
+ * FRAME_SIZE chunks, compressed by 'num_threads' worker threads, and the
+ * frames are written to 'out_fd' in their original order.
+ * Returns the new compressor, or NULL if an error occurred.
+ */
+compressor_t *compressor_start(int out_fd, int num_threads);
+
+// Descriptor that uncompressed data should be written to
+int compressor_input_fd(const compressor_t *compressor);
+
+/*
+ * Signal the end of the uncompressed data, wait until every frame has been
+ * written, and free the compressor. The last BLOCK_SIZE * 2 bytes written
+ * (the archive footer) become a frame of their own, marked as the footer if
+ * they are all zeros.
+ * Returns 0 if everything was compressed and written, -1 otherwise.
+ */
+int compressor_finish(compressor_t *compressor);
+
+#endif
@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "io_util.h"
+#include "stats.h"
+
+// XXH64 primes
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Unaligned little-endian loads
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t dedup_hash(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    // Four independent lanes over each 32-byte stripe
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    h += len;
+
+    // Then whatever is left, 8, 4 and 1 bytes at a time
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t dedup_hash_buffer(const void *data, size_t len) {
+    const char *bytes = data;
+    uint64_t h = 0;
+    for (size_t pos = 0; pos < len; pos += COPY_CHUNK_SIZE) {
+        h = dedup_hash(bytes + pos, len - pos < COPY_CHUNK_SIZE ? len - pos : COPY_CHUNK_SIZE, h);
+    }
+    return h;
+}
+
+int dedup_hash_fd(int fd, off_t size, uint64_t *hash) {
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    uint64_t h = 0;
+    off_t pos = 0;
+    while (pos < size) {
+        size_t chunk = size - pos < COPY_CHUNK_SIZE ? size - pos : COPY_CHUNK_SIZE;
+        size_t filled = 0;
+        while (filled < chunk) {
+            ssize_t nbytes = pread(fd, buf + filled, chunk - filled, pos + filled);
+            if (nbytes == -1 && errno == EINTR) {
+                continue;
+            }
+            STATS_SYSCALL(STATS_SYS_READ, nbytes > 0 ? nbytes : 0, 0);
+            if (nbytes <= 0) {
+                free(buf);
+                return nbytes == 0 ? 1 : -1;
+            }
+            filled += nbytes;
+        }
+        h = dedup_hash(buf, chunk, h);
+        pos += chunk;
+    }
+    free(buf);
+    *hash = h;
+    return 0;
+}
+
+void dedup_table_init(dedup_table_t *table) {
+    memset(table, 0, sizeof(dedup_table_t));
+}
+
+// Find the slot holding the first entry with this size and hash, or the empty
+// slot where it would go
+static size_t find_slot(const dedup_entry_t *slots, size_t capacity, off_t size, uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t slot = (hash ^ (uint64_t) size * PRIME64_1) & mask;
+    while (slots[slot].member_name != NULL &&
+           (slots[slot].size != size || slots[slot].hash != hash)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+const dedup_entry_t *dedup_table_find(const dedup_table_t *table, off_t size, uint64_t hash) {
+    if (table->capacity == 0) {
+        return NULL;
+    }
+    const dedup_entry_t *entry = &table->slots[find_slot(table->slots, table->capacity, size, hash)];
+    return entry->member_name != NULL ? entry : NULL;
+}
+
+// Double the number of slots, rehashing every entry
+// Returns 0 on success, -1 if memory could not be allocated
+static int grow_slots(dedup_table_t *table) {
+    size_t capacity = table->capacity == 0 ? 64 : 2 * table->capacity;
+    dedup_entry_t *slots = calloc(capacity, sizeof(dedup_entry_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; i++) {
+        const dedup_entry_t *entry = &table->slots[i];
+        if (entry->member_name != NULL) {
+            slots[find_slot(slots, capacity, entry->size, entry->hash)] = *entry;
+        }
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->capacity = capacity;
+    return 0;
+}
+
+int dedup_table_add(dedup_table_t *table, off_t size, uint64_t hash, const char *member_name,
+                    const char *file_name) {
+    // Keep the table at most half full so probe sequences stay short
+    if (2 * (table->num_entries + 1) > table->capacity && grow_slots(table)) {
+        return -1;
+    }
+    dedup_entry_t *entry = &table->slots[find_slot(table->slots, table->capacity, size, hash)];
+    // Only the first member with given contents is ever linked to
+    if (entry->member_name != NULL) {
+        return 0;
+    }
+    entry->member_name = strdup(member_name);
+    entry->file_name = strdup(file_name);
+    if (entry->member_name == NULL || entry->file_name == NULL) {
+        free(entry->member_name);
+        free(entry->file_name);
+        entry->member_name = NULL;
+        entry->file_name = NULL;
+        return -1;
+    }
+    entry->size = size;
+    entry->hash = hash;
+    table->num_entries++;
+    return 0;
+}
+
+void dedup_table_free(dedup_table_t *table) {
+    for (size_t i = 0; i < table->capacity; i++) {
+        free(table->slots[i].member_name);
+        free(table->slots[i].file_name);
+    }
+    free(table->slots);
+    dedup_table_init(table);
+}
@@ -0,0 +1,60 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A member whose contents a later identical file can link to instead
+typedef struct {
+    off_t size;
+    uint64_t hash;
+    // Name of the member, and of the file it was archived from
+    char *member_name;
+    char *file_name;
+} dedup_entry_t;
+
+// Open-addressing hash table of the members archived so far, keyed by size
+// and content hash
+typedef struct {
+    dedup_entry_t *slots;
+    // Number of slots (always a power of two, or 0) and slots in use
+    size_t capacity;
+    size_t num_entries;
+} dedup_table_t;
+
+// Initialize a new, empty table
+void dedup_table_init(dedup_table_t *table);
+
+/*
+ * Hash the 'len' bytes at 'data' with XXH64, seeded with 'seed'. Hashing a
+ * file a chunk at a time, each chunk seeded with the hash of the ones before,
+ * gives a hash of its whole contents.
+ */
+uint64_t dedup_hash(const void *data, size_t len, uint64_t seed);
+
+// Hash the 'len' bytes of contents at 'data' a COPY_CHUNK_SIZE chunk at a time
+uint64_t dedup_hash_buffer(const void *data, size_t len);
+
+/*
+ * Hash the first 'size' bytes of the file open on 'fd' the same way
+ * dedup_hash_buffer does, without moving its file offset.
+ * Returns 0 on success, 1 if the file is shorter than 'size', or -1 if an
+ * error occurred (with errno set).
+ */
+int dedup_hash_fd(int fd, off_t size, uint64_t *hash);
+
+// The first member added with this size and content hash, or NULL if none was
+const dedup_entry_t *dedup_table_find(const dedup_table_t *table, off_t size, uint64_t hash);
+
+/*
+ * Record the member 'member_name', archived from 'file_name', whose contents
+ * are 'size' bytes with hash 'hash'. The names are copied.
+ * Returns 0 on success or -1 if memory could not be allocated.
+ */
+int dedup_table_add(dedup_table_t *table, off_t size, uint64_t hash, const char *member_name,
+                    const char *file_name);
+
+// Free everything held by the table and leave it empty
+void dedup_table_free(dedup_table_t *table);
+
+#endif
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../io_util.h"
+#include "../minitar_reader.h"
+
+// Example of reading an archive through libminitar: prints the contents of
+// the named members, or of every member if none are named, to standard
+// output, like "tar -xOf". The archive is read front to back, so it can come
+// from a pipe ("-" for standard input).
+// Usage: minitar_cat ARCHIVE [MEMBER...]
+
+#define BUF_SIZE 65536
+
+// Returns 1 if 'name' is one of the 'num_names' members asked for
+static int wanted(const char *name, int num_names, char **names) {
+    if (num_names == 0) {
+        return 1;
+    }
+    for (int i = 0; i < num_names; i++) {
+        if (!strcmp(name, names[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s ARCHIVE [MEMBER...]\n", argv[0]);
+        return 1;
+    }
+
+    minitar_reader_t reader;
+    if (minitar_reader_open(&reader, argv[1])) {
+        return 1;
+    }
+    char buf[BUF_SIZE];
+    const minitar_member_t *member;
+    int ret;
+    while ((ret = minitar_reader_next(&reader, &member)) == 1) {
+        if (!wanted(member->name, argc - 2, argv + 2)) {
+            continue;
+        }
+        ssize_t nbytes;
+        while ((nbytes = minitar_reader_read(&reader, buf, sizeof(buf))) > 0) {
+            if (write_all(STDOUT_FILENO, buf, nbytes)) {
+                perror("Error writing contents");
+                ret = -1;
+                break;
+            }
+        }
+        if (nbytes == -1 || ret == -1) {
+            ret = -1;
+            break;
+        }
+    }
+    minitar_reader_close(&reader);
+    return ret == -1;
+}
@@ -0,0 +1,104 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../io_util.h"
+#include "../minitar.h"
+#include "../minitar_writer.h"
+
+// Example of writing an archive through libminitar: every NAME=TEXT argument
+// becomes a member NAME holding TEXT and a newline, built from two buffers
+// without any file being read, and every DIR/ argument a directory. The
+// archive goes to standard output through a callback if ARCHIVE is "-", and
+// is otherwise built in memory and then written out, or with -z compressed
+// straight to the file.
+// Usage: minitar_pack [-z] ARCHIVE NAME=TEXT|DIR/...
+
+// Callback that passes the archive on to the stdio stream 'context'
+static int write_stream(void *context, const void *data, size_t nbytes) {
+    return fwrite(data, 1, nbytes, context) == nbytes ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    int compress = argc > 1 && !strcmp(argv[1], "-z");
+    if (argc < 3 + compress) {
+        printf("Usage: %s [-z] ARCHIVE NAME=TEXT|DIR/...\n", argv[0]);
+        return 1;
+    }
+    const char *archive_name = argv[1 + compress];
+    int to_stdout = !strcmp(archive_name, STDIO_ARCHIVE_NAME);
+
+    minitar_writer_t writer;
+    int fd = -1;
+    int ret;
+    if (compress) {
+        fd = to_stdout ? STDOUT_FILENO : open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            perror("Error");
+            return 1;
+        }
+        ret = minitar_writer_open_fd(&writer, fd, 1);
+    } else if (to_stdout) {
+        ret = minitar_writer_open_callback(&writer, write_stream, stdout);
+    } else {
+        ret = minitar_writer_open_memory(&writer);
+    }
+    if (ret) {
+        return 1;
+    }
+
+    for (int i = 2 + compress; ret == 0 && i < argc; i++) {
+        char name[PATH_MAX + 1];
+        const char *equals = strchr(argv[i], '=');
+        size_t len = strlen(argv[i]);
+        int is_dir = equals == NULL && len > 0 && argv[i][len - 1] == '/';
+        if (!is_dir && (equals == NULL || equals == argv[i])) {
+            fprintf(stderr, "Error: expected NAME=TEXT or DIR/, got %s\n", argv[i]);
+            ret = -1;
+            break;
+        }
+        snprintf(name, sizeof(name), "%.*s", is_dir ? (int) len : (int) (equals - argv[i]), argv[i]);
+        minitar_member_t member = {
+            .name = name,
+            .type = is_dir ? DIRTYPE : REGTYPE,
+            .mode = is_dir ? 0755 : 0644,
+            .uid = getuid(),
+            .gid = getgid(),
+            .mtime = -1,
+        };
+        if (is_dir) {
+            ret = minitar_writer_addv(&writer, &member, NULL, 0);
+        } else {
+            struct iovec iov[2] = {{(void *) (equals + 1), strlen(equals + 1)}, {"\n", 1}};
+            member.size = iov[0].iov_len + iov[1].iov_len;
+            ret = minitar_writer_addv(&writer, &member, iov, 2);
+        }
+    }
+    if (ret == 0) {
+        ret = minitar_writer_finish(&writer);
+    }
+    if (ret == 0 && to_stdout && !compress && fflush(stdout)) {
+        perror("Error writing archive");
+        ret = -1;
+    }
+
+    // An archive built in memory is written out in one go
+    size_t len;
+    char *archive = minitar_writer_take_buffer(&writer, &len);
+    if (ret == 0 && archive != NULL) {
+        fd = open(archive_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1 || write_all(fd, archive, len)) {
+            perror("Error writing archive");
+            ret = -1;
+        }
+    }
+    free(archive);
+    minitar_writer_close(&writer);
+    if (fd != -1 && fd != STDOUT_FILENO && close(fd)) {
+        perror("Error closing archive");
+        ret = -1;
+    }
+    return ret != 0;
+}
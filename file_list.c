@@ -1,52 +1,130 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "file_list.h"
 
+#define INITIAL_CAPACITY 16
+// Arena blocks start this large and double as the list grows, up to the
+// maximum. A name too long for a block of the maximum size gets its own.
+#define ARENA_MIN_BLOCK_SIZE 4096
+#define ARENA_MAX_BLOCK_SIZE (1 << 20)
+
+// FNV-1a hash of a name
+static size_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; name[i] != '\0'; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Find the slot holding 'file_name', or the empty slot where it would go
+static size_t find_slot(node_t **buckets, size_t capacity, const char *file_name) {
+    size_t slot = hash_name(file_name) & (capacity - 1);
+    while (buckets[slot] != NULL && strcmp(buckets[slot]->name, file_name) != 0) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+// Double the size of the hash set, rehashing every entry
+// Returns 0 on success, 1 if memory could not be allocated
+static int grow_buckets(file_list_t *list) {
+    size_t capacity = list->capacity == 0 ? INITIAL_CAPACITY : 2 * list->capacity;
+    node_t **buckets = calloc(capacity, sizeof(node_t *));
+    if (buckets == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < list->capacity; i++) {
+        if (list->buckets[i] != NULL) {
+            buckets[find_slot(buckets, capacity, list->buckets[i]->name)] = list->buckets[i];
+        }
+    }
+    free(list->buckets);
+    list->buckets = buckets;
+    list->capacity = capacity;
+    return 0;
+}
+
+// Carve 'nbytes' bytes, aligned for a node, out of the list's arena
+// Returns the memory, or NULL if it could not be allocated
+static void *arena_alloc(file_list_t *list, size_t nbytes) {
+    nbytes = (nbytes + _Alignof(node_t) - 1) & ~(_Alignof(node_t) - 1);
+    arena_block_t *block = list->arena;
+    if (block == NULL || block->capacity - block->used < nbytes) {
+        size_t capacity = block == NULL ? ARENA_MIN_BLOCK_SIZE : 2 * block->capacity;
+        if (capacity > ARENA_MAX_BLOCK_SIZE) {
+            capacity = ARENA_MAX_BLOCK_SIZE;
+        }
+        if (capacity < nbytes) {
+            capacity = nbytes;
+        }
+        block = malloc(sizeof(arena_block_t) + capacity);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = list->arena;
+        block->used = 0;
+        block->capacity = capacity;
+        list->arena = block;
+    }
+    void *memory = block->data + block->used;
+    block->used += nbytes;
+    return memory;
+}
+
 void file_list_init(file_list_t *list) {
     list->head = NULL;
+    list->tail = NULL;
     list->size = 0;
+    list->buckets = NULL;
+    list->capacity = 0;
+    list->num_unique = 0;
+    list->arena = NULL;
 }
 
 int file_list_add(file_list_t *list, const char *file_name) {
-    if (list->head == NULL) {
-        list->head = malloc(sizeof(node_t));
-        if (list->head == NULL) {
-            return 1;
-        }
-        strncpy(list->head->name, file_name, MAX_NAME_LEN);
-        list->head->next = NULL;
-        list->size = 1;
-        return 0;
+    // Keep the hash set at most half full so probe sequences stay short
+    if (2 * (list->num_unique + 1) > list->capacity && grow_buckets(list)) {
+        return 1;
     }
 
-    node_t *current = list->head;
-    while (current->next != NULL) {
-        current = current->next;
-    }
-    current->next = malloc(sizeof(node_t));
-    if (current->next == NULL) {
+    size_t name_len = strlen(file_name) + 1;
+    node_t *node = arena_alloc(list, sizeof(node_t) + name_len);
+    if (node == NULL) {
         return 1;
     }
-    strncpy(current->next->name, file_name, MAX_NAME_LEN);
-    current->next->next = NULL;
+    memcpy(node->name, file_name, name_len);
+    node->next = NULL;
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+    list->tail = node;
     list->size++;
+
+    // Duplicate names stay in the list but only the first is indexed
+    size_t slot = find_slot(list->buckets, list->capacity, node->name);
+    if (list->buckets[slot] == NULL) {
+        list->buckets[slot] = node;
+        list->num_unique++;
+    }
     return 0;
 }
 
 int file_list_contains(const file_list_t *list, const char *file_name) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        if (strcmp(current->name, file_name) == 0) {
-            return 1;
-        }
-        current = current->next;
+    if (list->capacity == 0) {
+        return 0;
     }
-    return 0;
+    return list->buckets[find_slot(list->buckets, list->capacity, file_name)] != NULL;
 }
 
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
-    // This approach is not particularly efficient
+    // Each lookup is a hash probe, so this is linear in the size of l1
     node_t *current = l1->head;
     while (current != NULL) {
         if (!file_list_contains(l2, current->name)) {
@@ -58,12 +136,13 @@ int file_list_is_subset(const file_list_t *l1, const file_list_t *l2) {
 }
 
 void file_list_clear(file_list_t *list) {
-    node_t *current = list->head;
-    while (current != NULL) {
-        node_t *to_free = current;
-        current = current->next;
+    // Every node lives in the arena, so freeing its blocks frees them all
+    arena_block_t *block = list->arena;
+    while (block != NULL) {
+        arena_block_t *to_free = block;
+        block = block->next;
         free(to_free);
     }
-    list->head = NULL;
-    list->size = 0;
+    free(list->buckets);
+    file_list_init(list);
 }
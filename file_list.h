@@ -1,18 +1,38 @@
 #ifndef _FILE_LIST_H
 #define _FILE_LIST_H
-
-#define MAX_NAME_LEN 32
+#include <stddef.h>
 
 //  Definition of each node in the linked list
 typedef struct node {
-    char name[MAX_NAME_LEN];
     struct node *next;
+    // Null-terminated name of any length, stored right after the node
+    char name[];
 } node_t;
 
+// Chunk of memory that nodes are carved out of. Blocks are chained so they
+// can all be freed at once.
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} arena_block_t;
+
 // Linked list definition
 typedef struct {
     node_t *head;
+    // Last node, so that adding to the tail doesn't walk the list
+    node_t *tail;
     int size;
+    // Open-addressing hash set holding the first node for each distinct name,
+    // so membership tests don't walk the list either
+    node_t **buckets;
+    // Number of slots in 'buckets' (always a power of two) and slots in use
+    size_t capacity;
+    size_t num_unique;
+    // Most recently allocated arena block, which new nodes come from. Nodes
+    // are never freed one by one, only all together by file_list_clear.
+    arena_block_t *arena;
 } file_list_t;
 
 // Initialize a new, empty list
@@ -33,4 +53,4 @@ int file_list_contains(const file_list_t *list, const char *file_name);
 // Returns 1 if l1 is a subset of l2, 0 otherwise
 int file_list_is_subset(const file_list_t *l1, const file_list_t *l2);
 
-#endif
\ No newline at end of file
+#endif
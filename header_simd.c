@@ -0,0 +1,146 @@
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "header_simd.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HEADER_SIMD_X86 1
+#endif
+
+#define HEADER_BLOCK_SIZE 512
+
+unsigned header_checksum_scalar(const void *block) {
+    const unsigned char *bytes = block;
+    unsigned sum = 0;
+    for (int i = 0; i < HEADER_BLOCK_SIZE; i++) {
+        sum += bytes[i];
+    }
+    for (int i = HEADER_CHKSUM_OFFSET; i < HEADER_CHKSUM_OFFSET + HEADER_CHKSUM_LEN; i++) {
+        sum += ' ' - bytes[i];
+    }
+    return sum;
+}
+
+long long parse_octal_scalar(const char *field, size_t len) {
+    size_t i = 0;
+    while (i < len && field[i] == ' ') {
+        i++;
+    }
+    size_t start = i;
+    long long value = 0;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++) {
+        if (value > (LLONG_MAX >> 3)) {
+            return -1;
+        }
+        value = (value << 3) | (field[i] - '0');
+    }
+    return i == start ? -1 : value;
+}
+
+#ifdef HEADER_SIMD_X86
+
+// Sum of the checksum field's bytes, which the vector loops add in with the
+// rest of the block and which then get swapped for spaces
+static unsigned chksum_field_sum(const unsigned char *bytes) {
+    unsigned sum = 0;
+    for (int i = HEADER_CHKSUM_OFFSET; i < HEADER_CHKSUM_OFFSET + HEADER_CHKSUM_LEN; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+// psadbw against zero adds up each group of 8 bytes into a 64-bit lane, so
+// the whole block takes 32 loads and adds with SSE2 (always there on x86-64)
+__attribute__((target("sse2")))
+static unsigned header_checksum_sse2(const void *block) {
+    const __m128i *vectors = block;
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (int i = 0; i < HEADER_BLOCK_SIZE / 16; i++) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(vectors + i), zero));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    unsigned sum = _mm_cvtsi128_si32(acc);
+    return sum - chksum_field_sum(block) + HEADER_CHKSUM_LEN * ' ';
+}
+
+// The same with 32-byte vectors, in half as many steps
+__attribute__((target("avx2")))
+static unsigned header_checksum_avx2(const void *block) {
+    const __m256i *vectors = block;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (int i = 0; i < HEADER_BLOCK_SIZE / 32; i++) {
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(vectors + i), zero));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+    unsigned sum = _mm_cvtsi128_si32(half);
+    return sum - chksum_field_sum(block) + HEADER_CHKSUM_LEN * ' ';
+}
+
+/*
+ * Decodes an 8- or 12-byte field in one register: find the run of digits
+ * after any leading spaces, shuffle it to the end of the register behind
+ * zeros, then fold digit pairs with pmaddubsw (d0 * 8 + d1) and pairs of
+ * pairs with pmaddwd (p0 * 64 + p1), which leaves four 12-bit groups of four
+ * digits to join
+ */
+__attribute__((target("ssse3")))
+static long long parse_octal_ssse3(const char *field, size_t len) {
+    // Load the 8 or 12 bytes straight into a register, zeros after them
+    __m128i text = _mm_loadl_epi64((const __m128i *) field);
+    if (len == 12) {
+        uint32_t tail;
+        memcpy(&tail, field + 8, sizeof(tail));
+        text = _mm_unpacklo_epi64(text, _mm_cvtsi32_si128(tail));
+    }
+    __m128i digits = _mm_sub_epi8(text, _mm_set1_epi8('0'));
+    unsigned digit_mask = _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_min_epu8(digits, _mm_set1_epi8(7)), digits));
+    unsigned space_mask = _mm_movemask_epi8(_mm_cmpeq_epi8(text, _mm_set1_epi8(' ')));
+
+    int start = __builtin_ctz(~space_mask);
+    int run = __builtin_ctz(~(digit_mask >> start));
+    if (run == 0) {
+        return -1;
+    }
+
+    // Byte i of the result takes digit start + run - 16 + i, and the bytes
+    // in front of the run get a set high bit, which pshufb turns into zeros
+    __m128i positions = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i control = _mm_add_epi8(positions, _mm_set1_epi8(start + run - 16));
+    control = _mm_or_si128(control, _mm_cmplt_epi8(positions, _mm_set1_epi8(16 - run)));
+    digits = _mm_shuffle_epi8(digits, control);
+
+    __m128i pairs = _mm_maddubs_epi16(digits, _mm_set1_epi16(0x0108));
+    __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00010040));
+    uint64_t low = _mm_cvtsi128_si64(groups);
+    uint64_t high = _mm_cvtsi128_si64(_mm_unpackhi_epi64(groups, groups));
+    return (long long) ((low & 0xfff) << 36 | (low >> 32) << 24 | (high & 0xfff) << 12 | high >> 32);
+}
+
+#endif
+
+unsigned header_checksum(const void *block) {
+#ifdef HEADER_SIMD_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return header_checksum_avx2(block);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return header_checksum_sse2(block);
+    }
+#endif
+    return header_checksum_scalar(block);
+}
+
+long long parse_octal(const char *field, size_t len) {
+#ifdef HEADER_SIMD_X86
+    if ((len == 8 || len == 12) && __builtin_cpu_supports("ssse3")) {
+        return parse_octal_ssse3(field, len);
+    }
+#endif
+    return parse_octal_scalar(field, len);
+}
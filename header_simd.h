@@ -0,0 +1,34 @@
+#ifndef _HEADER_SIMD_H
+#define _HEADER_SIMD_H
+#include <stddef.h>
+
+// Offset and length of the checksum field within a header block
+#define HEADER_CHKSUM_OFFSET 148
+#define HEADER_CHKSUM_LEN 8
+
+/*
+ * Sum of the 512 bytes of the header block at 'block' as unsigned values,
+ * with the checksum field counted as if it held spaces, which is the checksum
+ * POSIX defines for a ustar header. Uses AVX2 or SSE2 when the CPU has them.
+ */
+unsigned header_checksum(const void *block);
+
+/*
+ * Same as header_checksum, one byte at a time. Kept as the fallback for other
+ * CPUs and as the reference the vector code is checked against.
+ */
+unsigned header_checksum_scalar(const void *block);
+
+/*
+ * Parse the 0-padded octal number in the 'len'-byte header field at 'field',
+ * which may start with spaces and need not be null-terminated. The digits end
+ * at the first byte that is not one. Fields of the widths headers use (8 and
+ * 12 bytes) are decoded with SSSE3 when the CPU has it.
+ * Returns the value, or -1 if the field holds no digits (or too many).
+ */
+long long parse_octal(const char *field, size_t len);
+
+// Same as parse_octal, one digit at a time
+long long parse_octal_scalar(const char *field, size_t len);
+
+#endif
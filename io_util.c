@@ -0,0 +1,81 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "io_util.h"
+#include "stats.h"
+
+int write_all(int fd, const void *buf, size_t nbytes) {
+    const char *pos = buf;
+    while (nbytes > 0) {
+        ssize_t written = write(fd, pos, nbytes);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        STATS_SYSCALL(STATS_SYS_WRITE, 0, written);
+        pos += written;
+        nbytes -= written;
+    }
+    return 0;
+}
+
+int copy_range(int out_fd, int in_fd, off_t in_offset, off_t nbytes) {
+    // Try to keep the copy inside the kernel first
+    while (nbytes > 0) {
+        size_t chunk = nbytes > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : nbytes;
+        ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, NULL, chunk, 0);
+        if (copied == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP || errno == EBADF) {
+                break;
+            }
+            return -1;
+        }
+        if (copied == 0) {
+            errno = EIO;
+            return -1;
+        }
+        STATS_SYSCALL(STATS_SYS_COPY, copied, copied);
+        nbytes -= copied;
+    }
+    if (nbytes == 0) {
+        return 0;
+    }
+
+    // Fall back to pread into an aligned buffer
+    void *buf;
+    if (posix_memalign(&buf, COPY_BUF_ALIGN, COPY_CHUNK_SIZE)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    while (nbytes > 0) {
+        size_t chunk = nbytes > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : nbytes;
+        ssize_t bytes_read = pread(in_fd, buf, chunk, in_offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) {
+                errno = EIO;
+            }
+            free(buf);
+            return -1;
+        }
+        STATS_SYSCALL(STATS_SYS_READ, bytes_read, 0);
+        if (write_all(out_fd, buf, bytes_read)) {
+            free(buf);
+            return -1;
+        }
+        in_offset += bytes_read;
+        nbytes -= bytes_read;
+    }
+    free(buf);
+    return 0;
+}
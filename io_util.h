@@ -0,0 +1,20 @@
+#ifndef _IO_UTIL_H
+#define _IO_UTIL_H
+#include <stddef.h>
+#include <sys/types.h>
+
+// Largest amount of data moved by a single copy syscall or buffered read
+#define COPY_CHUNK_SIZE (1 << 20)
+#define COPY_BUF_ALIGN 4096
+
+// Write all 'nbytes' bytes in 'buf' to 'fd', retrying after short writes
+// Returns 0 on success or -1 if an error occurs (with errno set)
+int write_all(int fd, const void *buf, size_t nbytes);
+
+// Copy 'nbytes' bytes starting at offset 'in_offset' of 'in_fd' to the current
+// position of 'out_fd'. The file offset of 'in_fd' is neither used nor changed,
+// so several threads can copy out of the same descriptor at once.
+// Returns 0 on success or -1 if an error occurs (with errno set)
+int copy_range(int out_fd, int in_fd, off_t in_offset, off_t nbytes);
+
+#endif
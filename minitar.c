@@ -1,558 +1,2932 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <grp.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "archive_index.h"
+#include "archive_reader.h"
+#include "compress.h"
+#include "dedup.h"
+#include "header_simd.h"
+#include "io_util.h"
 #include "minitar.h"
+#include "prefetch.h"
+#include "sparse.h"
+#include "stats.h"
+#include "walk.h"
 
 #define NUM_TRAILING_BLOCKS 2
 #define MAX_MSG_LEN 512
+// Headers and small files are gathered into a buffer this large before writing
+#define MEMBER_BUF_SIZE (1 << 20)
+// Largest size the 11 octal digits of a header's size field can hold
+#define MAX_OCTAL_SIZE 077777777777LL
+// Distinct owners (and groups) whose names are remembered by fill_tar_header
+#define NAME_CACHE_SIZE 64
+// Names tried for a temporary file next to an archive before giving up, and
+// room for one
+#define TMP_NAME_ATTEMPTS 100
+#define TMP_PATH_MAX (PATH_MAX + 32)
+
+// Location of one member inside an archive, as found by scan_archive_members
+typedef struct {
+    // Full member name, allocated on the heap
+    char *name;
+    // Offset of the member's first header block, of its data, and just past
+    // its padded data
+    off_t header_offset;
+    off_t data_offset;
+    off_t end_offset;
+    off_t size;
+    // Set for a sparse file, whose data starts with a map of its segments,
+    // and the full size of the file it holds
+    int sparse;
+    off_t real_size;
+    // Modification time recorded in the member's header
+    time_t mtime;
+    // Set for a hard link, which is extracted as a copy of the member it links
+    // to: 'data_offset', 'size', 'sparse' and 'real_size' then describe that
+    // member's data (see resolve_links)
+    int hard_link;
+} member_info_t;
+
+// Selects which members an extraction writes
+typedef struct {
+    // Names or glob patterns to extract, or NULL to extract every member
+    const file_list_t *patterns;
+    // The patterns that contain wildcards, and whether each matched anything
+    const char **globs;
+    int *glob_matched;
+    size_t num_globs;
+} member_filter_t;
+
+// Work shared by the threads of a parallel extraction
+typedef struct {
+    int tar_fd;
+    // Members to extract, largest first
+    const member_info_t *members;
+    size_t num_members;
+    // Index of the next member nobody has claimed yet
+    size_t next;
+    // Set by any worker that fails, so the others stop early
+    int failed;
+} extract_job_t;
+
+// An owner or group name, as it goes into a header's uname or gname field
+typedef struct {
+    unsigned id;
+    char name[32];
+} id_name_t;
+
+// Names that fill_tar_header already looked up. Each owner and group then
+// costs one lookup per run however many files it owns, which matters when
+// lookups go to a directory service. Once full, the oldest entry is replaced.
+typedef struct {
+    id_name_t entries[NAME_CACHE_SIZE];
+    size_t num_entries;
+    size_t next_evict;
+} name_cache_t;
+
+// Output gathered by write_archive_members, written out when it fills up
+typedef struct {
+    char *buf;
+    size_t len;
+    // Set when members are written over the end of an existing archive. The
+    // first block of the members not committed yet goes out as a zero block,
+    // so the archive still ends where it did, and is kept in 'held' (with its
+    // offset) until commit_members writes it in place.
+    int hold;
+    int holding;
+    off_t held_offset;
+    char held[BLOCK_SIZE];
+} member_buffer_t;
+
+minitar_options_t minitar_options;
+
+static name_cache_t owner_names;
+static name_cache_t group_names;
 
 /*
  * Helper function to compute the checksum of a tar header block
- * Performs a simple sum over all bytes in the header in accordance with POSIX
- * standard for tar file structure.
+ * Performs a simple sum over all bytes in the header, as unsigned values with
+ * the checksum field itself counted as blanks, in accordance with POSIX
+ * standard for tar file structure (see header_checksum).
  */
 void compute_checksum(tar_header *header) {
-    // Have to initially set header's checksum to "all blanks"
-    memset(header->chksum, ' ', 8);
-    unsigned sum = 0;
-    char *bytes = (char *)header;
-    for (int i = 0; i < sizeof(tar_header); i++) {
-        sum += bytes[i];
-    }
-    snprintf(header->chksum, 8, "%07o", sum);
+    snprintf(header->chksum, 8, "%07o", header_checksum(header));
 }
 
 /*
- * Populates a tar header block pointed to by 'header' with metadata about
- * the file identified by 'file_name'.
- * Returns 0 on success or -1 if an error occurs
+ * Returns the cached name for 'id', or NULL if it hasn't been looked up yet
  */
-int fill_tar_header(tar_header *header, const char *file_name) {
-    memset(header, 0, sizeof(tar_header));
-    char err_msg[MAX_MSG_LEN];
-    struct stat stat_buf;
-    // stat is a system call to inspect file metadata
-    if (stat(file_name, &stat_buf) != 0) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
-        perror(err_msg);
-        return -1;
+static const char *name_cache_find(const name_cache_t *cache, unsigned id) {
+    for (size_t i = 0; i < cache->num_entries; i++) {
+        if (cache->entries[i].id == id) {
+            return cache->entries[i].name;
+        }
     }
+    return NULL;
+}
 
-    strncpy(header->name, file_name, 100); // Name of the file, null-terminated string
-    snprintf(header->mode, 8, "%07o", stat_buf.st_mode & 07777); // Permissions for file, 0-padded octal
-
-    snprintf(header->uid, 8, "%07o", stat_buf.st_uid); // Owner ID of the file, 0-padded octal
-    struct passwd *pwd = getpwuid(stat_buf.st_uid); // Look up name corresponding to owner ID
-    if (pwd == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
-        perror(err_msg);
-        return -1;
+/*
+ * Remembers 'name' as the name for 'id'
+ */
+static void name_cache_insert(name_cache_t *cache, unsigned id, const char *name) {
+    id_name_t *entry;
+    if (cache->num_entries < NAME_CACHE_SIZE) {
+        entry = &cache->entries[cache->num_entries++];
+    } else {
+        entry = &cache->entries[cache->next_evict];
+        cache->next_evict = (cache->next_evict + 1) % NAME_CACHE_SIZE;
     }
-    strncpy(header->uname, pwd->pw_name, 32); // Owner  name of the file, null-terminated string
+    entry->id = id;
+    strncpy(entry->name, name, sizeof(entry->name));
+}
 
-    snprintf(header->gid, 8, "%07o", stat_buf.st_gid); // Group ID of the file, 0-padded octal
-    struct group *grp = getgrgid(stat_buf.st_gid); // Look up name corresponding to group ID
-    if (grp == NULL) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
-        perror(err_msg);
-        return -1;
+/*
+ * Fills the 32-byte 'uname' field with the name of user 'uid', asking the
+ * system only the first time each user is seen.
+ * Returns 0 on success or -1 if the user has no name
+ */
+static int lookup_owner_name(uid_t uid, char *uname) {
+    const char *name = name_cache_find(&owner_names, uid);
+    if (name == NULL) {
+        stats_phase_t outer = stats_enter(STATS_PHASE_NAMES);
+        struct passwd *pwd = getpwuid(uid);
+        stats_leave(outer);
+        STATS_ADD(name_lookups, 1);
+        if (pwd == NULL) {
+            return -1;
+        }
+        name_cache_insert(&owner_names, uid, pwd->pw_name);
+        name = name_cache_find(&owner_names, uid);
+    } else {
+        STATS_ADD(name_cache_hits, 1);
     }
-    strncpy(header->gname, grp->gr_name, 32); // Group name of the file, null-terminated string
-
-    snprintf(header->size, 12, "%011o", (unsigned)stat_buf.st_size); // File size, 0-padded octal
-    snprintf(header->mtime, 12, "%011o", (unsigned)stat_buf.st_mtime); // Modification time, 0-padded octal
-    header->typeflag = REGTYPE; // File type, always regular file in this project
-    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
-    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
-    snprintf(header->devmajor, 8, "%07o", major(stat_buf.st_dev)); // Major device number, 0-padded octal
-    snprintf(header->devminor, 8, "%07o", minor(stat_buf.st_dev)); // Minor device number, 0-padded octal
-
-    compute_checksum(header);
+    memcpy(uname, name, 32);
     return 0;
 }
 
 /*
- * Removes 'nbytes' bytes from the file identified by 'file_name'
- * Returns 0 upon success, -1 upon error
- * Note: This function uses lower-level I/O syscalls (not stdio), which we'll learn about later
+ * Fills the 32-byte 'gname' field with the name of group 'gid', asking the
+ * system only the first time each group is seen.
+ * Returns 0 on success or -1 if the group has no name
  */
-int remove_trailing_bytes(const char *file_name, size_t nbytes) {
-    char err_msg[MAX_MSG_LEN];
-    // Note: ftruncate does not work with O_APPEND
-    int fd = open(file_name, O_WRONLY);
-    if (fd == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
-        perror(err_msg);
-        return -1;
-    }
-    //  Seek to end of file - nbytes
-    off_t current_pos = lseek(fd, -1 * nbytes, SEEK_END);
-    if (current_pos == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to seek in file %s", file_name);
-        perror(err_msg);
-        close(fd);
-        return -1;
-    }
-    // Remove all contents of file past current position
-    if (ftruncate(fd, current_pos) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to truncate file %s", file_name);
-        perror(err_msg);
-        close(fd);
-        return -1;
-    }
-    if (close(fd) == -1) {
-        snprintf(err_msg, MAX_MSG_LEN, "Failed to close file %s", file_name);
-        perror(err_msg);
-        return -1;
+static int lookup_group_name(gid_t gid, char *gname) {
+    const char *name = name_cache_find(&group_names, gid);
+    if (name == NULL) {
+        stats_phase_t outer = stats_enter(STATS_PHASE_NAMES);
+        struct group *grp = getgrgid(gid);
+        stats_leave(outer);
+        STATS_ADD(name_lookups, 1);
+        if (grp == NULL) {
+            return -1;
+        }
+        name_cache_insert(&group_names, gid, grp->gr_name);
+        name = name_cache_find(&group_names, gid);
+    } else {
+        STATS_ADD(name_cache_hits, 1);
     }
+    memcpy(gname, name, 32);
     return 0;
 }
 
-
-int create_archive(const char *archive_name, const file_list_t *files) {
-
-    // Open/Create tar file
-    FILE* tar_file = fopen(archive_name, "w");
-
-    if (tar_file == NULL) {
-        perror("Error");
-        return -1;
+/*
+ * Stores 'value' in the numeric header field 'field' of 'len' bytes: as
+ * 0-padded octal when it fits in len - 1 digits, and otherwise in the GNU
+ * base-256 form (a leading 0x80 byte, then the value in big-endian binary),
+ * which tar and parse_numeric both understand.
+ */
+static void format_numeric(char *field, size_t len, unsigned long long value) {
+    if (value >> (3 * (len - 1)) == 0) {
+        snprintf(field, len, "%0*llo", (int) len - 1, value);
+        return;
     }
+    for (size_t i = len - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
 
-    
-    node_t *curfile = files->head;
-    for (int i = 0; i<files->size; i++) {
-
-        // Create and populate file header
-        tar_header header;
-
-        if(fill_tar_header(&header, curfile->name)) {
-            perror("Error in creating file header");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
-            return -1;
+/*
+ * Stores 'member_name' in the name field of 'header', or splits it at a slash
+ * between the prefix and name fields when it is too long for the name field
+ * alone, as ustar allows.
+ * Returns 0 if the name fits, or 1 if it doesn't, in which case the name
+ * field holds as much of it as fits
+ */
+static int store_member_name(tar_header *header, const char *member_name) {
+    size_t len = strlen(member_name);
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, member_name, len);
+        return 0;
+    }
+    // The name field gets everything after the first slash that leaves it
+    // short enough (a directory's trailing slash doesn't count)
+    for (size_t i = len - sizeof(header->name) - 1; i < len - 1 && i <= sizeof(header->prefix); i++) {
+        if (member_name[i] == '/' && i > 0) {
+            memcpy(header->prefix, member_name, i);
+            memcpy(header->name, member_name + i + 1, len - i - 1);
+            return 0;
         }
+    }
+    memcpy(header->name, member_name, sizeof(header->name));
+    return 1;
+}
 
-        // Write file header to tar file
-        if (fwrite(&header, sizeof(char), sizeof(tar_header), tar_file) < sizeof(tar_header)) {
-            perror("Error writing header to tar file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+/*
+ * Populates a tar header block pointed to by 'header' with the metadata in
+ * 'stat_buf', which describes the file identified by 'file_name'. The member
+ * is named 'member_name' (see store_member_name) and holds 'size' bytes of
+ * data. The owner and group names are 'uname' and 'gname' if either is not
+ * NULL, and are otherwise looked up unless --numeric-owner was given.
+ * Returns 0 on success, 1 if the name or size couldn't be stored in a way
+ * that every ustar reader understands, so the member needs a PAX extended
+ * header, or -1 if an error occurs
+ */
+static int fill_tar_header_from_stat(tar_header *header, const char *file_name,
+                                     const char *member_name, const struct stat *stat_buf,
+                                     off_t size, const char *uname, const char *gname) {
+    memset(header, 0, sizeof(tar_header));
+    char err_msg[MAX_MSG_LEN];
+    int is_dir = S_ISDIR(stat_buf->st_mode);
+
+    int needs_pax = store_member_name(header, member_name); // Name of the file, split if need be
+    snprintf(header->mode, 8, "%07o", stat_buf->st_mode & 07777); // Permissions for file, 0-padded octal
+
+    format_numeric(header->uid, 8, stat_buf->st_uid); // Owner ID of the file, 0-padded octal
+    format_numeric(header->gid, 8, stat_buf->st_gid); // Group ID of the file, 0-padded octal
+
+    // Owner and group names, left empty for numeric-only headers
+    if (uname != NULL || gname != NULL) {
+        strncpy(header->uname, uname != NULL ? uname : "", sizeof(header->uname));
+        strncpy(header->gname, gname != NULL ? gname : "", sizeof(header->gname));
+    } else if (!minitar_options.numeric_owner) {
+        if (lookup_owner_name(stat_buf->st_uid, header->uname)) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up owner name of file %s", file_name);
+            perror(err_msg);
             return -1;
         }
-        
-        // Open current file to be written to tar file and error check
-        FILE* f = fopen(curfile->name, "r");
-
-        if (f == NULL) {
-            perror("Error");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+        if (lookup_group_name(stat_buf->st_gid, header->gname)) {
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to look up group name of file %s", file_name);
+            perror(err_msg);
             return -1;
         }
+    }
 
-        int bytes_read = 1;
-        char buf[512];
-
-        // Initially fill the buffer with all zero bytes
-        memset(&buf, 0, 512);
-        
-        while (bytes_read) {
-            // Read into buf, which up to this point, will be filled with 0's
-            bytes_read = fread(&buf, sizeof(char), sizeof(buf), f);
-
-            // check that some amount of bytes were read
-            if (bytes_read) {
-                // Write to tar file and error check
-                if (fwrite(&buf, sizeof(char), sizeof(buf), tar_file) < sizeof(buf)) {
-                    perror("Error writing file data to tar file");
-                    if (fclose(tar_file) || fclose(f)) {
-                        perror("Error closing files");
-                    }
-                    return -1;
-                }
-            // Error check fread here
-            } else if (ferror(f)) {
-                perror("Error reading data file");
-                if (fclose(tar_file) || fclose(f)) {
-                    perror("Error closing files");
-                }
-                return -1;
-            }
-
-            // Set buffer to 0 bytes
-            memset(&buf, 0, 512);
-        }
+    format_numeric(header->size, 12, size); // File size, 0-padded octal or base-256 if huge
+    if (size > MAX_OCTAL_SIZE) {
+        needs_pax = 1;
+    }
+    format_numeric(header->mtime, 12, stat_buf->st_mtime); // Modification time, 0-padded octal
+    header->typeflag = is_dir ? DIRTYPE : REGTYPE; // File type: a directory or a regular file
+    strncpy(header->magic, MAGIC, 6); // Special, standardized sequence of bytes
+    memcpy(header->version, "00", 2); // A bit weird, sidesteps null termination
+    snprintf(header->devmajor, 8, "%07o", major(stat_buf->st_dev)); // Major device number, 0-padded octal
+    snprintf(header->devminor, 8, "%07o", minor(stat_buf->st_dev)); // Minor device number, 0-padded octal
 
-        // Close data file and error check
-        if (fclose(f)) {
-            perror("Error closing data file");
-            // Close tar file and error check
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
-            return -1;
-        }
+    compute_checksum(header);
+    return needs_pax;
+}
 
-        curfile = curfile->next;
+/*
+ * Appends the PAX extended header record "key=value" to 'records', which
+ * holds '*len' bytes and has room for 'capacity'.
+ * Returns 0 on success or -1 if it doesn't fit
+ */
+static int add_pax_record(char *records, size_t *len, size_t capacity, const char *key,
+                          const char *value) {
+    // A record's length counts the digits of the length itself
+    size_t body_len = strlen(key) + strlen(value) + 3; // ' ', '=' and '\n'
+    size_t record_len = body_len + 1;
+    while (snprintf(NULL, 0, "%zu", record_len) + body_len != record_len) {
+        record_len++;
     }
-
-    // Write the 2 512-byte zero blocks that act as a footer
-    char footer[1024];
-    memset(&footer, 0, sizeof(footer));
-    
-    // Write footer and error check
-    if (fwrite(&footer, sizeof(char), sizeof(footer), tar_file) < sizeof(footer)) {
-            perror("Error writing footer to tar file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
-            return -1;
+    if (*len + record_len >= capacity) {
+        return -1;
     }
+    *len += snprintf(records + *len, capacity - *len, "%zu %s=%s\n", record_len, key, value);
+    return 0;
+}
 
-    // Close tar file and error check
-    if (fclose(tar_file)) {
-        perror("Error closing tar file");
+/*
+ * Stores the name of the member for the file identified by 'file_name' in
+ * 'member_name', which has room for PATH_MAX + 1 bytes. Directory names end
+ * in a slash, as tar writes them.
+ * Returns 0 on success or -1 if the name is too long
+ */
+static int get_member_name(char *member_name, const char *file_name, const struct stat *stat_buf) {
+    size_t name_len = strlen(file_name);
+    int add_slash = S_ISDIR(stat_buf->st_mode) && name_len > 0 && file_name[name_len - 1] != '/';
+    if (name_len + add_slash > PATH_MAX) {
+        errno = ENAMETOOLONG;
         return -1;
     }
-
+    snprintf(member_name, PATH_MAX + 1, "%s%s", file_name, add_slash ? "/" : "");
     return 0;
 }
 
-int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+int fill_member_headers(char *blocks, size_t *len, const char *file_name, const char *member_name,
+                        const struct stat *stat_buf, const sparse_map_t *sparse, size_t map_len,
+                        const char *link_name, const char *uname, const char *gname) {
+    off_t size = S_ISDIR(stat_buf->st_mode) || link_name != NULL ? 0 : stat_buf->st_size;
+    const char *header_name = member_name;
+    char sparse_name[PATH_MAX + 32];
+    if (sparse != NULL) {
+        // The ustar header gets a stand-in name in a directory of its own,
+        // so tools that don't know the format extract the raw data elsewhere
+        size = map_len + sparse->data_size;
+        const char *slash = strrchr(member_name, '/');
+        int dir_len = slash != NULL ? slash - member_name + 1 : 0;
+        snprintf(sparse_name, sizeof(sparse_name), "%.*sGNUSparseFile.0/%s", dir_len, member_name,
+                 member_name + dir_len);
+        header_name = sparse_name;
+    }
 
-    // Check that the tar file exists
-    if (access(archive_name, F_OK) != 0) {
-        printf("Archive %s doesn't exist\n", archive_name);
-        return -1;
+    tar_header *header = (tar_header *) (blocks + BLOCK_SIZE);
+    int ret = fill_tar_header_from_stat(header, file_name, header_name, stat_buf, size, uname, gname);
+    if (ret != -1 && link_name != NULL) {
+        // Link names aren't split like member names, so a long one needs PAX
+        size_t link_len = strlen(link_name);
+        if (link_len > sizeof(header->linkname)) {
+            link_len = sizeof(header->linkname);
+            ret = 1;
+        }
+        memcpy(header->linkname, link_name, link_len);
+        header->typeflag = LNKTYPE;
+        compute_checksum(header);
+    }
+    if (ret == 0 && sparse == NULL) {
+        memmove(blocks, header, BLOCK_SIZE);
+        *len = BLOCK_SIZE;
+        return 0;
     }
-    
-    // Remove the footer from the tar file
-    int ret = remove_trailing_bytes(archive_name, 1024);
-    if(ret == -1) {
-        perror("Error removing trailing bytes");
+    if (ret == -1) {
         return -1;
     }
 
-    // Open tar file and error check
-    FILE* tar_file = fopen(archive_name, "a");
-    if(tar_file == NULL) {
-        perror("Error opening tar file");
+    // The records follow their own header block, then the member's header
+    char *records = blocks + BLOCK_SIZE;
+    size_t records_len = 0;
+    size_t capacity = MAX_MEMBER_HEADERS_SIZE - 2 * BLOCK_SIZE;
+    tar_header member_header = *header;
+    char number[32];
+    snprintf(number, sizeof(number), "%lld", (long long) size);
+    int failed = add_pax_record(records, &records_len, capacity, "size", number);
+    if (sparse != NULL) {
+        snprintf(number, sizeof(number), "%lld", (long long) sparse->real_size);
+        failed = failed ||
+                 add_pax_record(records, &records_len, capacity, "GNU.sparse.major", "1") ||
+                 add_pax_record(records, &records_len, capacity, "GNU.sparse.minor", "0") ||
+                 add_pax_record(records, &records_len, capacity, "GNU.sparse.name", member_name) ||
+                 add_pax_record(records, &records_len, capacity, "GNU.sparse.realsize", number);
+    } else {
+        failed = failed || add_pax_record(records, &records_len, capacity, "path", member_name);
+    }
+    if (link_name != NULL) {
+        failed = failed || add_pax_record(records, &records_len, capacity, "linkpath", link_name);
+    }
+    if (failed) {
+        errno = ENAMETOOLONG;
         return -1;
     }
+    size_t padded = (records_len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    memset(records + records_len, 0, padded - records_len);
+    memcpy(blocks + BLOCK_SIZE + padded, &member_header, BLOCK_SIZE);
+
+    // The extended header is named after the member, like GNU tar does it
+    tar_header *pax_header = (tar_header *) blocks;
+    memset(pax_header, 0, BLOCK_SIZE);
+    const char *base_name = strrchr(file_name, '/') != NULL ? strrchr(file_name, '/') + 1 : file_name;
+    snprintf(pax_header->name, sizeof(pax_header->name), "PaxHeaders/%.88s", base_name);
+    snprintf(pax_header->mode, 8, "%07o", 0644);
+    memcpy(pax_header->uid, member_header.uid, sizeof(pax_header->uid));
+    memcpy(pax_header->gid, member_header.gid, sizeof(pax_header->gid));
+    format_numeric(pax_header->size, 12, records_len);
+    memcpy(pax_header->mtime, member_header.mtime, sizeof(pax_header->mtime));
+    pax_header->typeflag = PAX_HEADER_TYPE;
+    strncpy(pax_header->magic, MAGIC, 6);
+    memcpy(pax_header->version, "00", 2);
+    compute_checksum(pax_header);
+
+    *len = BLOCK_SIZE + padded + BLOCK_SIZE;
+    return 0;
+}
 
-    node_t *curfile = files->head;
-    for (int i = 0; i<files->size; i++) {
-
-        // Create and populate file header
-        tar_header header;
+/*
+ * Populates a tar header block pointed to by 'header' with metadata about
+ * the file identified by 'file_name'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_tar_header(tar_header *header, const char *file_name) {
+    char err_msg[MAX_MSG_LEN];
+    struct stat stat_buf;
+    // stat is a system call to inspect file metadata
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    if (stat(file_name, &stat_buf) != 0) {
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    off_t size = S_ISDIR(stat_buf.st_mode) ? 0 : stat_buf.st_size;
+    return fill_tar_header_from_stat(header, file_name, file_name, &stat_buf, size, NULL, NULL) == -1 ? -1 : 0;
+}
 
-        // Error check tar header
-        if(fill_tar_header(&header, curfile->name)) {
-            perror("Error in creating file header");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+/*
+ * Copies 'nbytes' bytes of member data from the current position of 'in_fd'
+ * to 'tar_fd'.
+ * The copy stays inside the kernel via copy_file_range, or sendfile when the
+ * two files can't be range-copied (e.g. they live on different filesystems).
+ * If neither is supported we fall back to a large page-aligned buffer.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_file_data(int tar_fd, int in_fd, off_t nbytes) {
+    off_t remaining = nbytes;
+    int use_copy_file_range = 1;
+    int use_sendfile = 1;
+
+    while (remaining > 0) {
+        size_t chunk = remaining > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : remaining;
+        ssize_t copied = -1;
+
+        if (use_copy_file_range) {
+            copied = copy_file_range(in_fd, NULL, tar_fd, NULL, chunk, 0);
+            // Unsupported pair of files, try the next mechanism. Both file offsets
+            // advance with every copy, so switching part way through is safe.
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                 errno == EOPNOTSUPP || errno == EBADF)) {
+                use_copy_file_range = 0;
+                continue;
             }
-            return -1;
-        }
-
-        // Write file header to tar file
-        if (fwrite(&header, sizeof(char), sizeof(tar_header), tar_file) < sizeof(tar_header)) {
-            perror("Error writing header to tar file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+        } else if (use_sendfile) {
+            copied = sendfile(tar_fd, in_fd, NULL, chunk);
+            if (copied == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = 0;
+                continue;
             }
-            return -1;
-        }
-        
-        // Open current file to be written to tar file
-        FILE* f = fopen(curfile->name, "r");
-
-        if (f == NULL) {
-            perror("Error");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+        } else {
+            // Last resort: user-space copy through one big aligned buffer
+            void *buf;
+            if (posix_memalign(&buf, COPY_BUF_ALIGN, COPY_CHUNK_SIZE)) {
+                perror("Error allocating copy buffer");
+                return -1;
             }
-            return -1;
-        }
-
-        int bytes_read = 1;
-        char buf[512];
-
-        // Initially fill the buffer with all zero bytes
-        memset(&buf, 0, 512);
-        
-        while (bytes_read) {
-            // Read into buf, which up to this point, will be filled with 0's
-            bytes_read = fread(&buf, sizeof(char), sizeof(buf), f);
-
-            // Check that some amount of bytes were read
-            if (bytes_read) {
-                // Write to tar file and error check
-                if (fwrite(&buf, sizeof(char), sizeof(buf), tar_file) < sizeof(buf)) {
-                    perror("Error writing file data to tar file");
-                    if (fclose(tar_file) || fclose(f)) {
-                        perror("Error closing files");
+            while (remaining > 0) {
+                chunk = remaining > COPY_CHUNK_SIZE ? COPY_CHUNK_SIZE : remaining;
+                ssize_t bytes_read = read(in_fd, buf, chunk);
+                if (bytes_read == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes_read <= 0) {
+                    if (bytes_read == 0) {
+                        fprintf(stderr, "Error: data file shrank while being archived\n");
+                    } else {
+                        perror("Error reading data file");
                     }
+                    free(buf);
                     return -1;
                 }
-            // Error check fread
-            } else if (ferror(f)) {
-                perror("Error reading data file");
-                if (fclose(tar_file) || fclose(f)) {
-                    perror("Error closing files");
+                STATS_SYSCALL(STATS_SYS_READ, bytes_read, 0);
+                if (write_all(tar_fd, buf, bytes_read)) {
+                    perror("Error writing file data to tar file");
+                    free(buf);
+                    return -1;
                 }
-                return -1;
+                remaining -= bytes_read;
             }
-
-            // Refill buffer with 0 bytes
-            memset(&buf, 0, 512);
+            free(buf);
+            break;
         }
 
-        // Close file and error check
-        if (fclose(f)) {
-            perror("Error closing data file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+        if (copied == -1) {
+            if (errno == EINTR) {
+                continue;
             }
+            perror("Error copying file data to tar file");
             return -1;
         }
-
-        curfile = curfile->next;
-    }
-
-    // Fill 1024-byte buffer with zero bytes that act as 2-512 byte footer blocks
-    char footer[1024];
-    memset(&footer, 0, sizeof(footer));
-    
-    // Write footer and error check
-    if (fwrite(&footer, sizeof(char), sizeof(footer), tar_file) < sizeof(footer)) {
-            perror("Error writing footer to tar file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+        if (copied == 0) {
+            fprintf(stderr, "Error: data file shrank while being archived\n");
             return -1;
+        }
+        STATS_SYSCALL(STATS_SYS_COPY, copied, copied);
+        remaining -= copied;
     }
+    return 0;
+}
 
-    // Close file and error check
-    if (fclose(tar_file)) {
-        perror("Error closing tar file");
+/*
+ * Pads a member whose data was 'nbytes' long out to a whole number of blocks
+ * with zero bytes, in a single write.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member_padding(int tar_fd, off_t nbytes) {
+    static const char zero_block[BLOCK_SIZE];
+    size_t padding = (BLOCK_SIZE - nbytes % BLOCK_SIZE) % BLOCK_SIZE;
+    if (padding > 0 && write_all(tar_fd, zero_block, padding)) {
+        perror("Error writing padding to tar file");
         return -1;
     }
-
     return 0;
 }
 
-int get_archive_file_list(const char *archive_name, file_list_t *files) {
-
-    // Open tar file and error check
-    FILE* tar_file = fopen(archive_name, "r");
-    if(tar_file == NULL) {
-        perror("Error opening tar file");
+/*
+ * Copies 'nbytes' bytes from the current position of 'in_fd' to 'tar_fd'
+ * (see copy_file_data), then writes the padding that rounds the member up
+ * to a whole block.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_member_data(int tar_fd, int in_fd, off_t nbytes) {
+    if (copy_file_data(tar_fd, in_fd, nbytes)) {
         return -1;
     }
+    return write_member_padding(tar_fd, nbytes);
+}
 
-
-    int convertedSize = 1;
-
-    while(convertedSize != 0) {
-        tar_header header;
-
-        // Read tar data into header object and error check
-        fread(&header, 1, sizeof(tar_header), tar_file);
-        if(ferror(tar_file)) {
-            perror("Error reading");
-            return -1;
-        }
-
-        // Convert read header data into integer representing file size
-        convertedSize = 0;
-        int num_scanned = sscanf(header.size, "%o", &convertedSize);
-        if(convertedSize < 1) {
-            break;
+/*
+ * Copies the data segments of the sparse file open on 'in_fd', as listed in
+ * 'map', to 'tar_fd' one after another, then pads them out to a whole block.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_sparse_data(int tar_fd, int in_fd, const sparse_map_t *map, size_t map_len) {
+    for (size_t i = 0; i < map->num_segments; i++) {
+        const sparse_segment_t *segment = &map->segments[i];
+        if (segment->length == 0) {
+            continue;
         }
-
-        // Error check sscanf
-        if(num_scanned < 1) {
-            perror("Error reading header size");
-            // Close tar file and error check
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+        STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+        if (lseek(in_fd, segment->offset, SEEK_SET) == -1) {
+            perror("Error seeking in data file");
             return -1;
         }
-
-        // Add file name to linked list and error check
-        if (file_list_add(files, header.name)) {
-            perror("Error adding file to file list when reading existing archive");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+        if (copy_file_data(tar_fd, in_fd, segment->length)) {
             return -1;
         }
+    }
+    return write_member_padding(tar_fd, map_len + map->data_size);
+}
 
-        // Seek to next header in tar file
-        if (fseek(tar_file, convertedSize + (512 - (convertedSize % 512)), SEEK_CUR)) {
-            perror("Error seeking in file while getting file list from archive");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+/*
+ * Appends 'nbytes' bytes to the output buffer 'out', writing out what it
+ * holds first if they don't fit. Chunks larger than the buffer are written
+ * straight through.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int buffer_output(int tar_fd, member_buffer_t *out, const void *data, size_t nbytes) {
+    if (out->len + nbytes > MEMBER_BUF_SIZE) {
+        if (write_all(tar_fd, out->buf, out->len)) {
             return -1;
         }
-
+        out->len = 0;
+    }
+    if (nbytes > MEMBER_BUF_SIZE) {
+        return write_all(tar_fd, data, nbytes);
     }
+    memcpy(out->buf + out->len, data, nbytes);
+    out->len += nbytes;
+    return 0;
+}
 
-    // Close tar file and error check
-    if (fclose(tar_file)) {
-        perror("Error closing tar file");
+/*
+ * Writes out whatever the output buffer 'out' holds.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int flush_output(int tar_fd, member_buffer_t *out) {
+    if (out->len > 0 && write_all(tar_fd, out->buf, out->len)) {
         return -1;
     }
-    
+    out->len = 0;
     return 0;
 }
 
-int extract_files_from_archive(const char *archive_name) {
-    
-    // Open tar file and error check
-    FILE* tar_file = fopen(archive_name, "r");
-    if(tar_file == NULL) {
-        perror("Error opening tar file");
+/*
+ * Flushes everything written to 'tar_fd' to disk.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int sync_archive(int tar_fd) {
+    STATS_SYSCALL(STATS_SYS_FSYNC, 0, 0);
+    if (fdatasync(tar_fd) == -1) {
+        perror("Error syncing tar file");
         return -1;
     }
-    
-    int convertedSize = 1;
-
-    while(1) {
-
-        tar_header header;
+    return 0;
+}
 
-        // Read tar data into header object and error check
-        fread(&header, 1, sizeof(tar_header), tar_file);
-        if(ferror(tar_file)) {
-            perror("Error reading");
-            return -1;
+/*
+ * Writes the archive footer to the output buffer 'out' and writes out
+ * everything it holds. Members held back (see member_buffer_t) are then
+ * committed: synced unless --sync=none, made part of the archive by writing
+ * their first block over the zero block standing in for it, and synced
+ * again. Unless 'last' is set, the file offset of 'tar_fd' is then moved back
+ * to the footer, for more members to be written over it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int commit_members(int tar_fd, member_buffer_t *out, int last) {
+    static const char footer[NUM_TRAILING_BLOCKS * BLOCK_SIZE];
+    stats_phase_t outer = stats_enter(STATS_PHASE_FOOTER);
+    int ret = 0;
+    if (buffer_output(tar_fd, out, footer, sizeof(footer)) || flush_output(tar_fd, out)) {
+        perror("Error writing footer to tar file");
+        ret = -1;
+    }
+    int sync = minitar_options.sync != SYNC_NONE;
+    if (ret == 0 && out->holding) {
+        if (sync && sync_archive(tar_fd)) {
+            ret = -1;
+        }
+        STATS_SYSCALL(STATS_SYS_WRITE, 0, BLOCK_SIZE);
+        if (ret == 0 && pwrite(tar_fd, out->held, BLOCK_SIZE, out->held_offset) != BLOCK_SIZE) {
+            perror("Error writing header to tar file");
+            ret = -1;
+        }
+        if (ret == 0 && sync && sync_archive(tar_fd)) {
+            ret = -1;
+        }
+        out->holding = 0;
+    }
+    if (ret == 0 && !last) {
+        STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+        if (lseek(tar_fd, -(off_t) sizeof(footer), SEEK_CUR) == -1) {
+            perror("Error seeking in tar file");
+            ret = -1;
         }
+    }
+    stats_leave(outer);
+    return ret;
+}
 
-        // Convert read header data into integer representing file size
-        convertedSize = 0;
-        int num_scanned = sscanf(header.size, "%o", &convertedSize);
+/*
+ * Compares the 'size' bytes of contents of the file being archived, either
+ * in memory at 'data' or open on 'fd', with those of the file 'other_name'.
+ * Returns 1 if they are the same, 0 if they differ (or 'other_name' can no
+ * longer be read), or -1 if an error occurs
+ */
+static int same_file_contents(const char *other_name, int fd, const char *data, off_t size) {
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int other_fd = open(other_name, O_RDONLY);
+    if (other_fd == -1) {
+        return 0;
+    }
+    char *buf = malloc(COPY_CHUNK_SIZE);
+    char *other_buf = malloc(COPY_CHUNK_SIZE);
+    if (buf == NULL || other_buf == NULL) {
+        perror("Error allocating comparison buffers");
+        free(buf);
+        free(other_buf);
+        close(other_fd);
+        return -1;
+    }
 
-        // Breaks overall loop
-        if(convertedSize < 1) {
+    int ret = 1;
+    for (off_t pos = 0; pos < size && ret == 1;) {
+        size_t chunk = size - pos < COPY_CHUNK_SIZE ? size - pos : COPY_CHUNK_SIZE;
+        ssize_t nbytes = pread(other_fd, other_buf, chunk, pos);
+        if (nbytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (nbytes <= 0) {
+            ret = 0;
             break;
         }
-
-        // Error check sscanf
-        if(num_scanned < 1) {
-            perror("Error reading header size");
-            // Close tar file and error check
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+        STATS_SYSCALL(STATS_SYS_READ, nbytes, 0);
+        const char *contents = data != NULL ? data + pos : buf;
+        if (data == NULL && pread(fd, buf, nbytes, pos) != nbytes) {
+            perror("Error reading data file");
+            ret = -1;
+        } else {
+            if (data == NULL) {
+                STATS_SYSCALL(STATS_SYS_READ, nbytes, 0);
             }
-            return -1;
+            ret = memcmp(contents, other_buf, nbytes) == 0;
+            pos += nbytes;
         }
+    }
+    free(buf);
+    free(other_buf);
+    close(other_fd);
+    return ret;
+}
 
-        // Open data file for writing to and error check
-        FILE* data_file = fopen(header.name, "w");
-        if(data_file == NULL) {
-            perror("Error opening data file");
-            // Close tar file and error check
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
-            }
+/*
+ * Finds an earlier member of this run with the same contents as the 'size'
+ * bytes of the regular file 'file_name', in memory at 'data' or open on 'fd'.
+ * Candidates are looked up in 'dedup' by size and content hash, and their
+ * files compared byte for byte, so a hash collision never links two files
+ * that differ. A file with no match is added to 'dedup' as 'member_name'.
+ * On success '*link_name' is set to the name of the matching member, or NULL
+ * if there is none.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int find_duplicate(dedup_table_t *dedup, const char *file_name, const char *member_name,
+                          int fd, const char *data, off_t size, const char **link_name) {
+    *link_name = NULL;
+    uint64_t hash;
+    if (data != NULL) {
+        hash = dedup_hash_buffer(data, size);
+    } else {
+        int ret = dedup_hash_fd(fd, size, &hash);
+        if (ret == 1) {
+            fprintf(stderr, "Error: data file shrank while being archived\n");
+            return -1;
+        }
+        if (ret == -1) {
+            perror("Error reading data file");
             return -1;
         }
+    }
 
-        char buf[512];
-        int num_bytes_read;
+    const dedup_entry_t *entry = dedup_table_find(dedup, size, hash);
+    if (entry != NULL) {
+        int ret = same_file_contents(entry->file_name, fd, data, size);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 1) {
+            *link_name = entry->member_name;
+            return 0;
+        }
+    }
+    if (dedup_table_add(dedup, size, hash, member_name, file_name)) {
+        perror("Error allocating deduplication table");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes one member for the file identified by 'file_name' to 'tar_fd', and
+ * advances '*offset' past it. A directory gets a header and no data.
+ * 'file' is what the prefetcher found out about the file, or NULL if it is
+ * to be stat'ed and opened here, relative to the directory open on 'dir_fd'
+ * by its path_base_name() unless that is AT_FDCWD. Small prefetched files
+ * are added to the output buffer 'out' together with their header, so that
+ * many of them go out in one write. Anything else is copied with
+ * copy_member_data once the buffer has been written out, except that a file
+ * with holes is stored as a sparse member holding only its data segments.
+ * If 'dedup' is not NULL, a file with the same contents as one archived
+ * before it (see find_duplicate) is stored as a hard link to that member.
+ * Returns 0 for a file, 1 for a directory, or -1 if an error occurs
+ */
+static int write_archive_member(int tar_fd, const char *file_name, int dir_fd, prefetched_file_t *file,
+                                member_buffer_t *out, off_t *offset, archive_index_t *index,
+                                dedup_table_t *dedup) {
+    static const char zero_block[BLOCK_SIZE];
+
+    // Create and populate the member's header blocks
+    char headers[MAX_MEMBER_HEADERS_SIZE];
+    size_t headers_len;
+    struct stat stat_buf;
+    if (file != NULL && file->error != 0) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to %s file %s", file->failed_call, file_name);
+        errno = file->error;
+        perror(err_msg);
+        return -1;
+    }
+    stats_phase_t outer = stats_enter(STATS_PHASE_INPUT);
+    const char *at_name = dir_fd != AT_FDCWD ? path_base_name(file_name) : file_name;
+    if (file != NULL) {
+        stat_buf = file->stat_buf;
+    } else {
+        STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+        if (fstatat(dir_fd, at_name, &stat_buf, 0) != 0) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
+            perror(err_msg);
+            stats_leave(outer);
+            return -1;
+        }
+    }
+    int is_dir = S_ISDIR(stat_buf.st_mode);
+    off_t size = is_dir ? 0 : stat_buf.st_size;
+
+    // Large files are opened now, unless the prefetcher already did, since a
+    // file with fewer blocks allocated than its size may have holes, which
+    // are left out of the archive
+    int fd = -1;
+    int in_memory = file != NULL && file->fd == -1;
+    sparse_map_t map;
+    sparse_map_init(&map);
+    char *map_text = NULL;
+    size_t map_len = 0;
+    if (S_ISREG(stat_buf.st_mode) && !in_memory) {
+        if (file != NULL) {
+            fd = file->fd;
+            file->fd = -1;
+        } else {
+            STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+            fd = openat(dir_fd, at_name, O_RDONLY);
+        }
+        if (fd == -1) {
+            perror("Error");
+            stats_leave(outer);
+            return -1;
+        }
+        int ret = 1;
+        if ((off_t) stat_buf.st_blocks * 512 < size) {
+            ret = sparse_map_find(fd, size, &map);
+        }
+        if (ret == 0) {
+            map_len = sparse_map_format(&map, &map_text);
+        }
+        if (ret == -1 || (ret == 0 && map_len == 0)) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to find holes in file %s", file_name);
+            perror(err_msg);
+            sparse_map_free(&map);
+            close(fd);
+            stats_leave(outer);
+            return -1;
+        }
+    }
+    stats_leave(outer);
+    int sparse = map_text != NULL;
+
+    char member_name[PATH_MAX + 1];
+    int ret = 0;
+    if (get_member_name(member_name, file_name, &stat_buf)) {
+        perror("Error in creating file header");
+        ret = -1;
+    }
+    // Sparse files aren't worth hashing around their holes
+    const char *link_name = NULL;
+    if (ret == 0 && dedup != NULL && S_ISREG(stat_buf.st_mode) && !sparse && size > 0) {
+        if (in_memory && file->data_len < size) {
+            fprintf(stderr, "Error: data file shrank while being archived\n");
+            ret = -1;
+        } else {
+            outer = stats_enter(STATS_PHASE_HASH);
+            ret = find_duplicate(dedup, file_name, member_name, fd, in_memory ? file->data : NULL, size,
+                                 &link_name);
+            stats_leave(outer);
+        }
+    }
+    if (ret == 0 && fill_member_headers(headers, &headers_len, file_name, member_name, &stat_buf,
+                                        sparse ? &map : NULL, map_len, link_name, NULL, NULL)) {
+        perror("Error in creating file header");
+        ret = -1;
+    }
+    if (link_name != NULL) {
+        STATS_ADD(dedup_links, 1);
+        STATS_ADD(dedup_bytes, size);
+        size = 0;
+    }
+    off_t stored_size = sparse ? (off_t) map_len + map.data_size : size;
 
-        // Read data from tar file and write to data file loop
-        while(convertedSize > 0) {
+    if (ret == 0 && index != NULL &&
+        archive_index_add(index, member_name, *offset, *offset + headers_len, stored_size, size,
+                          stat_buf.st_mtime, sparse ? INDEX_ENTRY_SPARSE : 0, link_name)) {
+        perror("Error adding member to index");
+        ret = -1;
+    }
+    if (ret == 0 && out->hold && !out->holding) {
+        // The first header waits until the members are committed
+        memcpy(out->held, headers, BLOCK_SIZE);
+        memset(headers, 0, BLOCK_SIZE);
+        out->held_offset = *offset;
+        out->holding = 1;
+    }
+    *offset += headers_len + (stored_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
 
-            if (convertedSize < 512) {
-                num_bytes_read = fread(&buf, 1, convertedSize, tar_file);
+    // Write file header to tar file
+    outer = stats_enter(STATS_PHASE_DATA);
+    if (ret == 0 && buffer_output(tar_fd, out, headers, headers_len)) {
+        perror("Error writing header to tar file");
+        ret = -1;
+    }
+    if (ret == 0 && is_dir) {
+        ret = 1;
+    } else if (ret == 0 && link_name != NULL) {
+        // A hard link has no data
+    } else if (ret == 0 && in_memory) {
+        // A prefetched small file is already in memory
+        size_t padding = (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE;
+        if (file->data_len < size) {
+            fprintf(stderr, "Error: data file shrank while being archived\n");
+            ret = -1;
+        } else if (buffer_output(tar_fd, out, file->data, size) ||
+                   buffer_output(tar_fd, out, zero_block, padding)) {
+            perror("Error writing file data to tar file");
+            ret = -1;
+        }
+    } else if (ret == 0 && sparse) {
+        // The map goes out with the header, then the segments are copied
+        if (buffer_output(tar_fd, out, map_text, map_len) || flush_output(tar_fd, out)) {
+            perror("Error writing header to tar file");
+            ret = -1;
+        } else {
+            ret = copy_sparse_data(tar_fd, fd, &map, map_len);
+        }
+    } else if (ret == 0) {
+        // Copy exactly as many bytes as the header advertises
+        if (flush_output(tar_fd, out)) {
+            perror("Error writing header to tar file");
+            ret = -1;
+        } else {
+            ret = copy_member_data(tar_fd, fd, size);
+        }
+    }
 
-                // Check that nonzero amount of bytes read
-                if (num_bytes_read) {
-                    // Write data to data file from archive and error check via num_bytes_read
-                    if(fwrite(&buf, sizeof(char), num_bytes_read, data_file) < num_bytes_read) {
-                        perror("Error writing data to data file from archive");
-                        // If error occurs, close tar file and data file and assure they close correctly
-                        if (fclose(tar_file) || fclose(data_file)) {
-                            perror("Error closing tar file or data file");
-                        }
-                        return -1;
-                    }
-                // We will only read 0 bytes if an error occurs
-                } else {
-                    // If error occurs, close tar file and data file and assure they close correctly
-                    if (fclose(tar_file) || fclose(data_file)) {
-                        perror("Error closing tar file or data file");
-                    }
-                }
+    stats_leave(outer);
 
-                // Seek to next header in tar file and error check
-                if (fseek(tar_file, 512-num_bytes_read, SEEK_CUR)) {
-                    perror("Error seeking in file while getting file list from archive");
-                    if (fclose(tar_file) || fclose(data_file)) {
-                        perror("Error closing tar file or data file");
-                    }
-                    return -1;
-                }
-                convertedSize = 0;
-            } else {
-                num_bytes_read = fread(&buf, 1, sizeof(buf), tar_file);
-
-                // Check that nonzero amount of bytes read
-                if (num_bytes_read) {
-                    // Write data to data file from archive and error check via num_bytes_read
-                    if(fwrite(&buf, sizeof(char), num_bytes_read, data_file) < num_bytes_read) {
-                        perror("Error writing data to data file from archive");
-                        // If error occurs, close tar file and data file and assure they close correctly
-                        if (fclose(tar_file) || fclose(data_file)) {
-                            perror("Error closing tar file or data file");
-                        }
-                        return -1;
-                    }
-                // We will only read 0 bytes if an error occurs
-                } else {
-                    // If error occurs, close tar file and data file and assure they close correctly
-                    if (fclose(tar_file) || fclose(data_file)) {
-                        perror("Error closing tar file or data file");
-                    }
-                }
+    free(map_text);
+    sparse_map_free(&map);
+    // Close data file and error check
+    if (fd != -1 && close(fd) && ret != -1) {
+        perror("Error closing data file");
+        ret = -1;
+    }
+    if (ret != -1) {
+        STATS_ADD(members, 1);
+    }
+    return ret;
+}
+
+/*
+ * Writes a member for each of the 'num_names' files named in 'names', in
+ * order, to 'tar_fd' (see write_archive_member). If 'dir_fds' is not NULL,
+ * each file is found relative to the directory open on its entry. If
+ * 'expand_dirs' is set, each directory is followed by everything below it,
+ * as found by walk_directory. Those names are written without expanding them
+ * again, since the walk already included their contents.
+ * Unless the sync I/O engine was chosen, files are stat'ed, opened and read
+ * ahead of the writer in batches, but members are still written in order.
+ * With -j, a directory's contents are read ahead while the files listed after
+ * it are still held, so the memory budget is split between the two lists.
+ * With --sync=member, members held back are committed one by one.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_member_list(int tar_fd, const char *const *names, const int *dir_fds, size_t num_names,
+                             member_buffer_t *out, off_t *offset, archive_index_t *index,
+                             dedup_table_t *dedup, int expand_dirs) {
+    prefetcher_t *prefetcher = NULL;
+    if (minitar_options.io_engine != IO_ENGINE_SYNC) {
+        size_t memory_budget = 0;
+        if (minitar_options.read_threads > 1) {
+            memory_budget = minitar_options.memory_budget != 0 ? minitar_options.memory_budget
+                                                                : PREFETCH_DEFAULT_BUDGET;
+            memory_budget /= 2;
+        }
+        prefetcher = prefetcher_start(names, dir_fds, num_names, minitar_options.io_engine,
+                                      minitar_options.read_threads, memory_budget);
+        if (prefetcher == NULL) {
+            return -1;
+        }
+    }
 
-                convertedSize = convertedSize - 512;
+    int ret = 0;
+    for (size_t i = 0; i < num_names && ret == 0; i++) {
+        stats_phase_t outer = stats_enter(STATS_PHASE_INPUT);
+        prefetched_file_t *file = prefetcher != NULL ? prefetcher_next(prefetcher) : NULL;
+        stats_leave(outer);
+        int dir_fd = dir_fds != NULL ? dir_fds[i] : AT_FDCWD;
+        ret = write_archive_member(tar_fd, names[i], dir_fd, file, out, offset, index, dedup);
+        if (prefetcher != NULL) {
+            prefetcher_release(prefetcher);
+        }
+        if (ret != -1 && out->hold && minitar_options.sync == SYNC_MEMBER &&
+            commit_members(tar_fd, out, 0)) {
+            ret = -1;
+        }
+        if (ret == 1) {
+            ret = 0;
+            if (expand_dirs) {
+                path_list_t paths = {NULL, NULL, 0, 0, NULL, 0};
+                stats_phase_t outer = stats_enter(STATS_PHASE_WALK);
+                ret = walk_directory(names[i], &paths);
+                stats_leave(outer);
+                if (ret == 0) {
+                    ret = write_member_list(tar_fd, (const char *const *) paths.paths, paths.dir_fds,
+                                            paths.num_paths, out, offset, index, dedup, 0);
+                }
+                path_list_free(&paths);
             }
         }
+    }
 
-        // Close tar file and error check
-        if (fclose(data_file)) {
-            perror("Error closing data file");
-            if (fclose(tar_file)) {
-                perror("Error closing tar file");
+    if (prefetcher != NULL) {
+        prefetcher_free(prefetcher);
+    }
+    return ret;
+}
+
+/*
+ * Writes a header block followed by the padded contents of every file in
+ * 'files' to the archive open on 'tar_fd', starting at its current offset,
+ * which must be 'offset', and then the footer. Directories are archived
+ * recursively if 'expand_dirs' is set, and on their own otherwise. If
+ * 'index' is not NULL each member is added to it.
+ * If 'hold' is set, 'offset' is where the members of an existing archive end,
+ * and the new members are only made part of it once they have been written
+ * (see commit_members).
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_archive_members(int tar_fd, const file_list_t *files, off_t offset,
+                                 archive_index_t *index, int expand_dirs, int hold) {
+    const char **names = malloc((files->size + 1) * sizeof(const char *));
+    member_buffer_t out;
+    out.len = 0;
+    out.hold = hold;
+    out.holding = 0;
+    out.buf = malloc(MEMBER_BUF_SIZE);
+    if (names == NULL || out.buf == NULL) {
+        perror("Error allocating output buffer");
+        free(names);
+        free(out.buf);
+        return -1;
+    }
+    node_t *curfile = files->head;
+    for (int i = 0; i < files->size; i++) {
+        names[i] = curfile->name;
+        curfile = curfile->next;
+    }
+
+    // Duplicates are only looked for among the members of this one run
+    dedup_table_t dedup;
+    dedup_table_init(&dedup);
+    int ret = write_member_list(tar_fd, names, NULL, files->size, &out, &offset, index,
+                                minitar_options.dedup ? &dedup : NULL, expand_dirs);
+    if (ret == 0 && commit_members(tar_fd, &out, 1)) {
+        ret = -1;
+    }
+    dedup_table_free(&dedup);
+
+    free(out.buf);
+    free(names);
+    return ret;
+}
+
+/*
+ * Writes the 2 512-byte zero blocks that act as the archive footer
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_archive_footer(int tar_fd) {
+    char footer[NUM_TRAILING_BLOCKS * BLOCK_SIZE];
+    memset(footer, 0, sizeof(footer));
+    stats_phase_t outer = stats_enter(STATS_PHASE_FOOTER);
+    int ret = write_all(tar_fd, footer, sizeof(footer));
+    stats_leave(outer);
+    if (ret) {
+        perror("Error writing footer to tar file");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Number of threads that compress a -z archive: one per online CPU
+ */
+static int compress_threads(void) {
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return num_cpus < 1 ? 1 : num_cpus;
+}
+
+/*
+ * Writes the members in 'files' and then a footer to 'tar_fd', whose current
+ * archive offset is 'offset', as write_archive_members does. If 'compress' is
+ * set the data goes through a parallel compressor, so 'offset' is an offset
+ * within the uncompressed archive. Otherwise 'hold' is passed on to
+ * write_archive_members.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int write_archive_tail(int tar_fd, const file_list_t *files, off_t offset,
+                              archive_index_t *index, int compress, int expand_dirs, int hold) {
+    if (!compress) {
+        return write_archive_members(tar_fd, files, offset, index, expand_dirs, hold);
+    }
+
+    compressor_t *compressor = compressor_start(tar_fd, compress_threads());
+    if (compressor == NULL) {
+        return -1;
+    }
+    int in_fd = compressor_input_fd(compressor);
+    int ret = 0;
+    if (write_archive_members(in_fd, files, offset, index, expand_dirs, 0)) {
+        ret = -1;
+    }
+    if (compressor_finish(compressor)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Stores the name of the directory that holds 'file_name' in 'dir', which
+ * has room for PATH_MAX bytes
+ */
+static void get_directory_name(char *dir, const char *file_name) {
+    const char *slash = strrchr(file_name, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        // The root directory keeps its slash
+        int len = slash == file_name ? 1 : slash - file_name;
+        snprintf(dir, PATH_MAX, "%.*s", len, file_name);
+    }
+}
+
+/*
+ * Stores in 'tmp_path', which has room for TMP_PATH_MAX bytes, the name that
+ * try number 'attempt' gives a temporary file next to 'archive_name':
+ * ARCHIVE.tmp.PID.N, so a file of the user's is never taken for one of ours
+ */
+static void get_tmp_name(char *tmp_path, const char *archive_name, unsigned attempt) {
+    snprintf(tmp_path, TMP_PATH_MAX, "%s.tmp.%ld.%u", archive_name, (long) getpid(), attempt);
+}
+
+/*
+ * Creates a temporary file with permissions 'mode' next to 'archive_name',
+ * under a name no other file has, which is stored in 'tmp_path' (see
+ * get_tmp_name).
+ * Returns the new file's descriptor, or -1 if an error occurs
+ */
+static int create_tmp_file(char *tmp_path, const char *archive_name, mode_t mode) {
+    int fd = -1;
+    for (unsigned attempt = 0; attempt < TMP_NAME_ATTEMPTS; attempt++) {
+        get_tmp_name(tmp_path, archive_name, attempt);
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, mode);
+        if (fd != -1 || errno != EEXIST) {
+            break;
+        }
+    }
+    return fd;
+}
+
+/*
+ * Opens a new, unnamed file to write the archive 'archive_name' into, in the
+ * directory it will go in, and sets 'tmp_path' to "". Where O_TMPFILE isn't
+ * supported the file gets a temporary name instead, which is stored in
+ * 'tmp_path' (see create_tmp_file).
+ * Returns the new file's descriptor, or -1 if an error occurs
+ */
+static int open_new_archive(const char *archive_name, char *tmp_path) {
+    char dir[PATH_MAX];
+    get_directory_name(dir, archive_name);
+    tmp_path[0] = '\0';
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int fd = open(dir, O_TMPFILE | O_WRONLY, 0666);
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        fd = create_tmp_file(tmp_path, archive_name, 0666);
+        if (fd == -1) {
+            tmp_path[0] = '\0';
+        }
+    }
+    if (fd == -1) {
+        perror("Error");
+    }
+    return fd;
+}
+
+/*
+ * Gives the new archive open on 'tar_fd' the name 'archive_name', replacing
+ * any file by that name in one step. 'tmp_path' is the archive's temporary
+ * name, or "" if it has none (see open_new_archive). Unless --sync=none, the
+ * archive and then the directory entry are synced to disk.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int publish_new_archive(int tar_fd, const char *archive_name, char *tmp_path) {
+    int sync = minitar_options.sync != SYNC_NONE;
+    stats_phase_t outer = stats_enter(STATS_PHASE_FOOTER);
+    if (sync) {
+        STATS_SYSCALL(STATS_SYS_FSYNC, 0, 0);
+        if (fsync(tar_fd) == -1) {
+            perror("Error syncing tar file");
+            stats_leave(outer);
+            return -1;
+        }
+    }
+    int ret = 0;
+    if (tmp_path[0] == '\0') {
+        // An unnamed file can only be linked to a name that is free, so an
+        // existing archive is replaced by linking a temporary name and
+        // renaming that over it
+        char fd_path[64];
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", tar_fd);
+        ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, archive_name, AT_SYMLINK_FOLLOW);
+        for (unsigned attempt = 0; ret == -1 && errno == EEXIST && attempt < TMP_NAME_ATTEMPTS; attempt++) {
+            get_tmp_name(tmp_path, archive_name, attempt);
+            ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW);
+            if (ret == -1) {
+                tmp_path[0] = '\0';
             }
+        }
+    }
+    if (ret == 0 && tmp_path[0] != '\0' && rename(tmp_path, archive_name) == -1) {
+        ret = -1;
+    }
+    if (ret == -1) {
+        perror("Error putting tar file in place");
+        if (tmp_path[0] != '\0') {
+            unlink(tmp_path);
+        }
+    }
+
+    // The new name only survives a crash once its directory is on disk
+    if (ret == 0 && sync) {
+        char dir[PATH_MAX];
+        get_directory_name(dir, archive_name);
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+        STATS_SYSCALL(STATS_SYS_FSYNC, 0, 0);
+        if (dir_fd == -1 || fsync(dir_fd) == -1) {
+            perror("Error syncing directory of tar file");
+            ret = -1;
+        }
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+    }
+    stats_leave(outer);
+    return ret;
+}
+
+int create_archive(const char *archive_name, const file_list_t *files) {
+
+    // Open a file to create the archive in, or write to standard output
+    int streaming = strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0;
+    int tar_fd;
+    char tmp_path[TMP_PATH_MAX] = "";
+    // An archive being replaced keeps its permissions, and one reached
+    // through a symbolic link is replaced where the link points
+    const char *target = archive_name;
+    char real_path[PATH_MAX];
+    struct stat old_stat;
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    int replacing = !streaming && stat(archive_name, &old_stat) == 0;
+    if (replacing) {
+        if (realpath(archive_name, real_path) == NULL) {
+            perror("Error resolving tar file name");
             return -1;
         }
+        target = real_path;
+    }
+    if (streaming) {
+        tar_fd = dup(STDOUT_FILENO);
+        if (tar_fd == -1) {
+            perror("Error");
+        }
+    } else {
+        tar_fd = open_new_archive(target, tmp_path);
+    }
+    if (tar_fd == -1) {
+        return -1;
+    }
+    if (replacing && fchmod(tar_fd, old_stat.st_mode & 07777) == -1) {
+        perror("Error setting tar file permissions");
+        close(tar_fd);
+        if (tmp_path[0] != '\0') {
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+
+    // Keep an index if asked to, or if the archive we're replacing had one.
+    // There is nowhere to keep one for a stream.
+    archive_index_t index;
+    archive_index_init(&index);
+    int use_index = !streaming && (minitar_options.use_index || archive_index_exists(archive_name));
+
+    // Write members and footer, then put the archive in place
+    int ret = write_archive_tail(tar_fd, files, 0, use_index ? &index : NULL, minitar_options.compress, 1, 0);
+    if (ret == 0 && !streaming) {
+        ret = publish_new_archive(tar_fd, target, tmp_path);
+    } else if (ret == -1 && tmp_path[0] != '\0') {
+        unlink(tmp_path);
     }
 
     // Close tar file and error check
-    if (fclose(tar_file)) {
+    if (close(tar_fd) && ret == 0) {
         perror("Error closing tar file");
+        ret = -1;
+    }
+
+    if (ret == 0 && use_index && archive_index_save(&index, archive_name)) {
+        ret = -1;
+    }
+    archive_index_free(&index);
+    return ret;
+}
+
+/*
+ * Appends to an archive streamed through a pipe: every member read from
+ * standard input is copied to standard output unchanged, followed by the new
+ * members and a fresh footer. Nothing is ever seeked or truncated. Compressed
+ * input is decompressed, and the output is compressed only if asked for.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int append_files_to_stream(const file_list_t *files) {
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, STDIO_ARCHIVE_NAME, MADV_SEQUENTIAL)) {
+        return -1;
+    }
+    compressor_t *compressor = NULL;
+    if (minitar_options.compress) {
+        compressor = compressor_start(STDOUT_FILENO, compress_threads());
+        if (compressor == NULL) {
+            archive_reader_close(&reader);
+            return -1;
+        }
+    }
+    int out_fd = compressor != NULL ? compressor_input_fd(compressor) : STDOUT_FILENO;
+
+    int ret;
+    off_t offset = 0;
+    while ((ret = archive_reader_next(&reader)) == 1) {
+        // Header blocks, then the data with its padding, exactly as it was
+        off_t padded = (reader.data_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        if (write_all(out_fd, reader.extended_headers, reader.extended_headers_len) ||
+            write_all(out_fd, reader.header, BLOCK_SIZE)) {
+            perror("Error writing header to tar file");
+            ret = -1;
+            break;
+        }
+        if (archive_reader_write_range(&reader, reader.data_offset, padded, out_fd)) {
+            ret = -1;
+            break;
+        }
+        STATS_ADD(members, 1);
+        offset = reader.next_header;
+    }
+    archive_reader_close(&reader);
+
+    if (ret == -1 || write_archive_members(out_fd, files, offset, NULL, 1, 0)) {
+        ret = -1;
+    }
+    if (compressor != NULL && compressor_finish(compressor)) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Finds where the new members of an append go in the compressed archive
+ * open on 'tar_fd'. Its last frame has to be the footer, which stays in place
+ * until the new frames are written after it and is then erased.
+ * On success stores the footer frame in '*footer' and the offset of the new
+ * members in the uncompressed archive, which is where the footer starts, in
+ * '*offset'. The new frames go right after the footer frame, over anything
+ * an unfinished append left there.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int find_compressed_append_point(int tar_fd, frame_info_t *footer, off_t *offset) {
+    frame_table_t frames;
+    int ret = frame_table_load(tar_fd, &frames);
+    if (ret == -1) {
+        return -1;
+    }
+    const frame_info_t *last = ret == 0 && frames.num_frames > 0 ? &frames.frames[frames.num_frames - 1] : NULL;
+    int is_footer = last != NULL ? frame_is_footer(tar_fd, last) : 0;
+    if (is_footer == 1) {
+        *footer = *last;
+        *offset = last->uncompressed_offset;
+    } else if (is_footer == 0) {
+        fprintf(stderr, "Error: can only append to compressed archives created by minitar -z\n");
+    }
+    frame_table_free(&frames);
+    return is_footer == 1 ? 0 : -1;
+}
+
+/*
+ * Finds where the members of the uncompressed archive open on 'tar_fd' end,
+ * which is where an append writes new ones: at the first zero block, or at
+ * the end of the file if it has no footer. Anything past that was left by an
+ * append that never finished. The end is read off 'index' if it is not NULL,
+ * and otherwise found by stepping through the headers.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int find_append_point(int tar_fd, const archive_index_t *index, off_t *offset) {
+    if (index != NULL) {
+        *offset = 0;
+        if (index->num_entries > 0) {
+            const index_entry_t *last = &index->entries[index->num_entries - 1];
+            *offset = last->data_offset + (last->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        }
+        return 0;
+    }
+    int fd = dup(tar_fd);
+    if (fd == -1) {
+        perror("Error opening tar file");
+        return -1;
+    }
+    archive_reader_t reader;
+    if (archive_reader_open_fd(&reader, fd, MADV_RANDOM)) {
+        return -1;
+    }
+    stats_phase_t outer = stats_enter(STATS_PHASE_SCAN);
+    int ret;
+    while ((ret = archive_reader_next(&reader)) == 1) {
+    }
+    stats_leave(outer);
+    *offset = reader.header_offset;
+    archive_reader_close(&reader);
+    return ret;
+}
+
+/*
+ * Cuts the archive open on 'tar_fd' off at 'end', if it goes on past it.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int truncate_archive(int tar_fd, off_t end) {
+    struct stat stat_buf;
+    if (end == -1 || fstat(tar_fd, &stat_buf) == -1) {
+        perror("Error truncating tar file");
         return -1;
     }
-    
+    if (stat_buf.st_size > end) {
+        STATS_SYSCALL(STATS_SYS_TRUNCATE, 0, 0);
+        if (ftruncate(tar_fd, end) == -1) {
+            perror("Error truncating tar file");
+            return -1;
+        }
+    }
     return 0;
 }
+
+/*
+ * After a failed append to the uncompressed archive open on 'tar_fd', puts
+ * a footer right after the members committed so far (all of them but those
+ * the zero block standing in for a held header hides) and cuts off the rest,
+ * so no member data the append left behind trails the footer.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int restore_archive_end(int tar_fd) {
+    off_t end;
+    if (find_append_point(tar_fd, NULL, &end)) {
+        return -1;
+    }
+    STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+    if (lseek(tar_fd, end, SEEK_SET) == -1) {
+        perror("Error seeking in tar file");
+        return -1;
+    }
+    if (write_archive_footer(tar_fd)) {
+        return -1;
+    }
+    return truncate_archive(tar_fd, end + NUM_TRAILING_BLOCKS * BLOCK_SIZE);
+}
+
+/*
+ * Appends a member for each file in 'files' to the archive 'archive_name',
+ * which has to be a named file, keeping its index (if it has one) and its
+ * compression. Directories are expanded as write_archive_members does.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int append_members(const char *archive_name, const file_list_t *files, int expand_dirs) {
+
+    // Open the tar file, which has to exist, once for everything
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int tar_fd = open(archive_name, O_RDWR);
+    if (tar_fd == -1) {
+        if (errno == ENOENT) {
+            printf("Archive %s doesn't exist\n", archive_name);
+        } else {
+            perror("Error opening tar file");
+        }
+        return -1;
+    }
+
+    // Bring the index up to date first if one is being kept. A missing or
+    // stale index is rebuilt from the archive before anything changes.
+    archive_index_t index;
+    archive_index_init(&index);
+    int use_index = minitar_options.use_index || archive_index_exists(archive_name);
+    int ret = 0;
+    if (use_index) {
+        ret = archive_index_load(&index, archive_name);
+        if (ret == 1) {
+            ret = archive_index_build(&index, archive_name);
+        }
+    }
+
+    // A compressed archive stays compressed, whether or not -z was given
+    unsigned char magic[2];
+    int compressed = ret == 0 && pread(tar_fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+                     is_compressed(magic, sizeof(magic));
+
+    // Either way the footer stays until the new members are committed: an
+    // uncompressed archive's is written over, and a compressed archive's
+    // frame is erased once the new frames are in place after it.
+    off_t offset = 0;
+    off_t write_at = 0;
+    frame_info_t footer;
+    if (ret == 0 && compressed) {
+        ret = find_compressed_append_point(tar_fd, &footer, &offset);
+        write_at = footer.compressed_offset + footer.compressed_size;
+    } else if (ret == 0) {
+        ret = find_append_point(tar_fd, use_index ? &index : NULL, &offset);
+        write_at = offset;
+    }
+    // Note: copy_file_range does not work with O_APPEND, so seek instead
+    STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+    if (ret == 0 && lseek(tar_fd, write_at, SEEK_SET) == -1) {
+        perror("Error seeking in tar file");
+        ret = -1;
+    }
+
+    // Write new members and a fresh footer
+    int wrote = 0;
+    if (ret == 0) {
+        wrote = 1;
+        ret = write_archive_tail(tar_fd, files, offset, use_index ? &index : NULL, compressed, expand_dirs,
+                                 !compressed);
+    }
+
+    // A compressed archive was only synced as it was written if at all, and
+    // ends at the old footer until that frame is erased. Erasing it commits
+    // the new members, so a sync failing after that is reported but keeps them.
+    int committed = ret == 0;
+    if (ret == 0 && compressed) {
+        stats_phase_t outer = stats_enter(STATS_PHASE_FOOTER);
+        int sync = minitar_options.sync != SYNC_NONE;
+        committed = !(sync && sync_archive(tar_fd)) && frame_erase(tar_fd, &footer) == 0;
+        if (!committed || (sync && sync_archive(tar_fd))) {
+            ret = -1;
+        }
+        stats_leave(outer);
+    }
+
+    // Drop whatever an unfinished append left past the new footer, or on
+    // failure whatever this one wrote past the members it committed
+    if (committed) {
+        if (truncate_archive(tar_fd, lseek(tar_fd, 0, SEEK_CUR))) {
+            ret = -1;
+        }
+    } else if (wrote && compressed) {
+        truncate_archive(tar_fd, write_at);
+    } else if (wrote) {
+        restore_archive_end(tar_fd);
+    }
+
+    // Close file and error check
+    if (close(tar_fd) && ret == 0) {
+        perror("Error closing tar file");
+        ret = -1;
+    }
+
+    if (ret == 0 && use_index && archive_index_save(&index, archive_name)) {
+        ret = -1;
+    }
+    archive_index_free(&index);
+    return ret;
+}
+
+int append_files_to_archive(const char *archive_name, const file_list_t *files) {
+    if (strcmp(archive_name, STDIO_ARCHIVE_NAME) == 0) {
+        return append_files_to_stream(files);
+    }
+    return append_members(archive_name, files, 1);
+}
+
+int get_archive_file_list(const char *archive_name, file_list_t *files) {
+
+    // With a valid index the archive itself never has to be read
+    archive_index_t index;
+    archive_index_init(&index);
+    int ret = archive_index_load(&index, archive_name);
+    if (ret == -1) {
+        return -1;
+    }
+    if (ret == 0) {
+        for (size_t i = 0; i < index.num_entries; i++) {
+            if (file_list_add(files, archive_index_name(&index, &index.entries[i]))) {
+                perror("Error adding file to file list when reading existing archive");
+                archive_index_free(&index);
+                return -1;
+            }
+        }
+        STATS_ADD(members, index.num_entries);
+        archive_index_free(&index);
+        return 0;
+    }
+
+    // Only header pages are needed, so ask the kernel not to read ahead
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        return -1;
+    }
+
+    stats_phase_t outer = stats_enter(STATS_PHASE_SCAN);
+    while ((ret = archive_reader_next(&reader)) == 1) {
+        // Add file name to linked list and error check
+        if (file_list_add(files, reader.name)) {
+            perror("Error adding file to file list when reading existing archive");
+            ret = -1;
+            break;
+        }
+        STATS_ADD(members, 1);
+    }
+    stats_leave(outer);
+
+    archive_reader_close(&reader);
+    return ret;
+}
+
+/*
+ * Sets up 'filter' to select the members named by 'patterns', each of which
+ * is a plain name or a shell glob. A NULL or empty 'patterns' selects every
+ * member. Returns 0 on success or -1 if an error occurs
+ */
+static int member_filter_init(member_filter_t *filter, const file_list_t *patterns) {
+    memset(filter, 0, sizeof(member_filter_t));
+    if (patterns == NULL || patterns->size == 0) {
+        return 0;
+    }
+    filter->patterns = patterns;
+    filter->globs = calloc(patterns->size, sizeof(const char *));
+    filter->glob_matched = calloc(patterns->size, sizeof(int));
+    if (filter->globs == NULL || filter->glob_matched == NULL) {
+        perror("Error allocating member filter");
+        free(filter->globs);
+        free(filter->glob_matched);
+        return -1;
+    }
+    // Every pattern is tried as an exact name first, through the list's hash
+    // set, and only those with wildcard characters go through fnmatch
+    for (node_t *current = patterns->head; current != NULL; current = current->next) {
+        if (strpbrk(current->name, "*?[") != NULL) {
+            filter->globs[filter->num_globs++] = current->name;
+        }
+    }
+    return 0;
+}
+
+// Determine whether the member named 'name' was selected by 'filter'
+static int member_filter_matches(member_filter_t *filter, const char *name) {
+    if (filter->patterns == NULL || file_list_contains(filter->patterns, name)) {
+        return 1;
+    }
+    for (size_t i = 0; i < filter->num_globs; i++) {
+        if (fnmatch(filter->globs[i], name, 0) == 0) {
+            filter->glob_matched[i] = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reports every pattern of 'filter' that matched none of the member names in
+ * 'found' (the same way tar does).
+ * Returns 0 if every pattern matched something, -1 otherwise
+ */
+static int member_filter_report(const member_filter_t *filter, const file_list_t *found) {
+    if (filter->patterns == NULL) {
+        return 0;
+    }
+
+    int ret = 0;
+    size_t glob = 0;
+    for (node_t *current = filter->patterns->head; current != NULL; current = current->next) {
+        int matched = file_list_contains(found, current->name);
+        if (glob < filter->num_globs && filter->globs[glob] == current->name) {
+            matched = matched || filter->glob_matched[glob];
+            glob++;
+        }
+        if (!matched) {
+            fprintf(stderr, "%s: Not found in archive\n", current->name);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static void member_filter_free(member_filter_t *filter) {
+    free(filter->globs);
+    free(filter->glob_matched);
+}
+
+// Frees the names of the 'num_members' entries of 'members', then the array
+static void free_members(member_info_t *members, size_t num_members) {
+    for (size_t i = 0; i < num_members; i++) {
+        free(members[i].name);
+    }
+    free(members);
+}
+
+/*
+ * Records the name, data offset and size of every member of the archive open
+ * in 'reader' that 'filter' selects, in archive order. Other members are
+ * stepped over without touching their data. On success '*members' points to a
+ * heap array of '*num_members' entries, which the caller must free.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int scan_archive_members(archive_reader_t *reader, member_filter_t *filter,
+                                member_info_t **members, size_t *num_members) {
+    size_t capacity = 64;
+    size_t count = 0;
+    member_info_t *list = malloc(capacity * sizeof(member_info_t));
+    if (list == NULL) {
+        perror("Error allocating member table");
+        return -1;
+    }
+
+    int ret;
+    while ((ret = archive_reader_next(reader)) == 1) {
+        if (reader->data_offset + reader->data_size > reader->archive_size) {
+            fprintf(stderr, "Error: archive ends in the middle of member data\n");
+            ret = -1;
+            break;
+        }
+        if (!member_filter_matches(filter, reader->name)) {
+            continue;
+        }
+        // Double the table whenever it fills up
+        if (count == capacity) {
+            member_info_t *bigger = realloc(list, 2 * capacity * sizeof(member_info_t));
+            if (bigger == NULL) {
+                perror("Error allocating member table");
+                ret = -1;
+                break;
+            }
+            list = bigger;
+            capacity *= 2;
+        }
+        member_info_t *member = &list[count];
+        member->name = strdup(reader->name);
+        if (member->name == NULL) {
+            perror("Error allocating member table");
+            ret = -1;
+            break;
+        }
+        count++;
+        member->header_offset = reader->header_offset;
+        member->data_offset = reader->data_offset;
+        member->end_offset = reader->next_header;
+        member->size = reader->data_size;
+        member->sparse = reader->sparse;
+        member->real_size = reader->real_size;
+        member->mtime = reader->mtime;
+        member->hard_link = reader->hard_link;
+    }
+
+    if (ret == -1) {
+        free_members(list, count);
+        return -1;
+    }
+    *members = list;
+    *num_members = count;
+    return 0;
+}
+
+// qsort comparator: by name, then by position in the archive
+static int compare_members_by_name(const void *a, const void *b) {
+    const member_info_t *m1 = a;
+    const member_info_t *m2 = b;
+    int cmp = strcmp(m1->name, m2->name);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (m1->header_offset > m2->header_offset) - (m1->header_offset < m2->header_offset);
+}
+
+// qsort comparator: largest members first
+static int compare_members_by_size(const void *a, const void *b) {
+    const member_info_t *m1 = a;
+    const member_info_t *m2 = b;
+    return (m1->size < m2->size) - (m1->size > m2->size);
+}
+
+// qsort comparator: by position in the archive
+static int compare_members_by_offset(const void *a, const void *b) {
+    const member_info_t *m1 = a;
+    const member_info_t *m2 = b;
+    return (m1->header_offset > m2->header_offset) - (m1->header_offset < m2->header_offset);
+}
+
+/*
+ * Drops every member that a later member of the same name supersedes, so only
+ * the version that extraction would leave on disk remains.
+ * Returns the number of surviving members, which are moved to the front
+ */
+static size_t keep_last_versions(member_info_t *members, size_t num_members) {
+    qsort(members, num_members, sizeof(member_info_t), compare_members_by_name);
+    size_t kept = 0;
+    for (size_t i = 0; i < num_members; i++) {
+        // Within a run of equal names, only the last one is the final version
+        if (i + 1 < num_members && strcmp(members[i].name, members[i + 1].name) == 0) {
+            free(members[i].name);
+            continue;
+        }
+        members[kept++] = members[i];
+    }
+    return kept;
+}
+
+/*
+ * Records the data offset and size of every member listed in 'index' that
+ * 'filter' selects, in the same form as scan_archive_members does. Only the
+ * newest version of each name is kept, which the index's version numbers
+ * tell us without looking at the archive at all.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int index_archive_members(const archive_index_t *index, member_filter_t *filter,
+                                 member_info_t **members, size_t *num_members) {
+    *members = malloc((index->num_entries + 1) * sizeof(member_info_t));
+    if (*members == NULL) {
+        perror("Error allocating member table");
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < index->num_entries; i++) {
+        const char *name = archive_index_name(index, &index->entries[i]);
+        if (archive_index_lookup(index, name) != &index->entries[i] ||
+            !member_filter_matches(filter, name)) {
+            continue;
+        }
+        member_info_t *member = &(*members)[count];
+        member->name = strdup(name);
+        if (member->name == NULL) {
+            perror("Error allocating member table");
+            free_members(*members, count);
+            return -1;
+        }
+        count++;
+        member->header_offset = index->entries[i].header_offset;
+        member->data_offset = index->entries[i].data_offset;
+        member->end_offset = member->data_offset +
+            (index->entries[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        member->size = index->entries[i].size;
+        member->sparse = (index->entries[i].flags & INDEX_ENTRY_SPARSE) != 0;
+        member->real_size = index->entries[i].real_size;
+        member->mtime = index->entries[i].mtime;
+        member->hard_link = (index->entries[i].flags & INDEX_ENTRY_LINK) != 0;
+    }
+    *num_members = count;
+    return 0;
+}
+
+/*
+ * Finds the member that the hard link 'entry' of 'index' links to, following
+ * links to links until it reaches one that holds data.
+ * Returns that member's entry, or NULL if the link points nowhere
+ */
+static const index_entry_t *link_target(const archive_index_t *index, const index_entry_t *entry) {
+    while (entry->flags & INDEX_ENTRY_LINK) {
+        // Targets always come earlier in the archive, so this ends
+        if (entry->link_target == 0) {
+            return NULL;
+        }
+        entry = &index->entries[entry->link_target - 1];
+    }
+    return entry;
+}
+
+// Entry of 'index' for the member whose header starts at 'header_offset', or
+// NULL if there is none. Entries are in archive order, so a binary search works.
+static const index_entry_t *find_index_entry(const archive_index_t *index, off_t header_offset) {
+    size_t lo = 0;
+    size_t hi = index->num_entries;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((off_t) index->entries[mid].header_offset < header_offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < index->num_entries && (off_t) index->entries[lo].header_offset == header_offset) {
+        return &index->entries[lo];
+    }
+    return NULL;
+}
+
+/*
+ * Points every hard link among 'members' at the data of the member it links
+ * to, as recorded in 'index', so it can be extracted like any other member.
+ * Returns 0 on success or -1 if a link has nothing to link to
+ */
+static int resolve_links(const archive_index_t *index, member_info_t *members, size_t num_members) {
+    for (size_t i = 0; i < num_members; i++) {
+        member_info_t *member = &members[i];
+        if (!member->hard_link) {
+            continue;
+        }
+        const index_entry_t *entry = find_index_entry(index, member->header_offset);
+        const index_entry_t *target = entry != NULL ? link_target(index, entry) : NULL;
+        if (target == NULL) {
+            fprintf(stderr, "Error: hard link %s points to no earlier member\n", member->name);
+            return -1;
+        }
+        member->data_offset = target->data_offset;
+        member->size = target->size;
+        member->sparse = (target->flags & INDEX_ENTRY_SPARSE) != 0;
+        member->real_size = target->real_size;
+    }
+    return 0;
+}
+
+// Determine whether any of 'members' is a hard link
+static int has_hard_links(const member_info_t *members, size_t num_members) {
+    for (size_t i = 0; i < num_members; i++) {
+        if (members[i].hard_link) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Records the final version of every member of the archive 'archive_name',
+ * open in 'reader', that 'filter' selects, sorted by name. Superseded
+ * versions are left out.
+ * With a valid index the members come straight from it and the archive is
+ * never read. Otherwise every header has to be visited, since a later version
+ * of a name could appear anywhere up to the end. Hard links are resolved to
+ * the data they link to (see resolve_links), which without an index takes a
+ * second pass over the headers, but only if there are any links.
+ * If 'total' is not NULL, the number and combined data size of the selected
+ * members, superseded versions included, are stored in '*total' and
+ * '*total_bytes'.
+ * Returns 0 on success or -1 if an error occurs (see scan_archive_members)
+ */
+static int find_latest_members(const char *archive_name, archive_reader_t *reader, member_filter_t *filter,
+                               member_info_t **members, size_t *num_members,
+                               size_t *total, off_t *total_bytes) {
+    stats_phase_t outer = stats_enter(STATS_PHASE_SCAN);
+    archive_index_t index;
+    archive_index_init(&index);
+    int ret = archive_index_load(&index, archive_name);
+    if (ret == 0) {
+        ret = index_archive_members(&index, filter, members, num_members);
+        if (ret == 0 && resolve_links(&index, *members, *num_members)) {
+            free_members(*members, *num_members);
+            ret = -1;
+        }
+        if (ret == 0) {
+            qsort(*members, *num_members, sizeof(member_info_t), compare_members_by_name);
+        }
+        for (size_t i = 0; !ret && total != NULL && i < index.num_entries; i++) {
+            if (member_filter_matches(filter, archive_index_name(&index, &index.entries[i]))) {
+                (*total)++;
+                *total_bytes += index.entries[i].size;
+            }
+        }
+    } else if (ret == 1) {
+        ret = scan_archive_members(reader, filter, members, num_members);
+        for (size_t i = 0; !ret && total != NULL && i < *num_members; i++) {
+            *total_bytes += (*members)[i].size;
+        }
+        if (!ret && total != NULL) {
+            *total = *num_members;
+        }
+        if (!ret && has_hard_links(*members, *num_members)) {
+            ret = archive_index_build(&index, archive_name);
+            if (!ret) {
+                ret = resolve_links(&index, *members, *num_members);
+            }
+            if (ret) {
+                free_members(*members, *num_members);
+            }
+        }
+        if (!ret) {
+            *num_members = keep_last_versions(*members, *num_members);
+        }
+    }
+    archive_index_free(&index);
+    stats_leave(outer);
+    return ret ? -1 : 0;
+}
+
+/*
+ * Builds the extraction plan for the archive 'archive_name', open in 'reader':
+ * one entry for the final version of every name selected by 'filter', in
+ * archive order (see find_latest_members). Superseded versions are left out
+ * so their data is never written only to be overwritten later.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int plan_extraction(const char *archive_name, archive_reader_t *reader, member_filter_t *filter,
+                           member_info_t **members, size_t *num_members) {
+    // Count every selected member, including superseded ones, for --stats
+    size_t total = 0;
+    off_t total_bytes = 0;
+    if (find_latest_members(archive_name, reader, filter, members, num_members,
+                            minitar_stats_enabled ? &total : NULL, &total_bytes)) {
+        return -1;
+    }
+    qsort(*members, *num_members, sizeof(member_info_t), compare_members_by_offset);
+
+    if (minitar_stats_enabled) {
+        off_t kept_bytes = 0;
+        for (size_t i = 0; i < *num_members; i++) {
+            kept_bytes += (*members)[i].size;
+        }
+        minitar_stats.plan_members += total;
+        minitar_stats.plan_skipped_members += total - *num_members;
+        minitar_stats.plan_skipped_bytes += total_bytes - kept_bytes;
+        minitar_stats.plan_written_bytes += kept_bytes;
+    }
+    return 0;
+}
+
+/*
+ * Creates the directory 'path' along with any of its parents that don't exist
+ * yet. Directories that already exist are left alone.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int make_directories(const char *path) {
+    char dir[PATH_MAX];
+    size_t len = strnlen(path, sizeof(dir));
+    if (len == sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir, path, len + 1);
+    // Create each component in turn, including the last one if it isn't
+    // followed by a slash
+    for (size_t i = 1; i <= len; i++) {
+        if (dir[i] != '/' && dir[i] != '\0') {
+            continue;
+        }
+        if (dir[i - 1] == '/') {
+            continue;
+        }
+        char c = dir[i];
+        dir[i] = '\0';
+        int ret = mkdir(dir, 0777);
+        dir[i] = c;
+        if (ret == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Creates the member 'name' of an archive being extracted. A name ending in
+ * a slash is a directory, which is created (see make_directories), and
+ * '*data_fd' is set to -1. Anything else is a file, opened for writing and
+ * truncated after creating whatever directories it needs to live in, and
+ * '*data_fd' is set to its descriptor.
+ * Returns 0 on success or -1 if an error occurs (the error is reported)
+ */
+static int create_member_output(const char *name, int *data_fd) {
+    *data_fd = -1;
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '/') {
+        if (make_directories(name)) {
+            char err_msg[MAX_MSG_LEN];
+            snprintf(err_msg, MAX_MSG_LEN, "Failed to create directory %s", name);
+            perror(err_msg);
+            return -1;
+        }
+        STATS_ADD(members, 1);
+        return 0;
+    }
+
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    const char *slash = strrchr(name, '/');
+    if (fd == -1 && errno == ENOENT && slash != NULL) {
+        // The member's directory wasn't archived ahead of it, so make it now
+        char parent[PATH_MAX];
+        snprintf(parent, sizeof(parent), "%.*s", (int) (slash - name), name);
+        if (make_directories(parent) == 0) {
+            STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+            fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        }
+    }
+    if (fd == -1) {
+        perror("Error opening data file");
+        return -1;
+    }
+    *data_fd = fd;
+    STATS_ADD(members, 1);
+    return 0;
+}
+
+/*
+ * Writes the data of the sparse member whose 'size' bytes of data start at
+ * 'data_offset' in the archive open in 'reader' to 'data_fd'. Each data
+ * segment is written at its own offset and the holes are skipped over, then
+ * the file is extended to its full 'real_size', so the holes stay holes
+ * instead of being filled with zeros.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_sparse_data(archive_reader_t *reader, off_t data_offset, off_t size,
+                               off_t real_size, int data_fd) {
+    sparse_map_t map;
+    sparse_map_init(&map);
+    off_t offset;
+    if (archive_reader_read_sparse_map(reader, data_offset, size, real_size, &map, &offset)) {
+        return -1;
+    }
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < map.num_segments; i++) {
+        const sparse_segment_t *segment = &map.segments[i];
+        STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+        if (lseek(data_fd, segment->offset, SEEK_SET) == -1) {
+            perror("Error seeking in data file");
+            ret = -1;
+        } else {
+            ret = archive_reader_write_range(reader, offset, segment->length, data_fd);
+        }
+        offset += segment->length;
+    }
+    sparse_map_free(&map);
+    STATS_SYSCALL(STATS_SYS_TRUNCATE, 0, 0);
+    if (ret == 0 && ftruncate(data_fd, real_size) == -1) {
+        perror("Error setting size of data file");
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Writes the data of the planned member 'member' from the archive open in
+ * 'reader' to 'data_fd'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_member_data(archive_reader_t *reader, const member_info_t *member, int data_fd) {
+    if (member->sparse) {
+        return extract_sparse_data(reader, member->data_offset, member->size, member->real_size, data_fd);
+    }
+    return archive_reader_write_range(reader, member->data_offset, member->size, data_fd);
+}
+
+/*
+ * Worker thread body for parallel extraction: repeatedly claims the next
+ * member and copies its data range out of the shared archive descriptor.
+ * Every copy reads at an explicit offset, so workers never contend on the
+ * descriptor's file position.
+ */
+static void *extract_worker(void *arg) {
+    extract_job_t *job = arg;
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->num_members) {
+            break;
+        }
+        const member_info_t *member = &job->members[i];
+        // Sparse files are left to the thread that owns the reader
+        if (member->sparse) {
+            continue;
+        }
+
+        // Open data file for writing to and error check
+        int data_fd;
+        if (create_member_output(member->name, &data_fd)) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (data_fd == -1) {
+            continue;
+        }
+        if (copy_range(data_fd, job->tar_fd, member->data_offset, member->size)) {
+            perror("Error writing data to data file from archive");
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+        if (close(data_fd)) {
+            perror("Error closing data file");
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Writes the 'num_members' planned 'members' one after another, straight from
+ * the mapping of the archive open in 'reader'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_members_serial(archive_reader_t *reader, const member_info_t *members,
+                                  size_t num_members) {
+    // The members are visited in archive order, so read ahead
+    archive_reader_set_advice(reader, MADV_SEQUENTIAL);
+
+    for (size_t i = 0; i < num_members; i++) {
+
+        // Open data file for writing to and error check
+        int data_fd;
+        if (create_member_output(members[i].name, &data_fd)) {
+            return -1;
+        }
+        if (data_fd == -1) {
+            continue;
+        }
+
+        // Write member data straight from the mapped archive
+        if (extract_member_data(reader, &members[i], data_fd)) {
+            close(data_fd);
+            return -1;
+        }
+
+        // Close data file and error check
+        if (close(data_fd)) {
+            perror("Error closing data file");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the 'num_members' planned 'members' using 'num_threads' workers that
+ * copy out of the archive open in 'reader'. Since the plan holds only the last
+ * version of each name, no two workers ever write the same file. Handing out
+ * the largest members first balances the load. Sparse files are written by
+ * the calling thread while the workers run.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_members_parallel(archive_reader_t *reader, member_info_t *members,
+                                    size_t num_members, int num_threads) {
+    qsort(members, num_members, sizeof(member_info_t), compare_members_by_size);
+
+    extract_job_t job = {
+        .tar_fd = reader->fd,
+        .members = members,
+        .num_members = num_members,
+        .next = 0,
+        .failed = 0,
+    };
+    if ((size_t) num_threads > num_members) {
+        num_threads = num_members > 0 ? num_members : 1;
+    }
+
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("Error allocating worker threads");
+        return -1;
+    }
+    int started = 0;
+    for (; started < num_threads; started++) {
+        int err = pthread_create(&threads[started], NULL, extract_worker, &job);
+        if (err) {
+            errno = err;
+            perror("Error starting worker thread");
+            job.failed = 1;
+            break;
+        }
+    }
+
+    // Meanwhile, write the sparse files, whose maps have to be read through
+    // the reader, on this thread
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < num_members && !__atomic_load_n(&job.failed, __ATOMIC_RELAXED); i++) {
+        int data_fd;
+        if (!members[i].sparse) {
+            continue;
+        }
+        if (create_member_output(members[i].name, &data_fd)) {
+            ret = -1;
+        } else if (extract_member_data(reader, &members[i], data_fd)) {
+            close(data_fd);
+            ret = -1;
+        } else if (close(data_fd)) {
+            perror("Error closing data file");
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return job.failed || ret ? -1 : 0;
+}
+
+/*
+ * Opens the file 'link_name' that the hard link 'name' read from a stream
+ * links to, which has to have been extracted ahead of it since the stream
+ * can't go back to its data. 'filter' tells whether it was.
+ * Returns the file's descriptor, or -1 if an error occurs (the error is
+ * reported)
+ */
+static int open_linked_file(member_filter_t *filter, const char *name, const char *link_name) {
+    if (!member_filter_matches(filter, link_name)) {
+        fprintf(stderr, "Error: %s is a hard link to %s, which is not being extracted\n", name,
+                link_name);
+        errno = ENOENT;
+        return -1;
+    }
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int fd = open(link_name, O_RDONLY);
+    if (fd == -1) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open link target %s", link_name);
+        perror(err_msg);
+    }
+    return fd;
+}
+
+/*
+ * Writes the contents of the file 'link_name', open on 'fd', to 'data_fd',
+ * which is how a hard link read from a stream is extracted.
+ * Returns 0 on success or -1 if an error occurs (the error is reported)
+ */
+static int copy_linked_file(const char *link_name, int fd, int data_fd) {
+    struct stat stat_buf;
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    int ret = fstat(fd, &stat_buf);
+    if (ret == 0) {
+        ret = copy_range(data_fd, fd, 0, stat_buf.st_size);
+    }
+    if (ret) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to copy link target %s", link_name);
+        perror(err_msg);
+    }
+    return ret;
+}
+
+/*
+ * Extracts the members selected by 'filter' in a single pass over an archive
+ * that can only be read front to back. Every version of a name is written as
+ * it goes by, so later versions overwrite earlier ones as in the original
+ * serial extraction. Names that were written are added to 'found'.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int extract_members_streaming(archive_reader_t *reader, member_filter_t *filter,
+                                     file_list_t *found) {
+    int ret;
+    while ((ret = archive_reader_next(reader)) == 1) {
+        const char *name = reader->name;
+        // Unselected members are skipped by reading past them
+        if (!member_filter_matches(filter, name)) {
+            continue;
+        }
+
+        // A hard link to its own name leaves the file as it is
+        if (reader->hard_link && strcmp(reader->link_name, name) == 0) {
+            continue;
+        }
+
+        // A hard link copies the file it links to, which is opened first so
+        // that a link that can't be extracted leaves any file by its name alone
+        int link_fd = -1;
+        if (reader->hard_link) {
+            link_fd = open_linked_file(filter, name, reader->link_name);
+            if (link_fd == -1) {
+                return -1;
+            }
+        }
+
+        // Open data file for writing to and error check
+        int data_fd;
+        int failed = create_member_output(name, &data_fd);
+        // Directories have no data to write
+        if (!failed && data_fd != -1) {
+            failed = reader->hard_link ? copy_linked_file(reader->link_name, link_fd, data_fd)
+                     : reader->sparse  ? extract_sparse_data(reader, reader->data_offset, reader->data_size,
+                                                             reader->real_size, data_fd)
+                                       : archive_reader_write_data(reader, data_fd);
+            if (failed) {
+                close(data_fd);
+            } else if (close(data_fd)) {
+                perror("Error closing data file");
+                failed = 1;
+            }
+        }
+        if (link_fd != -1) {
+            close(link_fd);
+        }
+        if (failed) {
+            return -1;
+        }
+        if (filter->patterns != NULL && file_list_add(found, name)) {
+            perror("Error adding file to file list");
+            return -1;
+        }
+    }
+    return ret;
+}
+
+int extract_matching_files_from_archive(const char *archive_name, const file_list_t *patterns,
+                                        int num_threads) {
+    member_filter_t filter;
+    if (member_filter_init(&filter, patterns)) {
+        return -1;
+    }
+
+    // Planning only looks at headers, so start without readahead
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        member_filter_free(&filter);
+        return -1;
+    }
+
+    // A stream can't be planned ahead or shared between workers, so it is
+    // extracted serially in one pass
+    file_list_t found;
+    file_list_init(&found);
+    if (reader.streaming) {
+        // Patterns are only known to match nothing if the pass got to the end
+        int ret = extract_members_streaming(&reader, &filter, &found);
+        if (ret == 0 && member_filter_report(&filter, &found)) {
+            ret = -1;
+        }
+        file_list_clear(&found);
+        archive_reader_close(&reader);
+        member_filter_free(&filter);
+        return ret;
+    }
+
+    member_info_t *members;
+    size_t num_members;
+    if (plan_extraction(archive_name, &reader, &filter, &members, &num_members)) {
+        archive_reader_close(&reader);
+        member_filter_free(&filter);
+        return -1;
+    }
+    int ret = 0;
+    for (size_t i = 0; filter.patterns != NULL && i < num_members; i++) {
+        if (file_list_add(&found, members[i].name)) {
+            perror("Error adding file to file list");
+            ret = -1;
+        }
+    }
+    if (member_filter_report(&filter, &found)) {
+        ret = -1;
+    }
+    file_list_clear(&found);
+
+    // Workers copy straight from the archive file, which only works when it
+    // holds the member data uncompressed
+    stats_phase_t outer = stats_enter(STATS_PHASE_EXTRACT);
+    if (num_threads <= 1 || reader.compressed) {
+        ret |= extract_members_serial(&reader, members, num_members);
+    } else {
+        ret |= extract_members_parallel(&reader, members, num_members, num_threads);
+    }
+    stats_leave(outer);
+
+    free_members(members, num_members);
+    archive_reader_close(&reader);
+    member_filter_free(&filter);
+    return ret;
+}
+
+int extract_files_from_archive(const char *archive_name) {
+    return extract_matching_files_from_archive(archive_name, NULL, 1);
+}
+
+int extract_files_from_archive_parallel(const char *archive_name, int num_threads) {
+    return extract_matching_files_from_archive(archive_name, NULL, num_threads);
+}
+
+// bsearch comparator: a name against a member's name
+static int compare_name_to_member(const void *name, const void *member) {
+    return strcmp(name, ((const member_info_t *) member)->name);
+}
+
+/*
+ * Compares the contents of the file open on 'fd' with the data of 'member',
+ * which is not sparse and has as many bytes as the file.
+ * Returns 0 if they are the same, 1 if they differ, or -1 if an error occurs
+ */
+static int compare_member_contents(archive_reader_t *reader, const member_info_t *member, int fd) {
+    char *file_buf = malloc(COPY_CHUNK_SIZE);
+    char *member_buf = malloc(COPY_CHUNK_SIZE);
+    if (file_buf == NULL || member_buf == NULL) {
+        perror("Error allocating comparison buffers");
+        free(file_buf);
+        free(member_buf);
+        return -1;
+    }
+
+    int ret = 0;
+    for (off_t pos = 0; pos < member->size && ret == 0;) {
+        size_t chunk = member->size - pos < COPY_CHUNK_SIZE ? member->size - pos : COPY_CHUNK_SIZE;
+        ssize_t nbytes = pread(fd, file_buf, chunk, pos);
+        if (nbytes == -1 && errno == EINTR) {
+            continue;
+        }
+        STATS_SYSCALL(STATS_SYS_READ, nbytes > 0 ? nbytes : 0, 0);
+        if (nbytes == -1) {
+            perror("Error reading data file");
+            ret = -1;
+        } else if (nbytes == 0) {
+            // The file shrank since it was stat'ed
+            ret = 1;
+        } else if (archive_reader_read_at(reader, member->data_offset + pos, member_buf, nbytes)) {
+            ret = -1;
+        } else {
+            ret = memcmp(file_buf, member_buf, nbytes) != 0;
+            pos += nbytes;
+        }
+    }
+    free(file_buf);
+    free(member_buf);
+    return ret;
+}
+
+/*
+ * Determines whether the file 'file_name', described by 'stat_buf', changed
+ * since 'member', its latest version in the archive open in 'reader', was
+ * written. The archive was last modified in the second 'archive_mtime'.
+ * Returns 1 if it changed, 0 if it didn't, or -1 if an error occurs
+ */
+static int file_changed(archive_reader_t *reader, const member_info_t *member, const char *file_name,
+                        const struct stat *stat_buf, time_t archive_mtime) {
+    if (member->mtime != stat_buf->st_mtime) {
+        return 1;
+    }
+    if (S_ISDIR(stat_buf->st_mode)) {
+        return 0;
+    }
+    if (member->real_size != stat_buf->st_size) {
+        return 1;
+    }
+    // Headers only keep whole seconds, so a file written again in the second
+    // it was archived in looks unchanged. That can only have happened if it
+    // was last modified no earlier than the archive was last written.
+    if (!minitar_options.check_contents && stat_buf->st_mtime < archive_mtime) {
+        return 0;
+    }
+    // Comparing around the holes of a sparse member isn't worth it, so it is
+    // simply archived again
+    if (member->sparse) {
+        return 1;
+    }
+
+    STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to open file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    stats_phase_t outer = stats_enter(STATS_PHASE_HASH);
+    int ret = compare_member_contents(reader, member, fd);
+    stats_leave(outer);
+    close(fd);
+    STATS_ADD(update_contents_compared, 1);
+    return ret;
+}
+
+/*
+ * Determines whether the file 'file_name' is among the 'num_members' members
+ * in 'members' (sorted by name), under its own name or as a directory.
+ * Returns 1 if it is, 0 otherwise
+ */
+static int has_member(const member_info_t *members, size_t num_members, const char *file_name) {
+    if (bsearch(file_name, members, num_members, sizeof(member_info_t), compare_name_to_member) != NULL) {
+        return 1;
+    }
+    char dir_name[PATH_MAX + 1];
+    if (snprintf(dir_name, sizeof(dir_name), "%s/", file_name) >= (int) sizeof(dir_name)) {
+        return 0;
+    }
+    return bsearch(dir_name, members, num_members, sizeof(member_info_t), compare_name_to_member) != NULL;
+}
+
+/*
+ * Adds 'file_name' to 'changed' if it is missing from the 'num_members'
+ * latest versions in 'members' (sorted by name) or changed since its member
+ * was written (see file_changed).
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int check_update_file(archive_reader_t *reader, const member_info_t *members, size_t num_members,
+                             const char *file_name, time_t archive_mtime, file_list_t *changed) {
+    struct stat stat_buf;
+    char member_name[PATH_MAX + 1];
+    stats_phase_t outer = stats_enter(STATS_PHASE_INPUT);
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    int failed = stat(file_name, &stat_buf) != 0;
+    stats_leave(outer);
+    if (failed || get_member_name(member_name, file_name, &stat_buf)) {
+        char err_msg[MAX_MSG_LEN];
+        snprintf(err_msg, MAX_MSG_LEN, "Failed to stat file %s", file_name);
+        perror(err_msg);
+        return -1;
+    }
+    const member_info_t *member = bsearch(member_name, members, num_members, sizeof(member_info_t),
+                                          compare_name_to_member);
+    int ret = member == NULL ? 1 : file_changed(reader, member, file_name, &stat_buf, archive_mtime);
+    STATS_ADD(update_files_checked, 1);
+    STATS_ADD(update_files_changed, ret == 1);
+    if (ret == 1 && file_list_add(changed, file_name)) {
+        perror("Error adding file to file list");
+        return -1;
+    }
+    return ret == -1 ? -1 : 0;
+}
+
+int update_archive(const char *archive_name, const file_list_t *files) {
+    struct stat archive_stat;
+    if (stat(archive_name, &archive_stat) != 0) {
+        perror("Error");
+        return -1;
+    }
+
+    // Only headers are needed, unless some contents have to be compared
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        return -1;
+    }
+    member_filter_t filter;
+    member_filter_init(&filter, NULL);
+    member_info_t *members;
+    size_t num_members;
+    if (find_latest_members(archive_name, &reader, &filter, &members, &num_members, NULL, NULL)) {
+        archive_reader_close(&reader);
+        return -1;
+    }
+
+    // Every file named has to be a member already before anything is done
+    file_list_t changed;
+    file_list_init(&changed);
+    int ret = 0;
+    for (node_t *current = files->head; current != NULL && ret == 0; current = current->next) {
+        ret = !has_member(members, num_members, current->name);
+    }
+    for (node_t *current = files->head; current != NULL && ret == 0; current = current->next) {
+        ret = check_update_file(&reader, members, num_members, current->name, archive_stat.st_mtime,
+                                &changed);
+    }
+
+    // Directories are compared entry by entry. Entries are added to the list
+    // on their own, so an unchanged directory isn't archived again whole.
+    for (node_t *current = files->head; current != NULL && ret == 0; current = current->next) {
+        struct stat stat_buf;
+        STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+        if (stat(current->name, &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode)) {
+            continue;
+        }
+        path_list_t paths = {NULL, NULL, 0, 0, NULL, 0};
+        stats_phase_t outer = stats_enter(STATS_PHASE_WALK);
+        ret = walk_directory(current->name, &paths);
+        stats_leave(outer);
+        for (size_t i = 0; i < paths.num_paths && ret == 0; i++) {
+            ret = check_update_file(&reader, members, num_members, paths.paths[i], archive_stat.st_mtime,
+                                    &changed);
+        }
+        path_list_free(&paths);
+    }
+    free_members(members, num_members);
+    archive_reader_close(&reader);
+
+    if (ret == 0 && changed.size > 0) {
+        ret = append_members(archive_name, &changed, 0);
+    }
+    file_list_clear(&changed);
+    return ret;
+}
+
+/*
+ * Adds to 'members', the final versions kept by compaction, every member that
+ * one of their hard links leads to, since a superseded version a link points
+ * at still has to be there for the link to work. The list is left sorted by
+ * offset. On success '*links' is set if any member kept is a hard link.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int keep_link_targets(const char *archive_name, member_info_t **members, size_t *num_members,
+                             int *links) {
+    *links = has_hard_links(*members, *num_members);
+    if (!*links) {
+        return 0;
+    }
+    archive_index_t index;
+    archive_index_init(&index);
+    int ret = archive_index_load(&index, archive_name);
+    if (ret == 1) {
+        ret = archive_index_build(&index, archive_name);
+    }
+
+    size_t count = *num_members;
+    size_t capacity = count;
+    member_info_t *list = *members;
+    for (size_t i = 0; i < *num_members && ret == 0; i++) {
+        if (!list[i].hard_link) {
+            continue;
+        }
+        const index_entry_t *entry = find_index_entry(&index, list[i].header_offset);
+        while (entry != NULL && (entry->flags & INDEX_ENTRY_LINK) && entry->link_target != 0) {
+            entry = &index.entries[entry->link_target - 1];
+            if (count == capacity) {
+                capacity *= 2;
+                member_info_t *bigger = realloc(list, capacity * sizeof(member_info_t));
+                if (bigger == NULL) {
+                    perror("Error allocating member table");
+                    ret = -1;
+                    break;
+                }
+                list = bigger;
+            }
+            member_info_t *target = &list[count];
+            memset(target, 0, sizeof(member_info_t));
+            target->name = strdup(archive_index_name(&index, entry));
+            if (target->name == NULL) {
+                perror("Error allocating member table");
+                ret = -1;
+                break;
+            }
+            count++;
+            target->header_offset = entry->header_offset;
+            target->data_offset = entry->data_offset;
+            target->end_offset = entry->data_offset + (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+            target->hard_link = (entry->flags & INDEX_ENTRY_LINK) != 0;
+        }
+    }
+    archive_index_free(&index);
+
+    // Targets that are final versions themselves are already on the list
+    qsort(list, count, sizeof(member_info_t), compare_members_by_offset);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept > 0 && list[kept - 1].header_offset == list[i].header_offset) {
+            free(list[i].name);
+            continue;
+        }
+        list[kept++] = list[i];
+    }
+    *members = list;
+    *num_members = kept;
+    return ret ? -1 : 0;
+}
+
+/*
+ * Copies every one of the 'num_members' members in 'members', sorted by
+ * offset, from the archive open in 'reader' to 'out_fd', header blocks and
+ * padded data alike, back to back from offset 0. Each member is added to
+ * 'index' at its new offset if 'index' is not NULL.
+ * If 'in_place' is set, 'out_fd' is open on the archive itself. Members only
+ * ever move towards the start, so each one is copied over space that no
+ * member still to be copied occupies, and those already in place are skipped.
+ * On success '*end' is set to the offset where the last member ends.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int copy_live_members(archive_reader_t *reader, const member_info_t *members, size_t num_members,
+                             int out_fd, int in_place, archive_index_t *index, off_t *end) {
+    off_t offset = 0;
+    for (size_t i = 0; i < num_members; i++) {
+        const member_info_t *member = &members[i];
+        off_t len = member->end_offset - member->header_offset;
+        int ret;
+        if (in_place && member->header_offset == offset) {
+            STATS_SYSCALL(STATS_SYS_SEEK, 0, 0);
+            ret = lseek(out_fd, len, SEEK_CUR) == -1 ? -1 : 0;
+        } else if (reader->compressed) {
+            ret = archive_reader_write_range(reader, member->header_offset, len, out_fd);
+        } else {
+            ret = copy_range(out_fd, reader->fd, member->header_offset, len);
+        }
+        if (ret) {
+            perror("Error copying member");
+            return -1;
+        }
+        if (index != NULL &&
+            archive_index_add(index, member->name, offset, offset + member->data_offset - member->header_offset,
+                              member->size, member->real_size, member->mtime,
+                              member->sparse ? INDEX_ENTRY_SPARSE : 0, NULL)) {
+            perror("Error adding member to index");
+            return -1;
+        }
+        STATS_ADD(members, 1);
+        offset += len;
+    }
+    *end = offset;
+    return 0;
+}
+
+int compact_archive(const char *archive_name, int in_place, size_t *dropped, off_t *reclaimed) {
+    *dropped = 0;
+    *reclaimed = 0;
+    struct stat old_stat;
+    if (stat(archive_name, &old_stat) != 0) {
+        perror("Error");
+        return -1;
+    }
+
+    archive_reader_t reader;
+    if (archive_reader_open(&reader, archive_name, MADV_RANDOM)) {
+        return -1;
+    }
+    if (reader.streaming) {
+        fprintf(stderr, "Error: can only compact an archive stored in a file\n");
+        archive_reader_close(&reader);
+        return -1;
+    }
+    member_filter_t filter;
+    member_filter_init(&filter, NULL);
+    member_info_t *members;
+    size_t num_members;
+    size_t total = 0;
+    off_t total_bytes = 0;
+    if (find_latest_members(archive_name, &reader, &filter, &members, &num_members, &total, &total_bytes)) {
+        archive_reader_close(&reader);
+        return -1;
+    }
+    qsort(members, num_members, sizeof(member_info_t), compare_members_by_offset);
+    int links;
+    if (keep_link_targets(archive_name, &members, &num_members, &links)) {
+        free_members(members, num_members);
+        archive_reader_close(&reader);
+        return -1;
+    }
+
+    // Leave the archive alone if there is nothing to drop, not even the
+    // padding some tar implementations add after the footer
+    off_t new_size = NUM_TRAILING_BLOCKS * BLOCK_SIZE;
+    for (size_t i = 0; i < num_members; i++) {
+        new_size += members[i].end_offset - members[i].header_offset;
+    }
+    if (new_size >= reader.archive_size) {
+        free_members(members, num_members);
+        archive_reader_close(&reader);
+        return 0;
+    }
+
+    // A compressed archive is always rewritten into a new file, since its
+    // frames can't be moved around as they are
+    in_place = in_place && !reader.compressed;
+    char tmp_path[TMP_PATH_MAX];
+    int out_fd;
+    if (in_place) {
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        out_fd = open(archive_name, O_WRONLY);
+    } else {
+        out_fd = create_tmp_file(tmp_path, archive_name, old_stat.st_mode & 07777);
+    }
+    if (out_fd == -1) {
+        perror("Error opening tar file");
+        free_members(members, num_members);
+        archive_reader_close(&reader);
+        return -1;
+    }
+
+    archive_index_t index;
+    archive_index_init(&index);
+    int use_index = minitar_options.use_index || archive_index_exists(archive_name);
+    compressor_t *compressor = NULL;
+    if (reader.compressed) {
+        compressor = compressor_start(out_fd, compress_threads());
+    }
+    int ret = reader.compressed && compressor == NULL ? -1 : 0;
+    int copy_fd = compressor != NULL ? compressor_input_fd(compressor) : out_fd;
+    // The index is updated as members are copied, except that hard links
+    // need every member before them, so then it is rebuilt afterwards
+    off_t end;
+    stats_phase_t outer = stats_enter(STATS_PHASE_DATA);
+    if (ret == 0 && copy_live_members(&reader, members, num_members, copy_fd, in_place,
+                                      use_index && !links ? &index : NULL, &end)) {
+        ret = -1;
+    }
+    stats_leave(outer);
+    if (ret == 0 && write_archive_footer(copy_fd)) {
+        ret = -1;
+    }
+    if (compressor != NULL && compressor_finish(compressor)) {
+        ret = -1;
+    }
+    free_members(members, num_members);
+    archive_reader_close(&reader);
+
+    // The new archive has to be on disk before it replaces the old one
+    outer = stats_enter(STATS_PHASE_FOOTER);
+    if (ret == 0 && in_place) {
+        STATS_SYSCALL(STATS_SYS_TRUNCATE, 0, 0);
+        if (ftruncate(out_fd, end + NUM_TRAILING_BLOCKS * BLOCK_SIZE) == -1) {
+            perror("Error truncating tar file");
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        STATS_SYSCALL(STATS_SYS_FSYNC, 0, 0);
+        if (fsync(out_fd) == -1) {
+            perror("Error syncing tar file");
+            ret = -1;
+        }
+    }
+    stats_leave(outer);
+    if (close(out_fd) && ret == 0) {
+        perror("Error closing tar file");
+        ret = -1;
+    }
+    if (!in_place && ret == 0 && rename(tmp_path, archive_name) == -1) {
+        perror("Error replacing tar file");
+        ret = -1;
+    }
+    if (!in_place && ret == -1) {
+        unlink(tmp_path);
+    }
+
+    struct stat new_stat;
+    if (ret == 0 && use_index && links && archive_index_build(&index, archive_name)) {
+        ret = -1;
+    }
+    if (ret == 0 && use_index && archive_index_save(&index, archive_name)) {
+        ret = -1;
+    }
+    archive_index_free(&index);
+    if (ret == 0 && stat(archive_name, &new_stat) == 0) {
+        *dropped = total - num_members;
+        *reclaimed = old_stat.st_size - new_stat.st_size;
+    }
+    return ret;
+}
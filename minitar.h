@@ -1,8 +1,17 @@
 #ifndef _MINITAR_H
 #define _MINITAR_H
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
 #include "file_list.h"
+#include "sparse.h"
 
 #define BLOCK_SIZE 512
+// Room for every header block of one member: a PAX extended header with a
+// path and a link path of up to PATH_MAX bytes each and a size, and the
+// member's own header
+#define MAX_MEMBER_HEADERS_SIZE (3 * BLOCK_SIZE + 2 * PATH_MAX)
 
 // Standard tar header layout defined by POSIX
 typedef struct {
@@ -45,9 +54,95 @@ typedef struct {
 #define MAGIC "ustar"
 
 // Constants to represent different file types
-// We'll only use regular files in this project
+// Directories are archived with a header and no data, followed by their contents
 #define REGTYPE '0'
 #define DIRTYPE '5'
+// A hard link has no data of its own: it holds the same contents as the
+// member named in its linkname field, the newest one by that name before it
+#define LNKTYPE '1'
+// Extended headers, whose data holds values for the member that follows:
+// PAX records ("path", "linkpath", "size", "mtime"), PAX records for every
+// later member (read past and otherwise ignored), a GNU long name and a GNU
+// long link name
+#define PAX_HEADER_TYPE 'x'
+#define PAX_GLOBAL_HEADER_TYPE 'g'
+#define GNU_LONG_NAME_TYPE 'L'
+#define GNU_LONG_LINK_TYPE 'K'
+
+// Passing this as an archive name streams the archive through standard input
+// (for reading) and standard output (for writing) instead of a named file.
+// Appending then copies the archive from standard input to standard output
+// and adds the new members at the end.
+#define STDIO_ARCHIVE_NAME "-"
+
+// What --sync makes sure is on disk before a create or append returns
+typedef enum {
+    // Nothing: the kernel writes the archive back whenever it likes
+    SYNC_NONE,
+    // The whole archive, once, before it is put in place or its new members
+    // are made part of it
+    SYNC_END,
+    // Like SYNC_END, and an append also commits each member on its own, so a
+    // crash keeps every member written before it
+    SYNC_MEMBER,
+} sync_mode_t;
+
+// Behaviour switches shared by all operations, set from the command line
+typedef struct {
+    // Maintain an index file (ARCHIVE.idx) when creating or appending (--index).
+    // Once an archive has an index, later appends keep it up to date regardless.
+    int use_index;
+    // Compress newly created archives, and the output of a streamed append (-z).
+    // Reading recognizes compressed archives by themselves, and appending to
+    // a compressed archive keeps it compressed.
+    int compress;
+    // Leave the owner and group name fields of new headers empty, so only the
+    // numeric ids are recorded and no name lookups happen (--numeric-owner)
+    int numeric_owner;
+    // How input files are stat'ed, opened and read when creating or appending,
+    // one of the io_engine_t values in prefetch.h (--io-engine). The default
+    // batches the calls through io_uring and falls back to a thread pool.
+    int io_engine;
+    // Threads reading input files ahead of the writer when creating or
+    // appending (-j), the default pool if 1. More than 1 uses a thread pool of
+    // that size, which also reads larger files into memory, within
+    // 'memory_budget' bytes (--memory-budget, PREFETCH_DEFAULT_BUDGET if 0).
+    // Either way members are written in list order by a single writer.
+    int read_threads;
+    size_t memory_budget;
+    // Compare the contents of every file an update looks at with its latest
+    // member, not just those whose size and mtime can't be trusted to tell
+    // (--check-contents)
+    int check_contents;
+    // Store a file with the same contents as one archived earlier by the same
+    // create or append as a hard link to that member instead (--dedup)
+    int dedup;
+    // How durable a create or append is, one of the sync_mode_t values
+    // (--sync). Either way an interrupted append leaves the archive as it
+    // was, but only a synced one is sure to survive a power failure.
+    int sync;
+} minitar_options_t;
+
+extern minitar_options_t minitar_options;
+
+/*
+ * Writes every header block of the member 'member_name' for the file
+ * identified by 'file_name', described by 'stat_buf', into 'blocks', which
+ * has room for MAX_MEMBER_HEADERS_SIZE bytes: the member's own header,
+ * preceded by a PAX extended header if its full name or its size doesn't fit
+ * in ustar fields. On success '*len' is set to the number of bytes written,
+ * a whole number of blocks.
+ * If 'sparse' is not NULL the member is stored as a sparse file (PAX format
+ * 1.0, as GNU tar writes it), whose data is the 'map_len' bytes of the
+ * formatted map followed by the segments 'sparse' lists. If 'link_name' is
+ * not NULL it is instead stored as a hard link to that member, with no data.
+ * The owner and group names are 'uname' and 'gname' if either is not NULL,
+ * and are otherwise looked up unless --numeric-owner was given.
+ * Returns 0 on success or -1 if an error occurs
+ */
+int fill_member_headers(char *blocks, size_t *len, const char *file_name, const char *member_name,
+                        const struct stat *stat_buf, const sparse_map_t *sparse, size_t map_len,
+                        const char *link_name, const char *uname, const char *gname);
 
 /*
  * Create a new archive file with the name 'archive_name'.
@@ -56,6 +151,11 @@ typedef struct {
  * You may also assume that all the elements of 'files' exist.
  * If an archive of the specified name already exists, you should overwrite it
  * with the result of this operation.
+ * The archive is written to an unnamed file (O_TMPFILE, or a new file named
+ * ARCHIVE.tmp.PID.N where that isn't supported) and only then put in place,
+ * so nobody ever sees it half-written and an existing archive survives a
+ * failed create. An existing archive keeps its permissions, and one named
+ * through a symbolic link is replaced where the link points.
  * This function should return 0 upon success or -1 if an error occurred
  */
 int create_archive(const char *archive_name, const file_list_t *files);
@@ -64,10 +164,52 @@ int create_archive(const char *archive_name, const file_list_t *files);
  * Append each file specified in 'files' to the archive with the name 'archive_name'.
  * You can assume in this project that at least one new file to append is specified.
  * You may also assume that all files to be appended exist.
+ * The archive is opened once and the new members are written where its
+ * members end, except for their first header block. Until that block is
+ * written, last, the archive still ends where it did, so an append that is
+ * interrupted leaves it as it was. The next append finds that end again and
+ * writes over whatever was left behind. New frames of a compressed archive go
+ * after its footer frame, which is erased last in the same way. An append
+ * that fails leaves the archive ending in a footer right after the members
+ * committed so far.
  * This function should return 0 upon success or -1 if an error occurred.
  */
 int append_files_to_archive(const char *archive_name, const file_list_t *files);
 
+/*
+ * Bring the archive with the name 'archive_name' up to date with the files in
+ * 'files', each of which must already be a member of it. Directories are
+ * compared entry by entry, and entries that are not in the archive yet count
+ * as changed.
+ * A file is appended again only if it changed since its latest member was
+ * written: its size or modification time differs from the member's header,
+ * or its contents differ when those are compared. Contents are compared when
+ * minitar_options.check_contents is set, and whenever the file was modified
+ * no earlier than the second the archive was last written, since a change
+ * made within that second would leave the mtime as it was.
+ * Nothing is written if no file changed.
+ * This function should return 0 upon success, 1 if one of 'files' is not in
+ * the archive (which is then left alone), or -1 if an error occurred.
+ */
+int update_archive(const char *archive_name, const file_list_t *files);
+
+/*
+ * Rewrite the archive with the name 'archive_name' so that it only holds the
+ * newest version of each member, in their original order. Member bytes are
+ * copied as they are, with copy_file_range() when the archive is not
+ * compressed, and the archive's index (if it has one) is rebuilt.
+ * The new archive is written to a new file named ARCHIVE.tmp.PID.N and
+ * renamed over the old one, so a crash leaves one or the other intact. If
+ * 'in_place' is set, members are instead moved down within the archive
+ * itself and it is truncated, which needs no extra disk space but leaves a
+ * damaged archive if interrupted. Compressed archives are always rewritten
+ * through a new file.
+ * '*dropped' is set to the number of superseded versions removed and
+ * '*reclaimed' to the number of bytes the archive shrank by.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int compact_archive(const char *archive_name, int in_place, size_t *dropped, off_t *reclaimed);
+
 /*
  * Add the name of each file contained in the archive identified by 'archive_name'
  * to the 'files' list.
@@ -87,4 +229,29 @@ int get_archive_file_list(const char *archive_name, file_list_t *files);
  */
 int extract_files_from_archive(const char *archive_name);
 
+/*
+ * Same as extract_files_from_archive, but the work is spread over 'num_threads'
+ * worker threads (serial when 'num_threads' is 1 or less).
+ * Header offsets are collected up front, superseded versions of each name are
+ * dropped, and the remaining members are handed out largest first. Each worker
+ * reads its members' byte ranges independently of the others.
+ * The files left behind are identical to those of a serial extraction.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int extract_files_from_archive_parallel(const char *archive_name, int num_threads);
+
+/*
+ * Same as extract_files_from_archive_parallel, but only members whose names
+ * match an entry of 'patterns' are extracted. Each entry is either an exact
+ * member name or a shell glob pattern such as "f*.txt". If 'patterns' is
+ * NULL or empty, every member is extracted.
+ * Non-matching members are stepped over without reading their data. With a
+ * valid index the archive is only touched at the matching members' offsets.
+ * Any pattern that matches no member is reported, and makes this function
+ * fail after the matching members have been extracted.
+ * This function should return 0 upon success or -1 if an error occurred.
+ */
+int extract_matching_files_from_archive(const char *archive_name, const file_list_t *patterns,
+                                        int num_threads);
+
 #endif
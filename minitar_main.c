@@ -1,27 +1,158 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "file_list.h"
 #include "minitar.h"
+#include "prefetch.h"
+#include "stats.h"
+
+#define USAGE "Usage: %s -c|a|t|u|x|k -f ARCHIVE [-j N] [-z] [--index] [--in-place] [--numeric-owner] [--dedup] [--io-engine=auto|uring|threads|sync] [--sync=none|end|member] [--memory-budget=BYTES[K|M|G]] [--check-contents] [--stats[=text|json]] [FILE...]\n"
+
+// Parses a byte count with an optional K, M or G suffix into '*size'.
+// Returns 0 on success or -1 if 'text' is not a positive size
+static int parse_size(const char *text, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || text[0] == '-') {
+        return -1;
+    }
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') {
+        shift = 10;
+    } else if (*end == 'M' || *end == 'm') {
+        shift = 20;
+    } else if (*end == 'G' || *end == 'g') {
+        shift = 30;
+    }
+    if (shift != 0) {
+        end++;
+    }
+    if (*end != '\0' || value == 0 || value > (SIZE_MAX >> shift)) {
+        return -1;
+    }
+    *size = (size_t) value << shift;
+    return 0;
+}
+
+// Name of the operation selected by 'flag', as --stats reports it
+static const char *operation_name(const char *flag) {
+    static const char *const names[][2] = {
+        {"-c", "create"}, {"-a", "append"}, {"-t", "list"},
+        {"-u", "update"}, {"-x", "extract"}, {"-k", "compact"},
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (!strcmp(flag, names[i][0])) {
+            return names[i][1];
+        }
+    }
+    return flag;
+}
 
 int main(int argc, char **argv) {
     if (argc < 4) {
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         return 0;
     }
 
+    // Grab archive name and any options, which come before the member files
+    const char *archive_name = NULL;
+    int num_threads = 1;
+    int in_place = 0;
+    int first_file = 2;
+    while (first_file < argc) {
+        if (!strcmp(argv[first_file], "-f") && first_file + 1 < argc) {
+            archive_name = argv[first_file + 1];
+            first_file += 2;
+        } else if (!strcmp(argv[first_file], "-j") && first_file + 1 < argc) {
+            num_threads = atoi(argv[first_file + 1]);
+            if (num_threads < 1) {
+                printf("Invalid thread count %s\n", argv[first_file + 1]);
+                return 1;
+            }
+            minitar_options.read_threads = num_threads;
+            first_file += 2;
+        } else if (!strcmp(argv[first_file], "-z")) {
+            minitar_options.compress = 1;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--index")) {
+            minitar_options.use_index = 1;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--numeric-owner")) {
+            minitar_options.numeric_owner = 1;
+            first_file++;
+        } else if (!strncmp(argv[first_file], "--io-engine=", 12)) {
+            const char *engine = argv[first_file] + 12;
+            if (!strcmp(engine, "auto")) {
+                minitar_options.io_engine = IO_ENGINE_AUTO;
+            } else if (!strcmp(engine, "uring")) {
+                minitar_options.io_engine = IO_ENGINE_URING;
+            } else if (!strcmp(engine, "threads")) {
+                minitar_options.io_engine = IO_ENGINE_THREADS;
+            } else if (!strcmp(engine, "sync")) {
+                minitar_options.io_engine = IO_ENGINE_SYNC;
+            } else {
+                printf("Invalid I/O engine %s\n", engine);
+                return 1;
+            }
+            first_file++;
+        } else if (!strncmp(argv[first_file], "--sync=", 7)) {
+            const char *mode = argv[first_file] + 7;
+            if (!strcmp(mode, "none")) {
+                minitar_options.sync = SYNC_NONE;
+            } else if (!strcmp(mode, "end")) {
+                minitar_options.sync = SYNC_END;
+            } else if (!strcmp(mode, "member")) {
+                minitar_options.sync = SYNC_MEMBER;
+            } else {
+                printf("Invalid sync mode %s\n", mode);
+                return 1;
+            }
+            first_file++;
+        } else if (!strncmp(argv[first_file], "--memory-budget=", 16)) {
+            if (parse_size(argv[first_file] + 16, &minitar_options.memory_budget)) {
+                printf("Invalid memory budget %s\n", argv[first_file] + 16);
+                return 1;
+            }
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--dedup")) {
+            minitar_options.dedup = 1;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--in-place")) {
+            in_place = 1;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--check-contents")) {
+            minitar_options.check_contents = 1;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--stats") || !strcmp(argv[first_file], "--stats=text")) {
+            minitar_stats_enabled = STATS_TEXT;
+            first_file++;
+        } else if (!strcmp(argv[first_file], "--stats=json")) {
+            minitar_stats_enabled = STATS_JSON;
+            first_file++;
+        } else {
+            break;
+        }
+    }
+    if (archive_name == NULL) {
+        printf(USAGE, argv[0]);
+        return 1;
+    }
+
+    if (minitar_stats_enabled) {
+        stats_start();
+    }
+
     file_list_t files;
     file_list_init(&files);
 
-    // Grab archive name
-    const char *archive_name = argv[3];
-
     if (!strcmp(argv[1], "-c")) {
         // create
 
-        // start at 4, first 3 args are non-file names
-        for (int i = 4; i<argc; i++) {
+        // everything after the options is a file name
+        for (int i = first_file; i<argc; i++) {
             if(file_list_add(&files, argv[i])) {
                 perror("Error adding file to file list");
                 goto failure;
@@ -39,8 +170,8 @@ int main(int argc, char **argv) {
     else if (!strcmp(argv[1], "-a")) {
         // append
 
-        // start at 4, first 3 args are non-file names
-        for (int i = 4; i<argc; i++) {
+        // everything after the options is a file name
+        for (int i = first_file; i<argc; i++) {
             if(file_list_add(&files, argv[i])) {
                 perror("Error adding file to file list");
                 goto failure;
@@ -75,74 +206,100 @@ int main(int argc, char **argv) {
     else if (!strcmp(argv[1], "-u")) {
         // update
 
-        // Checks that archive exists
-        if (access(archive_name, F_OK) != 0) {
-            printf("Archive %s doesn't exist\n", archive_name);
+        // Updating has to read the archive twice, which a stream can't do
+        if (!strcmp(archive_name, STDIO_ARCHIVE_NAME)) {
+            printf("Cannot update an archive streamed through standard input\n");
             goto failure;
         }
 
-        // Get the list of files in the archive
-        file_list_t archive_files;
-        file_list_init(&archive_files);
-
-        // Grab file list from archive
-        if (get_archive_file_list(archive_name, &archive_files)) {
-            perror("Error in getting the list of files");
-            file_list_clear(&archive_files);
+        // Checks that archive exists
+        if (access(archive_name, F_OK) != 0) {
+            printf("Archive %s doesn't exist\n", archive_name);
             goto failure;
         }
 
-        // start at 4, first 3 args are non-file names
+        // everything after the options is a file name
         // make list of files specified by user
-        for (int i = 4; i<argc; i++) {
+        for (int i = first_file; i<argc; i++) {
             if(file_list_add(&files, argv[i])) {
                 perror("Error adding file to file list");
-                file_list_clear(&archive_files);
                 goto failure;
             }
         }
 
-        // Check that all specified update files are within the archive already
-        if (file_list_is_subset(&files, &archive_files)) {
-            // Error checking append
-            if (append_files_to_archive(archive_name, &files)) {
-                perror("Error in appending files to archive");
-                file_list_clear(&archive_files);
-                goto failure;
-            }
-        } else {
+        // Append only the files that changed, provided all of them are
+        // within the archive already
+        int ret = update_archive(archive_name, &files);
+        if (ret == 1) {
             printf("Error: One or more of the specified files is not already present in archive\n");
-            file_list_clear(&archive_files);
+            goto failure;
+        } else if (ret == -1) {
+            perror("Error in updating archive");
             goto failure;
         }
-        file_list_clear(&archive_files);
 
     } 
     
     else if (!strcmp(argv[1], "-x")) {
         // extract
 
-        // Checks that archive exists
-        if (access(archive_name, F_OK) != 0) {
+        // Checks that archive exists (standard input always does)
+        if (strcmp(archive_name, STDIO_ARCHIVE_NAME) && access(archive_name, F_OK) != 0) {
             printf("Archive %s doesn't exist\n", archive_name);
             goto failure;
         }
 
+        // Any files given select which members to extract
+        for (int i = first_file; i<argc; i++) {
+            if(file_list_add(&files, argv[i])) {
+                perror("Error adding file to file list");
+                goto failure;
+            }
+        }
+
         // Extract files and error check
-        if(extract_files_from_archive(archive_name)) {
+        if(extract_matching_files_from_archive(archive_name, &files, num_threads)) {
             perror("Error extracting files from archive");
             goto failure;
         }
     } 
     
+    else if (!strcmp(argv[1], "-k")) {
+        // compact
+
+        // The archive is rewritten, so it has to be a file
+        if (!strcmp(archive_name, STDIO_ARCHIVE_NAME)) {
+            printf("Cannot compact an archive streamed through standard input\n");
+            goto failure;
+        }
+
+        // Checks that archive exists
+        if (access(archive_name, F_OK) != 0) {
+            printf("Archive %s doesn't exist\n", archive_name);
+            goto failure;
+        }
+
+        // Drop superseded versions and report what that saved
+        size_t dropped;
+        off_t reclaimed;
+        if (compact_archive(archive_name, in_place, &dropped, &reclaimed)) {
+            perror("Error compacting archive");
+            goto failure;
+        }
+        printf("Removed %zu superseded versions, reclaimed %lld bytes\n", dropped, (long long) reclaimed);
+    } 
+    
     else {
         // incorrect operation code
         printf("Incorrect operation code\n");
-        printf("Usage: %s -c|a|t|u|x -f ARCHIVE [FILE...]\n", argv[0]);
+        printf(USAGE, argv[0]);
         goto failure;
     }
     
     file_list_clear(&files);
+    if (minitar_stats_enabled) {
+        stats_print(stderr, operation_name(argv[1]));
+    }
     return 0;
 
 // Will only reach here if called in error catching
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "minitar_reader.h"
+
+/*
+ * Sets up 'reader' once its archive has been opened
+ */
+static void reader_init(minitar_reader_t *reader) {
+    memset(&reader->member, 0, sizeof(minitar_member_t));
+    reader->have_member = 0;
+    reader->position = 0;
+    sparse_map_init(&reader->map);
+}
+
+int minitar_reader_open(minitar_reader_t *reader, const char *archive_name) {
+    // Members are meant to be read, so let the kernel read ahead
+    if (archive_reader_open(&reader->archive, archive_name, MADV_SEQUENTIAL)) {
+        return -1;
+    }
+    reader_init(reader);
+    return 0;
+}
+
+int minitar_reader_open_fd(minitar_reader_t *reader, int fd) {
+    int own_fd = dup(fd);
+    if (own_fd == -1) {
+        perror("Error opening tar file");
+        return -1;
+    }
+    if (archive_reader_open_fd(&reader->archive, own_fd, MADV_SEQUENTIAL)) {
+        return -1;
+    }
+    reader_init(reader);
+    return 0;
+}
+
+/*
+ * Copies the 'len'-byte string header field 'field', which need not be
+ * null-terminated, into 'dest'
+ */
+static void copy_field(char *dest, const char *field, size_t len) {
+    size_t n = strnlen(field, len);
+    memcpy(dest, field, n);
+    dest[n] = '\0';
+}
+
+int minitar_reader_next(minitar_reader_t *reader, const minitar_member_t **member) {
+    archive_reader_t *archive = &reader->archive;
+    reader->have_member = 0;
+    int ret = archive_reader_next(archive);
+    if (ret != 1) {
+        return ret;
+    }
+
+    // The header may be unmapped once data is read, so keep what is needed
+    const tar_header *header = archive->header;
+    minitar_member_t *m = &reader->member;
+    m->name = archive->name;
+    m->link_name = archive->hard_link ? archive->link_name : NULL;
+    m->type = header->typeflag;
+    m->mode = parse_numeric(header->mode, sizeof(header->mode)) & 07777;
+    m->uid = parse_numeric(header->uid, sizeof(header->uid));
+    m->gid = parse_numeric(header->gid, sizeof(header->gid));
+    copy_field(m->uname, header->uname, sizeof(header->uname));
+    copy_field(m->gname, header->gname, sizeof(header->gname));
+    m->mtime = archive->mtime;
+    m->size = archive->hard_link ? 0 : archive->real_size;
+
+    if (archive->sparse) {
+        if (archive_reader_read_sparse_map(archive, archive->data_offset, archive->data_size,
+                                           archive->real_size, &reader->map, &reader->segments_offset)) {
+            return -1;
+        }
+        reader->segment = 0;
+        reader->segment_data = reader->segments_offset;
+    }
+    reader->position = 0;
+    reader->have_member = 1;
+    *member = m;
+    return 1;
+}
+
+/*
+ * Sparse member: copies up to 'len' bytes from the current position into
+ * 'buf', filling holes with zeros. Segments are visited in order, so
+ * 'segment' only ever moves forwards.
+ * Returns the number of bytes copied or -1 on error
+ */
+static ssize_t read_sparse(minitar_reader_t *reader, char *buf, size_t len) {
+    const sparse_map_t *map = &reader->map;
+    // Step past segments that end at or before the current position
+    while (reader->segment < map->num_segments &&
+           map->segments[reader->segment].offset + map->segments[reader->segment].length <= reader->position) {
+        reader->segment_data += map->segments[reader->segment].length;
+        reader->segment++;
+    }
+    if (reader->segment == map->num_segments || reader->position < map->segments[reader->segment].offset) {
+        // In a hole, which lasts up to the next segment or the end of the file
+        off_t hole_end = reader->segment < map->num_segments ? map->segments[reader->segment].offset
+                                                              : reader->member.size;
+        size_t step = hole_end - reader->position < (off_t) len ? hole_end - reader->position : len;
+        memset(buf, 0, step);
+        return step;
+    }
+    const sparse_segment_t *segment = &map->segments[reader->segment];
+    off_t into = reader->position - segment->offset;
+    size_t step = segment->length - into < (off_t) len ? segment->length - into : len;
+    if (archive_reader_read_at(&reader->archive, reader->segment_data + into, buf, step)) {
+        return -1;
+    }
+    return step;
+}
+
+ssize_t minitar_reader_read(minitar_reader_t *reader, void *buf, size_t len) {
+    if (!reader->have_member) {
+        fprintf(stderr, "Error: no current member to read\n");
+        return -1;
+    }
+    off_t left = reader->member.size - reader->position;
+    if (left <= 0 || len == 0) {
+        return 0;
+    }
+    if ((off_t) len > left) {
+        len = left;
+    }
+    ssize_t nbytes;
+    if (reader->archive.sparse) {
+        nbytes = read_sparse(reader, buf, len);
+    } else {
+        off_t offset = reader->archive.data_offset + reader->position;
+        nbytes = archive_reader_read_at(&reader->archive, offset, buf, len) ? -1 : (ssize_t) len;
+    }
+    if (nbytes > 0) {
+        reader->position += nbytes;
+    }
+    return nbytes;
+}
+
+void minitar_reader_skip(minitar_reader_t *reader) {
+    if (reader->have_member) {
+        reader->position = reader->member.size;
+    }
+}
+
+void minitar_reader_close(minitar_reader_t *reader) {
+    archive_reader_close(&reader->archive);
+    sparse_map_free(&reader->map);
+    reader->have_member = 0;
+}
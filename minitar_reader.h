@@ -0,0 +1,107 @@
+#ifndef _MINITAR_READER_H
+#define _MINITAR_READER_H
+#include <sys/types.h>
+
+#include "archive_reader.h"
+#include "sparse.h"
+
+// Public API for reading archives from another program, built into
+// libminitar.a along with the rest of minitar. An archive is read front to
+// back: minitar_reader_next steps to each member in turn, and the contents of
+// the current member can be read into the caller's buffers as they go by, so
+// nothing is ever written to disk. The archive can be a file, compressed or
+// not, or a pipe.
+//
+// A reader allocates what it needs when it is opened and reuses it from one
+// member to the next. Only a member with a name (or sparse file map) longer
+// than any before it makes a buffer grow.
+
+// Description of a member, filled in by minitar_reader_next. The strings stay
+// valid until the next call to minitar_reader_next or minitar_reader_close.
+typedef struct {
+    // Full name of the member, however it was stored (ustar prefix, PAX path
+    // record or GNU long name). Directories end in '/'.
+    const char *name;
+    // Name of the member whose contents a hard link shares, or NULL if this
+    // member is not a hard link
+    const char *link_name;
+    // Type of the member, as in its header: REGTYPE, DIRTYPE, LNKTYPE, or
+    // whatever other type another tar program stored
+    char type;
+    // Permission bits, owner and group ids, and owner and group names (empty
+    // if the archive has none)
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    char uname[33];
+    char gname[33];
+    // Modification time, or -1 if the header has none
+    time_t mtime;
+    // Number of bytes minitar_reader_read returns for the member. For a
+    // sparse file this is its full size, holes included; directories and
+    // hard links have none.
+    off_t size;
+} minitar_member_t;
+
+// State of a reader. It is allocated by the caller (on the stack, say), and
+// its fields are private.
+typedef struct {
+    archive_reader_t archive;
+    minitar_member_t member;
+    // Set from when minitar_reader_next finds a member until the next call
+    int have_member;
+    // Bytes of the current member's contents already returned
+    off_t position;
+    // Where a sparse member's data lies, and the archive offset of its first
+    // segment's data. 'segment' is the segment reading has got to, and
+    // 'segment_data' the archive offset of that segment's data.
+    sparse_map_t map;
+    off_t segments_offset;
+    size_t segment;
+    off_t segment_data;
+} minitar_reader_t;
+
+/*
+ * Open the archive 'archive_name' for reading, or standard input if it is
+ * STDIO_ARCHIVE_NAME ("-").
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_reader_open(minitar_reader_t *reader, const char *archive_name);
+
+/*
+ * Open the archive on 'fd' for reading. The descriptor stays the caller's:
+ * the reader works on a duplicate of it. A regular file is read from its
+ * start, whatever the descriptor's offset, and anything else as a stream.
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_reader_open_fd(minitar_reader_t *reader, int fd);
+
+/*
+ * Step to the next member, skipping whatever is left of the current one, and
+ * point '*member' at its description. Extended headers are applied to the
+ * member they belong to and never show up as members themselves.
+ * Returns 1 if there was another member, 0 at the end of the archive, or -1
+ * if an error occurred (it is reported on stderr).
+ */
+int minitar_reader_next(minitar_reader_t *reader, const minitar_member_t **member);
+
+/*
+ * Copy up to 'len' bytes of the current member's contents, continuing where
+ * the last call left off, into 'buf'. The holes of a sparse file read as
+ * zeros.
+ * Returns the number of bytes copied, 0 once the member has been read to its
+ * end, or -1 if an error occurred (it is reported on stderr).
+ */
+ssize_t minitar_reader_read(minitar_reader_t *reader, void *buf, size_t len);
+
+/*
+ * Skip the rest of the current member's contents, as if it had been read to
+ * its end. minitar_reader_next does the same by itself, so this only serves
+ * to make minitar_reader_read return 0 from here on.
+ */
+void minitar_reader_skip(minitar_reader_t *reader);
+
+// Close the archive and free everything the reader allocated
+void minitar_reader_close(minitar_reader_t *reader);
+
+#endif
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_util.h"
+#include "minitar.h"
+#include "minitar_writer.h"
+#include "stats.h"
+
+// Output is gathered into a buffer this large before it is handed on
+#define WRITER_BUF_SIZE (1 << 20)
+// Initial size of the buffer an archive is written into
+#define WRITER_MEMORY_INITIAL_SIZE (64 << 10)
+#define NUM_TRAILING_BLOCKS 2
+
+/*
+ * Sets up 'writer' with no destination yet
+ */
+static void writer_init(minitar_writer_t *writer) {
+    memset(writer, 0, sizeof(minitar_writer_t));
+    writer->fd = -1;
+}
+
+/*
+ * Allocates the buffer output is gathered in before it goes to a descriptor
+ * or a callback.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int alloc_output_buffer(minitar_writer_t *writer) {
+    writer->buf = malloc(WRITER_BUF_SIZE);
+    if (writer->buf == NULL) {
+        perror("Error allocating archive buffer");
+        return -1;
+    }
+    return 0;
+}
+
+int minitar_writer_open_fd(minitar_writer_t *writer, int fd, int compress) {
+    writer_init(writer);
+    writer->fd = fd;
+    if (alloc_output_buffer(writer)) {
+        return -1;
+    }
+    if (compress) {
+        long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        writer->compressor = compressor_start(fd, num_cpus < 1 ? 1 : num_cpus);
+        if (writer->compressor == NULL) {
+            free(writer->buf);
+            writer->buf = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int minitar_writer_open_memory(minitar_writer_t *writer) {
+    writer_init(writer);
+    writer->out = malloc(WRITER_MEMORY_INITIAL_SIZE);
+    if (writer->out == NULL) {
+        perror("Error allocating archive buffer");
+        return -1;
+    }
+    writer->out_capacity = WRITER_MEMORY_INITIAL_SIZE;
+    return 0;
+}
+
+int minitar_writer_open_callback(minitar_writer_t *writer, minitar_write_fn write, void *context) {
+    writer_init(writer);
+    writer->write = write;
+    writer->context = context;
+    return alloc_output_buffer(writer);
+}
+
+/*
+ * Hands 'nbytes' bytes at 'data' on to the writer's destination, unbuffered.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int emit(minitar_writer_t *writer, const void *data, size_t nbytes) {
+    if (writer->fd != -1) {
+        int fd = writer->compressor != NULL ? compressor_input_fd(writer->compressor) : writer->fd;
+        if (write_all(fd, data, nbytes)) {
+            perror("Error writing to archive");
+            return -1;
+        }
+    } else if (writer->write != NULL) {
+        if (writer->write(writer->context, data, nbytes)) {
+            fprintf(stderr, "Error: archive write callback failed\n");
+            return -1;
+        }
+    } else {
+        if (writer->out_len + nbytes > writer->out_capacity) {
+            size_t capacity = writer->out_capacity * 2;
+            while (capacity < writer->out_len + nbytes) {
+                capacity *= 2;
+            }
+            char *out = realloc(writer->out, capacity);
+            if (out == NULL) {
+                perror("Error growing archive buffer");
+                return -1;
+            }
+            writer->out = out;
+            writer->out_capacity = capacity;
+        }
+        memcpy(writer->out + writer->out_len, data, nbytes);
+        writer->out_len += nbytes;
+    }
+    return 0;
+}
+
+/*
+ * Hands on whatever the writer has gathered.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int flush(minitar_writer_t *writer) {
+    if (writer->buf_len > 0 && emit(writer, writer->buf, writer->buf_len)) {
+        return -1;
+    }
+    writer->buf_len = 0;
+    return 0;
+}
+
+/*
+ * Adds 'nbytes' bytes at 'data' to the archive, gathering them with what came
+ * before unless they are written into memory anyway. Chunks larger than the
+ * buffer are handed on straight away.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int output(minitar_writer_t *writer, const void *data, size_t nbytes) {
+    if (writer->buf == NULL) {
+        return emit(writer, data, nbytes);
+    }
+    if (writer->buf_len + nbytes > WRITER_BUF_SIZE && flush(writer)) {
+        return -1;
+    }
+    if (nbytes > WRITER_BUF_SIZE) {
+        return emit(writer, data, nbytes);
+    }
+    memcpy(writer->buf + writer->buf_len, data, nbytes);
+    writer->buf_len += nbytes;
+    return 0;
+}
+
+/*
+ * Checks that 'member' describes a member the writer can add with 'size'
+ * bytes of data.
+ * Returns 0 if it does, or -1 after reporting what is wrong with it
+ */
+static int check_member(const minitar_member_t *member, size_t size) {
+    if (member->name == NULL || member->name[0] == '\0') {
+        fprintf(stderr, "Error: member has no name\n");
+        return -1;
+    }
+    if (member->type != REGTYPE && member->type != DIRTYPE && member->type != LNKTYPE) {
+        fprintf(stderr, "Error: member %s has unsupported type '%c'\n", member->name, member->type);
+        return -1;
+    }
+    if (member->type == LNKTYPE && (member->link_name == NULL || member->link_name[0] == '\0')) {
+        fprintf(stderr, "Error: hard link %s has no link name\n", member->name);
+        return -1;
+    }
+    if (member->size < 0 || (member->type != REGTYPE && member->size != 0)) {
+        fprintf(stderr, "Error: member %s has invalid size %lld\n", member->name, (long long) member->size);
+        return -1;
+    }
+    if ((size_t) member->size != size) {
+        fprintf(stderr, "Error: member %s has size %lld but %zu bytes of data\n", member->name,
+                (long long) member->size, size);
+        return -1;
+    }
+    return 0;
+}
+
+int minitar_writer_add(minitar_writer_t *writer, const minitar_member_t *member, const void *data) {
+    struct iovec iov = {(void *) data, member->size > 0 ? member->size : 0};
+    return minitar_writer_addv(writer, member, &iov, 1);
+}
+
+int minitar_writer_addv(minitar_writer_t *writer, const minitar_member_t *member,
+                        const struct iovec *iov, int iovcnt) {
+    static const char zero_block[BLOCK_SIZE];
+    if (writer->failed || writer->finished) {
+        fprintf(stderr, "Error: archive can no longer be written to\n");
+        return -1;
+    }
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (check_member(member, size)) {
+        return -1;
+    }
+
+    // Headers are filled in from the metadata as if it had been stat'ed
+    struct stat stat_buf;
+    memset(&stat_buf, 0, sizeof(stat_buf));
+    stat_buf.st_mode = (member->type == DIRTYPE ? S_IFDIR : S_IFREG) | (member->mode & 07777);
+    stat_buf.st_uid = member->uid;
+    stat_buf.st_gid = member->gid;
+    stat_buf.st_mtime = member->mtime < 0 ? time(NULL) : member->mtime;
+    stat_buf.st_size = size;
+    char headers[MAX_MEMBER_HEADERS_SIZE];
+    size_t headers_len;
+    const char *link_name = member->type == LNKTYPE ? member->link_name : NULL;
+    if (fill_member_headers(headers, &headers_len, member->name, member->name, &stat_buf, NULL, 0,
+                            link_name, member->uname, member->gname)) {
+        perror("Error in creating file header");
+        return -1;
+    }
+
+    stats_phase_t outer = stats_enter(STATS_PHASE_DATA);
+    int ret = output(writer, headers, headers_len);
+    for (int i = 0; ret == 0 && i < iovcnt; i++) {
+        if (iov[i].iov_len > 0) {
+            ret = output(writer, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+    if (ret == 0) {
+        ret = output(writer, zero_block, (BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+    }
+    stats_leave(outer);
+    if (ret) {
+        writer->failed = 1;
+        return -1;
+    }
+    STATS_ADD(members, 1);
+    return 0;
+}
+
+int minitar_writer_finish(minitar_writer_t *writer) {
+    if (writer->finished) {
+        return writer->failed ? -1 : 0;
+    }
+    writer->finished = 1;
+    char footer[NUM_TRAILING_BLOCKS * BLOCK_SIZE];
+    memset(footer, 0, sizeof(footer));
+    stats_phase_t outer = stats_enter(STATS_PHASE_FOOTER);
+    if (!writer->failed && (output(writer, footer, sizeof(footer)) || flush(writer))) {
+        writer->failed = 1;
+    }
+    stats_leave(outer);
+    if (writer->compressor != NULL) {
+        if (compressor_finish(writer->compressor)) {
+            writer->failed = 1;
+        }
+        writer->compressor = NULL;
+    }
+    return writer->failed ? -1 : 0;
+}
+
+char *minitar_writer_take_buffer(minitar_writer_t *writer, size_t *len) {
+    if (writer->fd != -1 || writer->write != NULL) {
+        return NULL;
+    }
+    char *out = writer->out;
+    *len = writer->out_len;
+    writer->out = NULL;
+    writer->out_len = 0;
+    writer->out_capacity = 0;
+    return out;
+}
+
+void minitar_writer_close(minitar_writer_t *writer) {
+    if (writer->compressor != NULL) {
+        // Let the compressor wind down; the archive is incomplete anyway
+        compressor_finish(writer->compressor);
+        writer->compressor = NULL;
+    }
+    free(writer->buf);
+    free(writer->out);
+    writer->buf = NULL;
+    writer->out = NULL;
+}
@@ -0,0 +1,112 @@
+#ifndef _MINITAR_WRITER_H
+#define _MINITAR_WRITER_H
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "compress.h"
+#include "minitar_reader.h"
+
+// Public API for writing archives from another program, the counterpart of
+// minitar_reader.h, built into libminitar.a. Members are added one after
+// another from the caller's memory, as one buffer or as an iovec array, with
+// metadata the caller makes up, so nothing has to exist on disk. The archive
+// goes to a file descriptor (compressed if asked to), a buffer in memory that
+// grows as needed, or a function the caller supplies.
+//
+// Headers and small members are gathered in a buffer and handed on in large
+// chunks; data too large for it is handed on straight from the caller's
+// buffers.
+
+// Function that receives the archive as it is written, in order. 'context'
+// is the pointer given to minitar_writer_open_callback.
+// Returns 0 on success, or -1 to make the write fail
+typedef int (*minitar_write_fn)(void *context, const void *data, size_t nbytes);
+
+// State of a writer. It is allocated by the caller (on the stack, say), and
+// its fields are private.
+typedef struct {
+    // Where the archive goes: a descriptor (-1 if not), a callback, or else
+    // the memory buffer 'out'
+    int fd;
+    minitar_write_fn write;
+    void *context;
+    char *out;
+    size_t out_len;
+    size_t out_capacity;
+    // Compressor the archive goes through when written to a descriptor with
+    // compression, or NULL
+    compressor_t *compressor;
+    // Output gathered before it is handed on, unused for a memory buffer
+    char *buf;
+    size_t buf_len;
+    // Set once a write has failed, after which the archive can't be finished
+    int failed;
+    // Set once the footer has been written
+    int finished;
+} minitar_writer_t;
+
+/*
+ * Start writing an archive to 'fd', through a parallel compressor if
+ * 'compress' is set (see compress.h). The descriptor stays the caller's: it
+ * is written from its current offset and left open.
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_writer_open_fd(minitar_writer_t *writer, int fd, int compress);
+
+/*
+ * Start writing an archive into memory. Once finished, it is handed over
+ * with minitar_writer_take_buffer.
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_writer_open_memory(minitar_writer_t *writer);
+
+/*
+ * Start writing an archive by passing it to 'write' piece by piece, along
+ * with 'context'.
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_writer_open_callback(minitar_writer_t *writer, minitar_write_fn write, void *context);
+
+/*
+ * Add a member described by 'member', whose contents are the 'size' bytes at
+ * 'data' (see minitar_writer_addv).
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_writer_add(minitar_writer_t *writer, const minitar_member_t *member, const void *data);
+
+/*
+ * Add a member described by 'member', whose contents are the 'iovcnt' buffers
+ * in 'iov', one after another. Only the name, link name, type, mode, ids,
+ * names, mtime and size of 'member' are used:
+ * - 'type' is REGTYPE, DIRTYPE or LNKTYPE. A directory's name should end in
+ *   '/', and a hard link needs 'link_name'.
+ * - 'size' must be the combined length of the buffers, which is 0 for a
+ *   directory or a hard link.
+ * - Empty owner and group names are stored empty, never looked up.
+ * - A negative mtime stands for the current time.
+ * Names too long for ustar headers get a PAX extended header.
+ * Returns 0 on success or -1 if an error occurred (it is reported on stderr).
+ */
+int minitar_writer_addv(minitar_writer_t *writer, const minitar_member_t *member,
+                        const struct iovec *iov, int iovcnt);
+
+/*
+ * Write the archive footer and hand on everything still buffered, then wait
+ * for any compressor to finish.
+ * Returns 0 if the whole archive was written, or -1 if an error occurred now
+ * or in an earlier call (it is reported on stderr).
+ */
+int minitar_writer_finish(minitar_writer_t *writer);
+
+/*
+ * Hand over the archive written into memory, setting '*len' to its length.
+ * The caller frees it, and the writer holds nothing afterwards.
+ * Returns the archive, or NULL if the writer doesn't write into memory.
+ */
+char *minitar_writer_take_buffer(minitar_writer_t *writer, size_t *len);
+
+// Free everything the writer allocated. An unfinished archive is abandoned.
+void minitar_writer_close(minitar_writer_t *writer);
+
+#endif
@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "stats.h"
+#include "walk.h"
+
+#ifdef MINITAR_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+// Submission and completion rings shared with the kernel
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    // Mappings to undo when the ring is closed
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    // Entries queued since the last submission
+    unsigned num_queued;
+} uring_t;
+#else
+typedef struct {
+    int fd;
+} uring_t;
+#endif
+
+struct prefetcher {
+    // Names of the input files, in list order, and the directories they are
+    // in (NULL if they are all found by name)
+    const char *const *names;
+    const int *dir_fds;
+    size_t num_files;
+    // File i lives in slots[i % num_slots] until the writer releases it
+    prefetched_file_t *slots;
+    size_t num_slots;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    pthread_cond_t budget;
+    // Next file for an engine thread to take, and next file for the writer
+    size_t next_claim;
+    size_t next_consume;
+    // Bytes files may hold in memory at once (0 if only small files are
+    // read), bytes they hold now, and next file to take its share
+    size_t memory_budget;
+    size_t memory_used;
+    size_t next_reserve;
+    // Set when the writer gives up early
+    int stop;
+    pthread_t *threads;
+    int num_threads;
+    // Set when files are prefetched through 'ring' rather than by the pool
+    int use_uring;
+    uring_t ring;
+};
+
+/*
+ * Records that 'call' failed for 'file' with errno value 'error', unless an
+ * earlier call already failed
+ */
+static void prefetch_failed(prefetched_file_t *file, const char *call, int error) {
+    if (file->error == 0) {
+        file->error = error;
+        file->failed_call = call;
+    }
+}
+
+/*
+ * Determines whether a file is to be read into memory: a small one always,
+ * and with a memory budget a larger one that takes a small enough share of
+ * it, unless it may have holes the writer has to look for
+ */
+static int wants_data(const prefetcher_t *prefetcher, const prefetched_file_t *file) {
+    const struct stat *stat_buf = &file->stat_buf;
+    if (!S_ISREG(stat_buf->st_mode)) {
+        return 0;
+    }
+    if (stat_buf->st_size <= PREFETCH_MAX_FILE_SIZE) {
+        return 1;
+    }
+    return prefetcher->memory_budget > 0 &&
+           (size_t) stat_buf->st_size <= prefetcher->memory_budget / PREFETCH_BUDGET_SHARE &&
+           (off_t) stat_buf->st_blocks * 512 >= stat_buf->st_size;
+}
+
+/*
+ * Makes sure a slot has a buffer for 'size' bytes. Buffers that fit any small
+ * file are kept from one file to the next, larger ones are freed on release.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int reserve_data(prefetched_file_t *file, size_t size) {
+    if (file->data_capacity < size || file->data_capacity == 0) {
+        size_t capacity = size > PREFETCH_MAX_FILE_SIZE ? size : PREFETCH_MAX_FILE_SIZE;
+        free(file->data);
+        file->data_capacity = 0;
+        file->data = malloc(capacity);
+        if (file->data == NULL) {
+            return -1;
+        }
+        file->data_capacity = capacity;
+    }
+    return 0;
+}
+
+/*
+ * Waits until file 'index' is the next to take its share of the memory
+ * budget and 'size' more bytes fit in it, or nothing is held at all, then
+ * takes them. Since the writer gives memory back in list order too, the files
+ * ahead of this one always make room in the end.
+ * Returns 0 once the memory is taken, or -1 if the writer gave up
+ */
+static int reserve_memory(prefetcher_t *prefetcher, size_t index, size_t size) {
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!prefetcher->stop &&
+           (prefetcher->next_reserve != index ||
+            (prefetcher->memory_used > 0 && prefetcher->memory_used + size > prefetcher->memory_budget))) {
+        pthread_cond_wait(&prefetcher->budget, &prefetcher->lock);
+    }
+    int ret = prefetcher->stop ? -1 : 0;
+    if (ret == 0) {
+        prefetcher->memory_used += size;
+        prefetcher->next_reserve++;
+        pthread_cond_broadcast(&prefetcher->budget);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return ret;
+}
+
+/*
+ * Thread-pool engine: stats, opens and, if it is to be read, reads and closes
+ * file 'index' of the list with ordinary blocking calls. With a memory budget,
+ * every file waits its turn to take its share before it is read, even one
+ * that takes none.
+ */
+static void prefetch_file_sync(prefetcher_t *prefetcher, size_t index, prefetched_file_t *file) {
+    int fd = -1;
+    STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+    if (fstatat(file->dir_fd, file->at_name, &file->stat_buf, 0) == -1) {
+        prefetch_failed(file, "stat", errno);
+    } else {
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        fd = openat(file->dir_fd, file->at_name, O_RDONLY);
+        if (fd == -1) {
+            prefetch_failed(file, "open", errno);
+        }
+    }
+    int read_data = fd != -1 && wants_data(prefetcher, file);
+    size_t size = read_data ? file->stat_buf.st_size : 0;
+    if (prefetcher->memory_budget > 0) {
+        if (reserve_memory(prefetcher, index, size)) {
+            prefetch_failed(file, "prefetch", ECANCELED);
+            if (fd != -1) {
+                close(fd);
+            }
+            return;
+        }
+        file->reserved = size;
+    }
+    if (fd == -1) {
+        return;
+    }
+    if (!read_data) {
+        file->fd = fd;
+        return;
+    }
+    if (reserve_data(file, size)) {
+        prefetch_failed(file, "read", ENOMEM);
+        close(fd);
+        return;
+    }
+    while (file->data_len < (size_t) file->stat_buf.st_size) {
+        ssize_t bytes_read = read(fd, file->data + file->data_len,
+                                  file->stat_buf.st_size - file->data_len);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        STATS_SYSCALL(STATS_SYS_READ, bytes_read > 0 ? bytes_read : 0, 0);
+        if (bytes_read == -1) {
+            prefetch_failed(file, "read", errno);
+            break;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        file->data_len += bytes_read;
+    }
+    close(fd);
+}
+
+#ifdef MINITAR_HAVE_IO_URING
+
+/*
+ * Sets up a ring with room for 'entries' submissions, provided the kernel
+ * supports every operation the prefetcher uses.
+ * Returns 0 on success or -1 if io_uring can't be used
+ */
+static int uring_init(uring_t *ring, unsigned entries) {
+    memset(ring, 0, sizeof(uring_t));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    // Older kernels lack some of the operations we need
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    int supported = probe != NULL &&
+                    syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    for (size_t i = 0; supported && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!supported) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // Both rings share one mapping
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = 0;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_len > 0) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        if (ring->cq_ring_len > 0) {
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_close(uring_t *ring) {
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    if (ring->cq_ring_len > 0) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    close(ring->fd);
+}
+
+/*
+ * Queues a cleared submission entry tagged with 'user_data'. The caller never
+ * queues more than the ring holds between two calls to uring_run.
+ */
+static struct io_uring_sqe *uring_queue(uring_t *ring, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail + ring->num_queued;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->num_queued++;
+    return sqe;
+}
+
+/*
+ * Submits everything queued and waits for all of it to complete, passing each
+ * completion to 'handle'.
+ * Returns 0 on success or -1 if the ring itself fails (with errno set)
+ */
+static int uring_run(uring_t *ring, void (*handle)(void *, const struct io_uring_cqe *), void *arg) {
+    unsigned count = ring->num_queued;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->num_queued = 0;
+
+    unsigned to_submit = count;
+    unsigned completed = 0;
+    while (completed < count) {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, count - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (ret > 0) {
+            to_submit -= ret < (int) to_submit ? ret : to_submit;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            handle(arg, &ring->cqes[head & *ring->cq_mask]);
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Scratch state for one window of the io_uring engine. Submissions for file k
+// of the window are tagged k * 2 and k * 2 + 1.
+typedef struct {
+    prefetched_file_t *files[PREFETCH_WINDOW];
+    struct statx statx_bufs[PREFETCH_WINDOW];
+    int fds[PREFETCH_WINDOW];
+} uring_window_t;
+
+/*
+ * Completion of the first round: a statx (even tag) or an openat (odd tag)
+ */
+static void handle_open(void *arg, const struct io_uring_cqe *cqe) {
+    uring_window_t *window = arg;
+    size_t k = cqe->user_data / 2;
+    prefetched_file_t *file = window->files[k];
+    STATS_SYSCALL(cqe->user_data % 2 == 0 ? STATS_SYS_STAT : STATS_SYS_OPEN, 0, 0);
+    if (cqe->user_data % 2 == 0) {
+        if (cqe->res < 0) {
+            // The open may have completed first, but the stat is reported,
+            // as the thread-pool engine would
+            file->error = 0;
+            prefetch_failed(file, "stat", -cqe->res);
+            return;
+        }
+        // Fill in everything stat() would, so both engines hand the writer
+        // the same thing (it tells sparse files by their block count)
+        const struct statx *stx = &window->statx_bufs[k];
+        struct stat *stat_buf = &file->stat_buf;
+        memset(stat_buf, 0, sizeof(struct stat));
+        stat_buf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+        stat_buf->st_ino = stx->stx_ino;
+        stat_buf->st_mode = stx->stx_mode;
+        stat_buf->st_nlink = stx->stx_nlink;
+        stat_buf->st_uid = stx->stx_uid;
+        stat_buf->st_gid = stx->stx_gid;
+        stat_buf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+        stat_buf->st_size = stx->stx_size;
+        stat_buf->st_blksize = stx->stx_blksize;
+        stat_buf->st_blocks = stx->stx_blocks;
+        stat_buf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+        stat_buf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+        stat_buf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+        stat_buf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+        stat_buf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+        stat_buf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    } else if (cqe->res < 0) {
+        window->fds[k] = -1;
+        prefetch_failed(file, "open", -cqe->res);
+    } else {
+        window->fds[k] = cqe->res;
+    }
+}
+
+/*
+ * Completion of the second round: a read (even tag) or a close (odd tag)
+ */
+static void handle_read(void *arg, const struct io_uring_cqe *cqe) {
+    uring_window_t *window = arg;
+    size_t k = cqe->user_data / 2;
+    prefetched_file_t *file = window->files[k];
+    if (cqe->user_data % 2 == 0) {
+        STATS_SYSCALL(STATS_SYS_READ, cqe->res > 0 ? cqe->res : 0, 0);
+        if (cqe->res < 0) {
+            prefetch_failed(file, "read", -cqe->res);
+        } else {
+            file->data_len = cqe->res;
+        }
+    } else {
+        // A failed read cancels the close linked to it
+        if (cqe->res == -ECANCELED) {
+            close(window->fds[k]);
+        }
+        window->fds[k] = -1;
+    }
+}
+
+/*
+ * io_uring engine: prefetches 'count' files in two rounds of submissions.
+ * Every statx and openat goes in the first, then every read of a small file,
+ * each linked to the close of its descriptor, goes in the second.
+ */
+static void prefetch_window_uring(prefetcher_t *prefetcher, prefetched_file_t **files, size_t count) {
+    uring_t *ring = &prefetcher->ring;
+    uring_window_t window;
+    for (size_t k = 0; k < count; k++) {
+        window.files[k] = files[k];
+        window.fds[k] = -1;
+
+        struct io_uring_sqe *sqe = uring_queue(ring, k * 2);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = files[k]->dir_fd;
+        sqe->addr = (uintptr_t) files[k]->at_name;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (uintptr_t) &window.statx_bufs[k];
+
+        sqe = uring_queue(ring, k * 2 + 1);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = files[k]->dir_fd;
+        sqe->addr = (uintptr_t) files[k]->at_name;
+        sqe->open_flags = O_RDONLY;
+    }
+    if (uring_run(ring, handle_open, &window)) {
+        for (size_t k = 0; k < count; k++) {
+            prefetch_failed(files[k], "prefetch", errno);
+        }
+        return;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        prefetched_file_t *file = files[k];
+        if (window.fds[k] == -1) {
+            continue;
+        }
+        if (file->error != 0) {
+            close(window.fds[k]);
+            continue;
+        }
+        if (!wants_data(prefetcher, file)) {
+            file->fd = window.fds[k];
+            continue;
+        }
+        if (reserve_data(file, file->stat_buf.st_size)) {
+            prefetch_failed(file, "read", ENOMEM);
+            close(window.fds[k]);
+            continue;
+        }
+        struct io_uring_sqe *sqe;
+        if (file->stat_buf.st_size > 0) {
+            sqe = uring_queue(ring, k * 2);
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = window.fds[k];
+            sqe->addr = (uintptr_t) file->data;
+            sqe->len = file->stat_buf.st_size;
+            sqe->off = 0;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe = uring_queue(ring, k * 2 + 1);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = window.fds[k];
+    }
+    if (uring_run(ring, handle_read, &window)) {
+        for (size_t k = 0; k < count; k++) {
+            prefetch_failed(files[k], "prefetch", errno);
+        }
+    }
+}
+
+#else
+
+static int uring_init(uring_t *ring, unsigned entries) {
+    return -1;
+}
+
+static void uring_close(uring_t *ring) {
+}
+
+static void prefetch_window_uring(prefetcher_t *prefetcher, prefetched_file_t **files, size_t count) {
+}
+
+#endif
+
+/*
+ * Claims up to 'max' of the next files for an engine thread, waiting until
+ * their slots are free.
+ * Returns the number of files claimed (starting at '*start'), or 0 when there
+ * is nothing left to do
+ */
+static size_t claim_files(prefetcher_t *prefetcher, size_t max, size_t *start) {
+    pthread_mutex_lock(&prefetcher->lock);
+    size_t count = 0;
+    while (!prefetcher->stop && prefetcher->next_claim < prefetcher->num_files) {
+        count = prefetcher->num_files - prefetcher->next_claim;
+        if (count > max) {
+            count = max;
+        }
+        if (prefetcher->next_claim + count <= prefetcher->next_consume + prefetcher->num_slots) {
+            break;
+        }
+        count = 0;
+        pthread_cond_wait(&prefetcher->space, &prefetcher->lock);
+    }
+    if (prefetcher->stop) {
+        count = 0;
+    }
+    *start = prefetcher->next_claim;
+    prefetcher->next_claim += count;
+    pthread_mutex_unlock(&prefetcher->lock);
+    return count;
+}
+
+static void *prefetch_thread(void *arg) {
+    prefetcher_t *prefetcher = arg;
+    size_t max = prefetcher->use_uring ? PREFETCH_WINDOW : 1;
+    size_t start;
+    size_t count;
+    while ((count = claim_files(prefetcher, max, &start)) > 0) {
+        prefetched_file_t *files[PREFETCH_WINDOW];
+        for (size_t k = 0; k < count; k++) {
+            prefetched_file_t *file = &prefetcher->slots[(start + k) % prefetcher->num_slots];
+            file->name = prefetcher->names[start + k];
+            file->dir_fd = prefetcher->dir_fds != NULL ? prefetcher->dir_fds[start + k] : AT_FDCWD;
+            file->at_name = file->dir_fd != AT_FDCWD ? path_base_name(file->name) : file->name;
+            file->fd = -1;
+            file->data_len = 0;
+            file->reserved = 0;
+            file->error = 0;
+            file->failed_call = NULL;
+            files[k] = file;
+        }
+
+        if (prefetcher->use_uring) {
+            prefetch_window_uring(prefetcher, files, count);
+        } else {
+            prefetch_file_sync(prefetcher, start, files[0]);
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        for (size_t k = 0; k < count; k++) {
+            files[k]->ready = 1;
+        }
+        pthread_cond_broadcast(&prefetcher->ready);
+        pthread_mutex_unlock(&prefetcher->lock);
+    }
+    return NULL;
+}
+
+prefetcher_t *prefetcher_start(const char *const *names, const int *dir_fds, size_t num_files,
+                               io_engine_t engine, int num_threads, size_t memory_budget) {
+    prefetcher_t *prefetcher = calloc(1, sizeof(prefetcher_t));
+    if (prefetcher == NULL) {
+        perror("Error allocating prefetcher");
+        return NULL;
+    }
+    prefetcher->names = names;
+    prefetcher->dir_fds = dir_fds;
+    prefetcher->num_files = num_files;
+    prefetcher->num_slots = 2 * PREFETCH_WINDOW;
+    prefetcher->slots = calloc(prefetcher->num_slots, sizeof(prefetched_file_t));
+    if (prefetcher->slots == NULL) {
+        perror("Error allocating prefetcher");
+        free(prefetcher);
+        return NULL;
+    }
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->ready, NULL);
+    pthread_cond_init(&prefetcher->space, NULL);
+    pthread_cond_init(&prefetcher->budget, NULL);
+
+    // A single thread drives the ring, since each window is one batch anyway
+    if (num_threads > 1 && engine == IO_ENGINE_AUTO) {
+        engine = IO_ENGINE_THREADS;
+    }
+    if (engine != IO_ENGINE_THREADS) {
+        prefetcher->use_uring = uring_init(&prefetcher->ring, 2 * PREFETCH_WINDOW) == 0;
+        if (!prefetcher->use_uring && engine == IO_ENGINE_URING) {
+            fprintf(stderr, "Error: io_uring is not available\n");
+            prefetcher_free(prefetcher);
+            return NULL;
+        }
+    }
+    if (prefetcher->use_uring) {
+        num_threads = 1;
+    } else {
+        // The ring only has room for so many files in flight
+        if (num_threads <= 1) {
+            num_threads = PREFETCH_THREADS;
+        } else if ((size_t) num_threads > prefetcher->num_slots) {
+            num_threads = prefetcher->num_slots;
+        }
+        prefetcher->memory_budget = memory_budget;
+    }
+    prefetcher->threads = calloc(num_threads, sizeof(pthread_t));
+    if (prefetcher->threads == NULL) {
+        perror("Error allocating prefetcher");
+        prefetcher_free(prefetcher);
+        return NULL;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&prefetcher->threads[i], NULL, prefetch_thread, prefetcher)) {
+            break;
+        }
+        prefetcher->num_threads++;
+    }
+    if (prefetcher->num_threads == 0) {
+        fprintf(stderr, "Error starting prefetch thread\n");
+        prefetcher_free(prefetcher);
+        return NULL;
+    }
+    return prefetcher;
+}
+
+prefetched_file_t *prefetcher_next(prefetcher_t *prefetcher) {
+    prefetched_file_t *file = &prefetcher->slots[prefetcher->next_consume % prefetcher->num_slots];
+    pthread_mutex_lock(&prefetcher->lock);
+    while (!file->ready) {
+        pthread_cond_wait(&prefetcher->ready, &prefetcher->lock);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return file;
+}
+
+void prefetcher_release(prefetcher_t *prefetcher) {
+    prefetched_file_t *file = &prefetcher->slots[prefetcher->next_consume % prefetcher->num_slots];
+    if (file->fd != -1) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if (file->data_capacity > PREFETCH_MAX_FILE_SIZE) {
+        free(file->data);
+        file->data = NULL;
+        file->data_capacity = 0;
+    }
+    pthread_mutex_lock(&prefetcher->lock);
+    file->ready = 0;
+    prefetcher->next_consume++;
+    pthread_cond_broadcast(&prefetcher->space);
+    if (file->reserved > 0) {
+        prefetcher->memory_used -= file->reserved;
+        pthread_cond_broadcast(&prefetcher->budget);
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+}
+
+void prefetcher_free(prefetcher_t *prefetcher) {
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->stop = 1;
+    pthread_cond_broadcast(&prefetcher->space);
+    pthread_cond_broadcast(&prefetcher->budget);
+    pthread_mutex_unlock(&prefetcher->lock);
+    for (int i = 0; i < prefetcher->num_threads; i++) {
+        pthread_join(prefetcher->threads[i], NULL);
+    }
+
+    // Files prefetched ahead of the writer may still hold descriptors
+    for (size_t i = 0; i < prefetcher->num_slots; i++) {
+        prefetched_file_t *file = &prefetcher->slots[i];
+        if (file->ready && file->fd != -1) {
+            close(file->fd);
+        }
+        free(file->data);
+    }
+    if (prefetcher->use_uring) {
+        uring_close(&prefetcher->ring);
+    }
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->ready);
+    pthread_cond_destroy(&prefetcher->space);
+    pthread_cond_destroy(&prefetcher->budget);
+    free(prefetcher->threads);
+    free(prefetcher->slots);
+    free(prefetcher);
+}
@@ -0,0 +1,94 @@
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Files that are stat'ed, opened and read ahead of the archive writer at once
+#define PREFETCH_WINDOW 64
+// Files up to this size are read into memory by the prefetcher. Larger ones
+// are only opened, and the writer copies them with copy_member_data.
+#define PREFETCH_MAX_FILE_SIZE (64 << 10)
+// Threads used by the thread-pool engine unless asked for more
+#define PREFETCH_THREADS 8
+// Memory budget for reading ahead with more threads (-j), if none is given
+#define PREFETCH_DEFAULT_BUDGET (64 << 20)
+// With a memory budget, a file is read into memory if it takes at most this
+// share of the budget, so several are always in flight
+#define PREFETCH_BUDGET_SHARE 4
+
+// How the prefetcher issues its syscalls
+typedef enum {
+    // io_uring if the kernel allows it, the thread pool otherwise
+    IO_ENGINE_AUTO,
+    // Batches of statx, openat, read and close submitted through io_uring
+    IO_ENGINE_URING,
+    // A pool of threads making the same calls one at a time
+    IO_ENGINE_THREADS,
+    // No prefetching: the writer stats, opens and reads each file itself
+    IO_ENGINE_SYNC,
+} io_engine_t;
+
+// One input file, as handed to the archive writer
+typedef struct {
+    const char *name;
+    // Where it is stat'ed and opened: 'at_name' relative to the directory open
+    // on 'dir_fd', which is AT_FDCWD if 'at_name' is the whole name
+    int dir_fd;
+    const char *at_name;
+    // Result of stat() on the file, valid if 'error' is 0
+    struct stat stat_buf;
+    // Open descriptor for a file too large to prefetch, which the writer may
+    // take over by setting it to -1, otherwise -1
+    int fd;
+    // The whole contents of a small file, or NULL if it wasn't read
+    char *data;
+    size_t data_len;
+    size_t data_capacity;
+    // Bytes of the memory budget taken by 'data', given back on release
+    size_t reserved;
+    // errno of the first call that failed, and a description of that call
+    int error;
+    const char *failed_call;
+    // Set once the prefetcher is done with this file
+    int ready;
+} prefetched_file_t;
+
+typedef struct prefetcher prefetcher_t;
+
+/*
+ * Start prefetching the 'num_files' files named in 'names', in that order, with
+ * 'engine', which must not be IO_ENGINE_SYNC. If 'dir_fds' is not NULL, each
+ * file is found by its path_base_name() relative to the directory open on its
+ * entry, as walk_directory lists them. Both have to stay valid until the
+ * prefetcher is freed. At most two windows of files are held at any time.
+ * 'num_threads' sets the size of the thread pool, PREFETCH_THREADS if it is
+ * 1 or less; more than 1 also picks the pool over io_uring for
+ * IO_ENGINE_AUTO.
+ * If 'memory_budget' is not 0, the pool also reads files larger than
+ * PREFETCH_MAX_FILE_SIZE into memory (all but sparse ones and those over a
+ * PREFETCH_BUDGET_SHARE of the budget), and the contents held at once never
+ * add up to more than 'memory_budget' bytes. Files take their share of the
+ * budget in list order, so one the writer waits for is never held up by
+ * those behind it.
+ * Returns the new prefetcher, or NULL if an error occurred (or if
+ * IO_ENGINE_URING was asked for and io_uring is unavailable).
+ */
+prefetcher_t *prefetcher_start(const char *const *names, const int *dir_fds, size_t num_files,
+                               io_engine_t engine, int num_threads, size_t memory_budget);
+
+/*
+ * Wait for the next file, in the order of the original list, to be prefetched.
+ * The file stays valid until prefetcher_release() is called.
+ */
+prefetched_file_t *prefetcher_next(prefetcher_t *prefetcher);
+
+// Hand the file returned by the last prefetcher_next() back to the prefetcher,
+// closing its descriptor if the writer didn't take it over and giving its
+// memory back to the budget
+void prefetcher_release(prefetcher_t *prefetcher);
+
+// Stop prefetching, wait for the engine threads, and free everything
+void prefetcher_free(prefetcher_t *prefetcher);
+
+#endif
@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "minitar.h"
+#include "sparse.h"
+
+// Largest number of segments accepted from an archive's map, which keeps a
+// corrupt count from turning into a huge allocation
+#define MAX_SPARSE_SEGMENTS (1 << 24)
+
+void sparse_map_init(sparse_map_t *map) {
+    memset(map, 0, sizeof(sparse_map_t));
+}
+
+/*
+ * Appends the segment of 'length' bytes at 'offset' to 'map'.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int add_segment(sparse_map_t *map, off_t offset, off_t length) {
+    if (map->num_segments == map->capacity) {
+        size_t capacity = map->capacity == 0 ? 16 : 2 * map->capacity;
+        sparse_segment_t *bigger = realloc(map->segments, capacity * sizeof(sparse_segment_t));
+        if (bigger == NULL) {
+            return -1;
+        }
+        map->segments = bigger;
+        map->capacity = capacity;
+    }
+    map->segments[map->num_segments].offset = offset;
+    map->segments[map->num_segments].length = length;
+    map->num_segments++;
+    map->data_size += length;
+    return 0;
+}
+
+int sparse_map_find(int fd, off_t size, sparse_map_t *map) {
+    map->real_size = size;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data == -1) {
+            // No data past 'pos': the file ends in a hole
+            if (errno == ENXIO) {
+                break;
+            }
+            if (errno == EINVAL || errno == EOPNOTSUPP) {
+                sparse_map_free(map);
+                return 1;
+            }
+            return -1;
+        }
+        if (data >= size) {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1) {
+            return -1;
+        }
+        if (hole > size) {
+            hole = size;
+        }
+        if (add_segment(map, data, hole - data)) {
+            return -1;
+        }
+        pos = hole;
+    }
+    if (lseek(fd, 0, SEEK_SET) == -1) {
+        return -1;
+    }
+
+    // Like GNU tar, mark a trailing hole with an empty segment at the end
+    if (map->num_segments == 0 || pos < size) {
+        if (add_segment(map, size, 0)) {
+            return -1;
+        }
+    }
+    if (map->data_size == size) {
+        sparse_map_free(map);
+        return 1;
+    }
+    return 0;
+}
+
+size_t sparse_map_format(const sparse_map_t *map, char **text) {
+    // Each number takes at most 20 digits and a newline
+    size_t capacity = (2 * map->num_segments + 1) * 21 + BLOCK_SIZE;
+    char *buf = malloc(capacity);
+    if (buf == NULL) {
+        return 0;
+    }
+    size_t len = snprintf(buf, capacity, "%zu\n", map->num_segments);
+    for (size_t i = 0; i < map->num_segments; i++) {
+        len += snprintf(buf + len, capacity - len, "%lld\n%lld\n",
+                        (long long) map->segments[i].offset, (long long) map->segments[i].length);
+    }
+    size_t padded = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    memset(buf + len, 0, padded - len);
+    *text = buf;
+    return padded;
+}
+
+/*
+ * Parses the newline-terminated decimal number at 'text[*pos]', which has to
+ * end before 'len', and moves '*pos' past it.
+ * Returns 0 on success, 1 if the number isn't terminated before 'len', or -1
+ * if it is malformed
+ */
+static int parse_number(const char *text, size_t len, size_t *pos, long long *value) {
+    size_t i = *pos;
+    long long number = 0;
+    while (i < len && text[i] >= '0' && text[i] <= '9') {
+        if (number > (0x7fffffffffffffffLL - 9) / 10) {
+            return -1;
+        }
+        number = number * 10 + (text[i++] - '0');
+    }
+    if (i == len) {
+        return 1;
+    }
+    if (i == *pos || text[i] != '\n') {
+        return -1;
+    }
+    *pos = i + 1;
+    *value = number;
+    return 0;
+}
+
+int sparse_map_parse(const char *text, size_t len, sparse_map_t *map, size_t *map_len) {
+    map->num_segments = 0;
+    map->data_size = 0;
+    size_t pos = 0;
+    long long count;
+    int ret = parse_number(text, len, &pos, &count);
+    if (ret == 0 && count > MAX_SPARSE_SEGMENTS) {
+        ret = -1;
+    }
+    for (long long i = 0; ret == 0 && i < count; i++) {
+        long long offset;
+        long long length;
+        ret = parse_number(text, len, &pos, &offset);
+        if (ret == 0) {
+            ret = parse_number(text, len, &pos, &length);
+        }
+        if (ret == 0 && add_segment(map, offset, length)) {
+            return -1;
+        }
+    }
+    if (ret != 0) {
+        return ret;
+    }
+    *map_len = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    return 0;
+}
+
+void sparse_map_free(sparse_map_t *map) {
+    free(map->segments);
+    sparse_map_init(map);
+}
@@ -0,0 +1,56 @@
+#ifndef _SPARSE_H
+#define _SPARSE_H
+#include <stddef.h>
+#include <sys/types.h>
+
+// One run of data in a sparse file. Everything between runs is a hole.
+typedef struct {
+    off_t offset;
+    off_t length;
+} sparse_segment_t;
+
+// Where the data of a sparse file lies. In an archive, a sparse member (PAX
+// format 1.0, as GNU tar writes it) stores this map as text at the start of
+// its data, padded to a whole block, followed by the segments back to back.
+typedef struct {
+    sparse_segment_t *segments;
+    size_t num_segments;
+    size_t capacity;
+    // Full size of the file, holes included
+    off_t real_size;
+    // Combined length of every segment
+    off_t data_size;
+} sparse_map_t;
+
+// Initialize a new, empty map
+void sparse_map_init(sparse_map_t *map);
+
+/*
+ * Find the data segments of the 'size'-byte file open on 'fd' with
+ * SEEK_DATA and SEEK_HOLE. The file offset is left at 0.
+ * Returns 0 if the file has holes and 'map' describes it, 1 if it has none
+ * (or the filesystem can't tell), or -1 if an error occurred.
+ */
+int sparse_map_find(int fd, off_t size, sparse_map_t *map);
+
+/*
+ * Format 'map' as the text that starts a sparse member's data, padded with
+ * zeros to a whole number of blocks, in a new heap buffer stored in '*text'.
+ * Returns the length of the text, padding included, or 0 if memory could not
+ * be allocated.
+ */
+size_t sparse_map_format(const sparse_map_t *map, char **text);
+
+/*
+ * Parse the map at the start of a sparse member's data from the 'len' bytes
+ * at 'text', filling the empty 'map' (all but 'real_size'). On success
+ * '*map_len' is set to the length of the map, padding included.
+ * Returns 0 on success, 1 if the map continues past 'len' bytes (try again
+ * with more), or -1 if it is malformed.
+ */
+int sparse_map_parse(const char *text, size_t len, sparse_map_t *map, size_t *map_len);
+
+// Free the segments in 'map' and leave it empty
+void sparse_map_free(sparse_map_t *map);
+
+#endif
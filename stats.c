@@ -0,0 +1,236 @@
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+minitar_stats_t minitar_stats;
+stats_format_t minitar_stats_enabled = STATS_OFF;
+
+// When the run started, and the phase the calling thread is in and since
+// when. Threads other than the one that called stats_start never have a
+// start time, so their phases go untimed.
+static double run_start;
+static __thread stats_phase_t current_phase = STATS_PHASE_OTHER;
+static __thread double phase_start;
+
+static const char *const phase_names[NUM_STATS_PHASES] = {
+    [STATS_PHASE_OTHER] = "other",
+    [STATS_PHASE_WALK] = "walk",
+    [STATS_PHASE_INPUT] = "input",
+    [STATS_PHASE_NAMES] = "names",
+    [STATS_PHASE_HASH] = "hash",
+    [STATS_PHASE_DATA] = "data",
+    [STATS_PHASE_FOOTER] = "footer",
+    [STATS_PHASE_COMPRESS] = "compress",
+    [STATS_PHASE_INDEX] = "index",
+    [STATS_PHASE_SCAN] = "scan",
+    [STATS_PHASE_EXTRACT] = "extract",
+};
+
+static const char *const syscall_names[NUM_STATS_SYSCALLS] = {
+    [STATS_SYS_STAT] = "stat",
+    [STATS_SYS_OPEN] = "open",
+    [STATS_SYS_READ] = "read",
+    [STATS_SYS_WRITE] = "write",
+    [STATS_SYS_COPY] = "copy",
+    [STATS_SYS_SEEK] = "seek",
+    [STATS_SYS_TRUNCATE] = "truncate",
+    [STATS_SYS_FSYNC] = "fsync",
+    [STATS_SYS_DIRENT] = "getdents",
+    [STATS_SYS_MMAP] = "mmap",
+};
+
+// What the kernel counted for the whole process in /proc/self/io, which
+// covers every thread and every read and write minitar does not count itself
+typedef struct {
+    int valid;
+    unsigned long long read_calls;
+    unsigned long long write_calls;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+} kernel_io_t;
+
+double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+stats_phase_t stats_switch_phase(stats_phase_t phase) {
+    stats_phase_t outer = current_phase;
+    if (phase_start != 0) {
+        double now = stats_now();
+        __atomic_fetch_add(&minitar_stats.phase_ns[outer], (unsigned long long) ((now - phase_start) * 1e9),
+                           __ATOMIC_RELAXED);
+        phase_start = now;
+    }
+    current_phase = phase;
+    return outer;
+}
+
+void stats_start(void) {
+    run_start = stats_now();
+    phase_start = run_start;
+    current_phase = STATS_PHASE_OTHER;
+}
+
+/*
+ * Fills in 'io' from /proc/self/io, leaving 'io->valid' unset if the kernel
+ * doesn't provide it
+ */
+static void read_kernel_io(kernel_io_t *io) {
+    memset(io, 0, sizeof(kernel_io_t));
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return;
+    }
+    char key[32];
+    unsigned long long value;
+    int found = 0;
+    while (fscanf(file, "%31[^:]: %llu ", key, &value) == 2) {
+        if (!strcmp(key, "rchar")) {
+            io->bytes_read = value;
+            found++;
+        } else if (!strcmp(key, "wchar")) {
+            io->bytes_written = value;
+            found++;
+        } else if (!strcmp(key, "syscr")) {
+            io->read_calls = value;
+            found++;
+        } else if (!strcmp(key, "syscw")) {
+            io->write_calls = value;
+            found++;
+        }
+    }
+    fclose(file);
+    io->valid = found == 4;
+}
+
+// Rate of 'amount' per second over 'seconds', or 0 for a run too short to time
+static double per_second(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+/*
+ * Sets '*plan_seconds' to the time spent planning an extraction,
+ * '*extract_seconds' to the time spent extracting, and '*saved_seconds' to
+ * an estimate of the time the plan saved: what writing the skipped versions
+ * would have cost at the throughput achieved for the surviving ones, less
+ * the planning itself
+ */
+static void estimate_plan_savings(const minitar_stats_t *s, double *plan_seconds, double *extract_seconds,
+                                  double *saved_seconds) {
+    *plan_seconds = (s->phase_ns[STATS_PHASE_SCAN] + s->phase_ns[STATS_PHASE_INDEX]) / 1e9;
+    *extract_seconds = s->phase_ns[STATS_PHASE_EXTRACT] / 1e9;
+    double skipped_seconds = 0;
+    if (s->plan_written_bytes > 0) {
+        skipped_seconds = *extract_seconds * s->plan_skipped_bytes / s->plan_written_bytes;
+    }
+    *saved_seconds = skipped_seconds - *plan_seconds;
+}
+
+static void print_text(FILE *out, const char *operation, double wall, const kernel_io_t *io) {
+    const minitar_stats_t *s = &minitar_stats;
+    fprintf(out, "%s: %.6fs, %llu members, %llu bytes read, %llu bytes written\n", operation, wall,
+            s->members, s->bytes_read, s->bytes_written);
+    fprintf(out, "throughput: %.1f members/s, %.2f MB/s read, %.2f MB/s written\n",
+            per_second(s->members, wall), per_second(s->bytes_read / 1e6, wall),
+            per_second(s->bytes_written / 1e6, wall));
+    fprintf(out, "phases:");
+    for (int i = 0; i < NUM_STATS_PHASES; i++) {
+        if (s->phase_ns[i] > 0) {
+            fprintf(out, " %s %.6fs", phase_names[i], s->phase_ns[i] / 1e9);
+        }
+    }
+    fprintf(out, "\nsyscalls:");
+    for (int i = 0; i < NUM_STATS_SYSCALLS; i++) {
+        if (s->syscalls[i] > 0) {
+            fprintf(out, " %s %llu", syscall_names[i], s->syscalls[i]);
+        }
+    }
+    fprintf(out, "\n");
+    if (io->valid) {
+        fprintf(out, "kernel: %llu read calls, %llu write calls, %llu bytes read, %llu bytes written\n",
+                io->read_calls, io->write_calls, io->bytes_read, io->bytes_written);
+    }
+
+    if (s->plan_members > 0) {
+        double plan_seconds;
+        double extract_seconds;
+        double saved_seconds;
+        estimate_plan_savings(s, &plan_seconds, &extract_seconds, &saved_seconds);
+        fprintf(out, "extract plan: %llu members, %llu superseded versions skipped\n",
+                s->plan_members, s->plan_skipped_members);
+        fprintf(out, "extract plan: %llu bytes written, %llu bytes skipped\n",
+                s->plan_written_bytes, s->plan_skipped_bytes);
+        fprintf(out, "extract plan: planning %.6fs, extraction %.6fs, est. time saved %.6fs\n",
+                plan_seconds, extract_seconds, saved_seconds);
+    }
+    if (s->name_lookups + s->name_cache_hits > 0) {
+        fprintf(out, "owner names: %llu lookups, %llu cache hits, %.6fs looking up\n",
+                s->name_lookups, s->name_cache_hits, s->phase_ns[STATS_PHASE_NAMES] / 1e9);
+    }
+    if (s->update_files_checked > 0) {
+        fprintf(out, "update: %llu files checked, %llu changed, %llu compared by contents\n",
+                s->update_files_checked, s->update_files_changed, s->update_contents_compared);
+    }
+    if (s->dedup_links > 0) {
+        fprintf(out, "dedup: %llu files stored as links, %llu bytes not stored again\n",
+                s->dedup_links, s->dedup_bytes);
+    }
+}
+
+// Every key is always present in the JSON, so it can be scraped without
+// checking which operation produced it
+static void print_json(FILE *out, const char *operation, double wall, const kernel_io_t *io) {
+    const minitar_stats_t *s = &minitar_stats;
+    fprintf(out, "{\"operation\": \"%s\", \"wall_seconds\": %.6f, \"members\": %llu, ", operation, wall,
+            s->members);
+    fprintf(out, "\"bytes_read\": %llu, \"bytes_written\": %llu, ", s->bytes_read, s->bytes_written);
+    fprintf(out, "\"members_per_second\": %.1f, \"read_mb_per_second\": %.2f, \"write_mb_per_second\": %.2f, ",
+            per_second(s->members, wall), per_second(s->bytes_read / 1e6, wall),
+            per_second(s->bytes_written / 1e6, wall));
+    fprintf(out, "\"phase_seconds\": {");
+    for (int i = 0; i < NUM_STATS_PHASES; i++) {
+        fprintf(out, "%s\"%s\": %.6f", i > 0 ? ", " : "", phase_names[i], s->phase_ns[i] / 1e9);
+    }
+    fprintf(out, "}, \"syscalls\": {");
+    for (int i = 0; i < NUM_STATS_SYSCALLS; i++) {
+        fprintf(out, "%s\"%s\": %llu", i > 0 ? ", " : "", syscall_names[i], s->syscalls[i]);
+    }
+    fprintf(out, "}, ");
+    if (io->valid) {
+        fprintf(out, "\"kernel\": {\"read_calls\": %llu, \"write_calls\": %llu, "
+                "\"bytes_read\": %llu, \"bytes_written\": %llu}, ",
+                io->read_calls, io->write_calls, io->bytes_read, io->bytes_written);
+    } else {
+        fprintf(out, "\"kernel\": null, ");
+    }
+    double plan_seconds;
+    double extract_seconds;
+    double saved_seconds;
+    estimate_plan_savings(s, &plan_seconds, &extract_seconds, &saved_seconds);
+    fprintf(out, "\"extract_plan\": {\"members\": %llu, \"skipped_members\": %llu, "
+            "\"written_bytes\": %llu, \"skipped_bytes\": %llu, \"planning_seconds\": %.6f, "
+            "\"extract_seconds\": %.6f, \"saved_seconds\": %.6f}, ",
+            s->plan_members, s->plan_skipped_members, s->plan_written_bytes, s->plan_skipped_bytes,
+            plan_seconds, extract_seconds, saved_seconds);
+    fprintf(out, "\"owner_names\": {\"lookups\": %llu, \"cache_hits\": %llu}, ", s->name_lookups,
+            s->name_cache_hits);
+    fprintf(out, "\"update\": {\"files_checked\": %llu, \"files_changed\": %llu, \"contents_compared\": %llu}, ",
+            s->update_files_checked, s->update_files_changed, s->update_contents_compared);
+    fprintf(out, "\"dedup\": {\"links\": %llu, \"bytes\": %llu}}\n", s->dedup_links, s->dedup_bytes);
+}
+
+void stats_print(FILE *out, const char *operation) {
+    // Close out whatever phase the run ended in
+    stats_switch_phase(STATS_PHASE_OTHER);
+    double wall = stats_now() - run_start;
+    kernel_io_t io;
+    read_kernel_io(&io);
+    if (minitar_stats_enabled == STATS_JSON) {
+        print_json(out, operation, wall, &io);
+    } else {
+        print_text(out, operation, wall, &io);
+    }
+}
@@ -0,0 +1,149 @@
+#ifndef _STATS_H
+#define _STATS_H
+#include <stdio.h>
+
+// Phases a run's wall time is divided into. Phases nest (an owner name looked
+// up while writing member data, say), and time spent in an inner phase is
+// charged to it alone, so the phases add up to the whole run. Anything not
+// inside a phase is charged to STATS_PHASE_OTHER.
+typedef enum {
+    STATS_PHASE_OTHER,
+    // Walking directories given on the command line
+    STATS_PHASE_WALK,
+    // Stat'ing and opening input files, or waiting for the prefetcher to
+    STATS_PHASE_INPUT,
+    // Owner and group name lookups for headers
+    STATS_PHASE_NAMES,
+    // Hashing and comparing file contents for --dedup and update
+    STATS_PHASE_HASH,
+    // Writing headers and member data to the archive
+    STATS_PHASE_DATA,
+    // Writing the footer, truncating it away before an append, and syncing a
+    // compacted archive
+    STATS_PHASE_FOOTER,
+    // Waiting for the compressor to finish after the last member
+    STATS_PHASE_COMPRESS,
+    // Loading, building and saving the member index
+    STATS_PHASE_INDEX,
+    // Reading member headers to list, plan an extraction, update or compact
+    STATS_PHASE_SCAN,
+    // Writing extracted members
+    STATS_PHASE_EXTRACT,
+    NUM_STATS_PHASES
+} stats_phase_t;
+
+// System calls counted, each one standing for the calls like it. A request
+// through io_uring counts as the call it replaces.
+typedef enum {
+    STATS_SYS_STAT,
+    STATS_SYS_OPEN,
+    STATS_SYS_READ,
+    STATS_SYS_WRITE,
+    // copy_file_range and sendfile
+    STATS_SYS_COPY,
+    STATS_SYS_SEEK,
+    STATS_SYS_TRUNCATE,
+    STATS_SYS_FSYNC,
+    // getdents64
+    STATS_SYS_DIRENT,
+    STATS_SYS_MMAP,
+    NUM_STATS_SYSCALLS
+} stats_syscall_t;
+
+// Counters collected while minitar runs, reported with --stats. Counters are
+// updated atomically, since worker threads add to them too.
+typedef struct {
+    // Nanoseconds spent in each phase
+    unsigned long long phase_ns[NUM_STATS_PHASES];
+    unsigned long long syscalls[NUM_STATS_SYSCALLS];
+    // Bytes of files and archives read and written. Bytes copied inside the
+    // kernel count as both, archive bytes read through the mapping count as
+    // read, and with -z the archive is counted on its way into the compressor
+    // as well as on its way out
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    // Members written, extracted, listed or copied
+    unsigned long long members;
+    // Extraction planner: members seen, and superseded versions not written
+    unsigned long long plan_members;
+    unsigned long long plan_skipped_members;
+    unsigned long long plan_skipped_bytes;
+    unsigned long long plan_written_bytes;
+    // Owner and group names looked up from the system while writing headers,
+    // and names served from the cache instead
+    unsigned long long name_lookups;
+    unsigned long long name_cache_hits;
+    // Update: files compared with their latest member, those found to have
+    // changed, and those whose contents had to be read to tell
+    unsigned long long update_files_checked;
+    unsigned long long update_files_changed;
+    unsigned long long update_contents_compared;
+    // Files stored as hard links to an identical member, and the bytes of
+    // data that were not stored again because of it
+    unsigned long long dedup_links;
+    unsigned long long dedup_bytes;
+} minitar_stats_t;
+
+typedef enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+} stats_format_t;
+
+// Process-wide statistics, only filled in when 'minitar_stats_enabled' is set
+// to the format they are to be printed in
+extern minitar_stats_t minitar_stats;
+extern stats_format_t minitar_stats_enabled;
+
+// Adds 'n' to the counter 'field' of minitar_stats. With --stats off this is
+// one load and a branch that is predicted not taken.
+#define STATS_ADD(field, n)                                                              \
+    do {                                                                                 \
+        if (__builtin_expect(minitar_stats_enabled != STATS_OFF, 0)) {                   \
+            __atomic_fetch_add(&minitar_stats.field, (n), __ATOMIC_RELAXED);             \
+        }                                                                                \
+    } while (0)
+
+// Counts one system call of kind 'call' that read 'nread' and wrote 'nwritten' bytes
+#define STATS_SYSCALL(call, nread, nwritten)                                             \
+    do {                                                                                 \
+        if (__builtin_expect(minitar_stats_enabled != STATS_OFF, 0)) {                   \
+            __atomic_fetch_add(&minitar_stats.syscalls[call], 1, __ATOMIC_RELAXED);      \
+            __atomic_fetch_add(&minitar_stats.bytes_read, (nread), __ATOMIC_RELAXED);    \
+            __atomic_fetch_add(&minitar_stats.bytes_written, (nwritten), __ATOMIC_RELAXED); \
+        }                                                                                \
+    } while (0)
+
+// Current time in seconds from a monotonic clock
+double stats_now(void);
+
+// Charges the time since the last switch on this thread to the phase it was
+// in, and makes 'phase' the current one.
+// Returns the phase that was current before
+stats_phase_t stats_switch_phase(stats_phase_t phase);
+
+// Enters 'phase', returning the phase to hand back to stats_leave once it ends
+static inline stats_phase_t stats_enter(stats_phase_t phase) {
+    if (__builtin_expect(minitar_stats_enabled != STATS_OFF, 0)) {
+        return stats_switch_phase(phase);
+    }
+    return STATS_PHASE_OTHER;
+}
+
+// Leaves the current phase for 'outer', as returned by stats_enter
+static inline void stats_leave(stats_phase_t outer) {
+    if (__builtin_expect(minitar_stats_enabled != STATS_OFF, 0)) {
+        stats_switch_phase(outer);
+    }
+}
+
+// Marks the start of the run on the calling thread, whose phases are then
+// timed from here on
+void stats_start(void);
+
+// Print every statistic that was collected for the operation named
+// 'operation' to 'out', in the format --stats asked for. Only the phases of
+// the thread that called stats_start are timed.
+void stats_print(FILE *out, const char *operation);
+
+#endif
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "walk.h"
+
+// Buffer handed to each getdents64 call
+#define DIRENT_BUF_SIZE (32 << 10)
+
+typedef struct walk_dir walk_dir_t;
+
+// One entry of a directory, and its own node if it is a subdirectory
+typedef struct {
+    char *name;
+    walk_dir_t *dir;
+} walk_entry_t;
+
+// A directory found by the walk
+struct walk_dir {
+    walk_dir_t *parent;
+    // Name within the parent (or the root path) and descriptor, which stays
+    // open until every subdirectory has been opened relative to it, or for
+    // good if 'keep' is set
+    const char *name;
+    int fd;
+    int keep;
+    // Subdirectories not yet opened
+    size_t unopened_children;
+    // Entries, sorted by name once the directory has been read
+    walk_entry_t *entries;
+    size_t num_entries;
+    // Next directory on the walker's stack of directories to read
+    walk_dir_t *next_queued;
+};
+
+// State shared by the walker threads
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    // Directories waiting to be read. A stack keeps the walk depth first,
+    // which keeps few parent descriptors open at a time.
+    walk_dir_t *stack;
+    // Directories queued or being read; the walk is over when this is 0
+    size_t active;
+    // Set by the first directory that could not be read
+    int failed;
+    // Descriptors kept for the output so far, and how many may be
+    size_t num_kept;
+    size_t max_kept;
+} walker_t;
+
+// qsort comparator: entries by name
+static int compare_entries(const void *a, const void *b) {
+    const walk_entry_t *e1 = a;
+    const walk_entry_t *e2 = b;
+    return strcmp(e1->name, e2->name);
+}
+
+/*
+ * Reads every entry of the directory open on 'fd' into 'dir', sorted by name.
+ * Returns 0 on success or -1 if an error occurs
+ */
+static int read_directory(walk_dir_t *dir, int fd) {
+    char *buf = malloc(DIRENT_BUF_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    size_t capacity = 0;
+    while (1) {
+        ssize_t nbytes = getdents64(fd, buf, DIRENT_BUF_SIZE);
+        if (nbytes == -1 && errno == EINTR) {
+            continue;
+        }
+        STATS_SYSCALL(STATS_SYS_DIRENT, 0, 0);
+        if (nbytes <= 0) {
+            free(buf);
+            if (nbytes == -1) {
+                return -1;
+            }
+            break;
+        }
+        for (ssize_t pos = 0; pos < nbytes;) {
+            struct dirent64 *entry = (struct dirent64 *) (buf + pos);
+            pos += entry->d_reclen;
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+                continue;
+            }
+
+            // Only some filesystems report the type, ask the others directly
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat stat_buf;
+                STATS_SYSCALL(STATS_SYS_STAT, 0, 0);
+                if (fstatat(fd, entry->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == 0) {
+                    type = S_ISDIR(stat_buf.st_mode) ? DT_DIR : S_ISREG(stat_buf.st_mode) ? DT_REG : DT_UNKNOWN;
+                }
+            }
+            // Archives only hold regular files and directories, so symbolic
+            // links, devices and the like are left out
+            if (type != DT_DIR && type != DT_REG) {
+                continue;
+            }
+            int is_dir = type == DT_DIR;
+
+            if (dir->num_entries == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                walk_entry_t *entries = realloc(dir->entries, capacity * sizeof(walk_entry_t));
+                if (entries == NULL) {
+                    free(buf);
+                    return -1;
+                }
+                dir->entries = entries;
+            }
+            walk_entry_t *new_entry = &dir->entries[dir->num_entries];
+            new_entry->name = strdup(entry->d_name);
+            new_entry->dir = is_dir ? calloc(1, sizeof(walk_dir_t)) : NULL;
+            if (new_entry->name == NULL || (is_dir && new_entry->dir == NULL)) {
+                free(new_entry->name);
+                free(new_entry->dir);
+                free(buf);
+                return -1;
+            }
+            dir->num_entries++;
+        }
+    }
+    // An empty directory has no entries array to sort
+    if (dir->num_entries > 1) {
+        qsort(dir->entries, dir->num_entries, sizeof(walk_entry_t), compare_entries);
+    }
+    return 0;
+}
+
+/*
+ * Worker thread body: repeatedly takes a directory off the stack, opens it
+ * relative to its parent, reads it, and queues its subdirectories
+ */
+static void *walk_worker(void *arg) {
+    walker_t *walker = arg;
+    pthread_mutex_lock(&walker->lock);
+    while (1) {
+        while (walker->stack == NULL && walker->active > 0) {
+            pthread_cond_wait(&walker->work, &walker->lock);
+        }
+        if (walker->stack == NULL) {
+            break;
+        }
+        walk_dir_t *dir = walker->stack;
+        walker->stack = dir->next_queued;
+        pthread_mutex_unlock(&walker->lock);
+
+        int parent_fd = dir->parent != NULL ? dir->parent->fd : AT_FDCWD;
+        STATS_SYSCALL(STATS_SYS_OPEN, 0, 0);
+        // The root is named on the command line, so it may be a symbolic link
+        int nofollow = dir->parent != NULL ? O_NOFOLLOW : 0;
+        int fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | nofollow | O_CLOEXEC);
+        int failed = fd == -1 || read_directory(dir, fd);
+        if (failed) {
+            // Report the problem here, where the path is still easy to tell
+            char err_msg[512];
+            snprintf(err_msg, sizeof(err_msg), "Failed to read directory %s", dir->name);
+            perror(err_msg);
+        }
+
+        size_t num_subdirs = 0;
+        for (size_t i = 0; i < dir->num_entries; i++) {
+            walk_dir_t *child = dir->entries[i].dir;
+            if (child != NULL) {
+                child->parent = dir;
+                child->name = dir->entries[i].name;
+                child->fd = -1;
+                num_subdirs++;
+            }
+        }
+        pthread_mutex_lock(&walker->lock);
+        // Keep the descriptor for the entries to be opened relative to, if
+        // there is room, and otherwise only while subdirectories still need it
+        if (!failed && dir->num_entries > 0 && walker->num_kept < walker->max_kept) {
+            dir->keep = 1;
+            walker->num_kept++;
+        } else if (failed || num_subdirs == 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd = -1;
+            num_subdirs = 0;
+        }
+        dir->fd = fd;
+        dir->unopened_children = num_subdirs;
+
+        // This directory no longer needs its parent's descriptor
+        walk_dir_t *parent = dir->parent;
+        if (parent != NULL && --parent->unopened_children == 0 && !parent->keep && parent->fd != -1) {
+            close(parent->fd);
+            parent->fd = -1;
+        }
+        if (failed) {
+            walker->failed = 1;
+        } else {
+            for (size_t i = dir->num_entries; i > 0; i--) {
+                walk_dir_t *child = dir->entries[i - 1].dir;
+                if (child != NULL) {
+                    child->next_queued = walker->stack;
+                    walker->stack = child;
+                    walker->active++;
+                }
+            }
+        }
+        walker->active--;
+        pthread_cond_broadcast(&walker->work);
+    }
+    pthread_mutex_unlock(&walker->lock);
+    return NULL;
+}
+
+/*
+ * Appends 'path', in the directory open on 'dir_fd', to 'paths', taking
+ * ownership of it.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int path_list_add(path_list_t *paths, char *path, int dir_fd) {
+    if (paths->num_paths == paths->capacity) {
+        size_t capacity = paths->capacity == 0 ? 64 : paths->capacity * 2;
+        char **bigger = realloc(paths->paths, capacity * sizeof(char *));
+        if (bigger != NULL) {
+            paths->paths = bigger;
+        }
+        int *bigger_fds = realloc(paths->dir_fds, capacity * sizeof(int));
+        if (bigger_fds != NULL) {
+            paths->dir_fds = bigger_fds;
+        }
+        if (bigger == NULL || bigger_fds == NULL) {
+            free(path);
+            return -1;
+        }
+        paths->capacity = capacity;
+    }
+    paths->paths[paths->num_paths] = path;
+    paths->dir_fds[paths->num_paths] = dir_fd;
+    paths->num_paths++;
+    return 0;
+}
+
+/*
+ * Appends the contents of 'dir', whose path is 'prefix', to 'paths' in
+ * pre-order, handing the descriptors kept open over to 'paths'.
+ * Returns 0 on success or -1 if memory could not be allocated
+ */
+static int emit_paths(walk_dir_t *dir, const char *prefix, path_list_t *paths) {
+    int dir_fd = AT_FDCWD;
+    if (dir->keep) {
+        int *bigger = realloc(paths->open_fds, (paths->num_open_fds + 1) * sizeof(int));
+        if (bigger == NULL) {
+            return -1;
+        }
+        paths->open_fds = bigger;
+        paths->open_fds[paths->num_open_fds++] = dir->fd;
+        dir_fd = dir->fd;
+        dir->fd = -1;
+    }
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        const walk_entry_t *entry = &dir->entries[i];
+        char *path;
+        if (asprintf(&path, "%s/%s%s", prefix, entry->name, entry->dir ? "/" : "") == -1) {
+            return -1;
+        }
+        if (path_list_add(paths, path, dir_fd)) {
+            return -1;
+        }
+        if (entry->dir != NULL) {
+            // Use the path without its trailing slash as the prefix
+            path[strlen(path) - 1] = '\0';
+            int ret = emit_paths(entry->dir, path, paths);
+            path[strlen(path)] = '/';
+            if (ret) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Frees the entries of 'dir' and every directory below it, closing any
+ * descriptor still open
+ */
+static void free_walk_dir(walk_dir_t *dir) {
+    if (dir->fd != -1) {
+        close(dir->fd);
+    }
+    for (size_t i = 0; i < dir->num_entries; i++) {
+        if (dir->entries[i].dir != NULL) {
+            free_walk_dir(dir->entries[i].dir);
+            free(dir->entries[i].dir);
+        }
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+}
+
+int walk_directory(const char *root, path_list_t *paths) {
+    // Paths below 'root' are joined with a single slash
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        root_len--;
+    }
+    char *prefix = strndup(root, root_len);
+    walk_dir_t *top = calloc(1, sizeof(walk_dir_t));
+    if (prefix == NULL || top == NULL) {
+        perror("Error allocating directory walk");
+        free(prefix);
+        free(top);
+        return -1;
+    }
+    top->name = root;
+    top->fd = -1;
+
+    walker_t walker;
+    memset(&walker, 0, sizeof(walker));
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.work, NULL);
+    walker.stack = top;
+    walker.active = 1;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur > WALK_FD_RESERVE) {
+        walker.max_kept = limit.rlim_cur == RLIM_INFINITY ? SIZE_MAX : limit.rlim_cur - WALK_FD_RESERVE;
+    }
+
+    pthread_t threads[WALK_THREADS];
+    int started = 0;
+    for (; started < WALK_THREADS; started++) {
+        if (pthread_create(&threads[started], NULL, walk_worker, &walker)) {
+            break;
+        }
+    }
+    // With no threads at all, walk on this one
+    if (started == 0) {
+        walk_worker(&walker);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&walker.lock);
+    pthread_cond_destroy(&walker.work);
+
+    int ret = walker.failed ? -1 : 0;
+    // An empty prefix stands for "/" itself, which then joins as "/name"
+    const char *join = strcmp(prefix, "/") == 0 ? "" : prefix;
+    if (ret == 0 && emit_paths(top, join, paths)) {
+        perror("Error allocating directory walk");
+        ret = -1;
+    }
+    free_walk_dir(top);
+    free(top);
+    free(prefix);
+    if (ret == -1) {
+        path_list_free(paths);
+    }
+    return ret;
+}
+
+void path_list_free(path_list_t *paths) {
+    for (size_t i = 0; i < paths->num_paths; i++) {
+        free(paths->paths[i]);
+    }
+    for (size_t i = 0; i < paths->num_open_fds; i++) {
+        close(paths->open_fds[i]);
+    }
+    free(paths->paths);
+    free(paths->dir_fds);
+    free(paths->open_fds);
+    memset(paths, 0, sizeof(path_list_t));
+}
+
+const char *path_base_name(const char *path) {
+    size_t len = strlen(path);
+    // A directory's own trailing slash is part of its name
+    if (len > 0 && path[len - 1] == '/') {
+        len--;
+    }
+    while (len > 0 && path[len - 1] != '/') {
+        len--;
+    }
+    return path + len;
+}
@@ -0,0 +1,52 @@
+#ifndef _WALK_H
+#define _WALK_H
+#include <stddef.h>
+
+// Threads that read directories during a walk
+#define WALK_THREADS 8
+
+// Descriptors under the open-file limit that the directory descriptors kept
+// by a walk leave to the rest of the process: the walk's own, the archive,
+// and the input files held open by the prefetchers of the list being written
+// and of the walked list
+#define WALK_FD_RESERVE 512
+
+// Paths found by a directory walk, in the order they go into an archive
+typedef struct {
+    char **paths;
+    // For each path, the descriptor of the directory it is in, to find it by
+    // its path_base_name() relative to, or AT_FDCWD to use the whole path
+    int *dir_fds;
+    size_t num_paths;
+    size_t capacity;
+    // Directory descriptors kept open for 'dir_fds'
+    int *open_fds;
+    size_t num_open_fds;
+} path_list_t;
+
+/*
+ * Find everything below the directory 'root', in sorted pre-order: the
+ * entries of each directory sorted by name, every subdirectory immediately
+ * followed by its own contents. Paths start with 'root', and directory paths
+ * end in '/'. 'root' itself is not included, and neither is anything that
+ * is not a regular file or a directory.
+ * Directories are read in parallel with getdents64(), and each one is opened
+ * with openat() relative to its parent's descriptor, so no path is resolved
+ * from the top more than once. A directory's descriptor is then kept open in
+ * 'paths' for the entries in it, which the archive writer stats and opens
+ * relative to it in turn, while that leaves WALK_FD_RESERVE descriptors
+ * under the open-file limit. Entries of the directories after that are found
+ * by their whole paths. Symbolic links below 'root' are not followed.
+ * Returns 0 on success or -1 if an error occurred (the error is reported).
+ */
+int walk_directory(const char *root, path_list_t *paths);
+
+// Free every path in 'paths', close its directory descriptors, and leave it
+// empty
+void path_list_free(path_list_t *paths);
+
+// The last component of 'path' (with its trailing slash, if any), by which it
+// is found relative to the directory it is in
+const char *path_base_name(const char *path);
+
+#endif